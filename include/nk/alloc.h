@@ -30,6 +30,8 @@
 typedef struct nk_freelist_node nk_freelist_node;
 typedef struct nk_freelist_attrs nk_freelist_attrs;
 typedef struct nk_freelist nk_freelist;
+typedef struct nk_freelist_magazine nk_freelist_magazine;
+typedef struct nk_freelist_cache nk_freelist_cache;
 
 struct nk_freelist_node {
   nk_freelist_node *next;
@@ -51,6 +53,38 @@ struct nk_freelist_attrs {
   nk_freelist_alloc_func alloc_func;
   nk_freelist_free_func free_func;
   nk_freelist_zero_func zero_func;
+  // Objects per magazine, or 0 for none (see nk_freelist).
+  size_t magazine_size;
+};
+
+#define NK_FREELIST_MAGAZINE_SIZE 32
+
+// How many caches of magazines a freelist has. A system thread claims one
+// while it lives, and flushes its magazines to the depot when it exits; past
+// this many live threads, the rest share them in turn.
+#define NK_FREELIST_CACHES 16
+
+/*
+ * With magazines (after Bonwick), a freelist keeps free objects in magazines
+ * of attrs.magazine_size: each system thread allocates from and frees to the
+ * two magazines of its cache, and trades an empty one for a full one, or a
+ * full one for an empty one, with the freelist's depot only when both are
+ * empty, or both full. Without, every object goes through the freelist's
+ * lock. Either way, the freelist holds on to about attrs.max_count free
+ * objects besides those in magazines.
+ */
+
+struct nk_freelist_magazine {
+  nk_freelist_magazine *next; // in the depot.
+  size_t rounds;
+  void *objs[];
+};
+
+struct nk_freelist_cache {
+  pthread_spinlock_t lock; // only contended if system threads share a cache.
+  nk_freelist_magazine *loaded;
+  nk_freelist_magazine *previous;
+  char pad[64 - sizeof(pthread_spinlock_t) - 2 * sizeof(void *)];
 };
 
 struct nk_freelist {
@@ -58,8 +92,17 @@ struct nk_freelist {
   void *cookie;
 
   pthread_spinlock_t lock;
+  // Free objects held here, other than in caches.
   size_t count;
+  // Without magazines: the free objects.
   nk_freelist_node *freelist_head;
+  // With magazines: the depot's full and empty magazines, and the caches.
+  nk_freelist_magazine *full;
+  nk_freelist_magazine *empty;
+  nk_freelist_cache *caches;
+  // With magazines: the next on the list of all such freelists, whose caches
+  // exiting threads flush.
+  nk_freelist *next;
 };
 
 nk_status nk_freelist_init(nk_freelist *f, const nk_freelist_attrs *attrs,
@@ -68,6 +111,12 @@ void nk_freelist_destroy(nk_freelist *f);
 void *nk_freelist_alloc(nk_freelist *f);
 void nk_freelist_free(nk_freelist *f, void *p);
 
+/**
+ * Frees all but about the `keep` most recently freed objects held on the
+ * freelist. With magazines, only those in the depot are freed.
+ */
+void nk_freelist_trim(nk_freelist *f, size_t keep);
+
 #define DEFINE_SIMPLE_FREELIST_TYPE(type, count)                               \
   static nk_freelist_attrs type##_freelist_attrs = {                           \
       .node_size = sizeof(type),                                               \
@@ -76,6 +125,7 @@ void nk_freelist_free(nk_freelist *f, void *p);
       .alloc_func = NULL,                                                      \
       .free_func = NULL,                                                       \
       .zero_func = NULL,                                                       \
+      .magazine_size = NK_FREELIST_MAGAZINE_SIZE,                              \
   }
 
 #endif // __NK_ALLOC_H__
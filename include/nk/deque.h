@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __NK_DEQUE_H__
+#define __NK_DEQUE_H__
+
+#include "nk/kernel.h"
+
+/*
+ * A bounded work-stealing deque in the style of Chase and Lev: exactly one
+ * owner pushes at the bottom, and any number of consumers (including the
+ * owner) take from the top with a CAS. No locks are taken on either side.
+ *
+ * Unlike the textbook deque, the owner does *not* pop LIFO from the bottom.
+ * The scheduler relies on FIFO order so that a thread that yields goes behind
+ * everything already queued on its host-thread; a LIFO owner would re-run the
+ * yielder immediately and starve its neighbours.
+ */
+
+#define NK_DEQUE_SIZE 256 // must be a power of two.
+
+typedef struct nk_deque {
+  // Next slot to take from. Advanced by CAS by any consumer.
+  int64_t top;
+  char pad[64 - sizeof(int64_t)]; // keep owner/consumer indices apart.
+  // Next slot to push into. Written only by the owner.
+  int64_t bottom;
+  void *slots[NK_DEQUE_SIZE];
+} nk_deque;
+
+void nk_deque_init(nk_deque *d);
+
+/**
+ * Pushes an item at the bottom of the deque. Must only be called by the owner.
+ * Returns 0 if the deque is full, in which case the caller must place the item
+ * elsewhere.
+ */
+int nk_deque_push(nk_deque *d, void *item);
+
+/**
+ * Takes the item at the top of the deque, or returns NULL if the deque is
+ * empty. May be called from any thread.
+ */
+void *nk_deque_steal(nk_deque *d);
+
+/**
+ * Takes up to `max` items from the top of the deque with a single CAS, storing
+ * them in `out` in FIFO order. If `half` is set, takes at most half of the
+ * items present (rounded up), leaving the rest for other consumers. Returns
+ * the number of items taken. May be called from any thread.
+ */
+int nk_deque_steal_batch(nk_deque *d, void **out, int max, int half);
+
+/**
+ * Returns nonzero if the deque appeared empty at the time of the call.
+ */
+int nk_deque_empty(nk_deque *d);
+
+#endif // __NK_DEQUE_H__
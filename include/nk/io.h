@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __NK_IO_H__
+#define __NK_IO_H__
+
+#include "nk/kernel.h"
+#include "nk/thd.h"
+
+/*
+ * Blocking on file descriptors from green threads.
+ *
+ * Each host has an epoll instance. A thread that waits on a file descriptor
+ * registers it there (one-shot) and parks; idle host-threads poll the epoll
+ * instance before they park, and the host-thread that waits for the next
+ * timer (see nk_hostthd_park()) blocks in it rather than on a futex. Busy
+ * host-threads poll it too, now and then, if no host-thread is blocked in
+ * it. Readied threads are queued on the polling host-thread in one batch.
+ *
+ * Regular files, which epoll cannot wait on, go through an io_uring instance
+ * per host instead: a thread queues its operation on the ring and parks, and
+ * the queued operations of all threads are handed to the kernel together the
+ * next time a host-thread goes looking for work (or after a few dispatches, or
+ * once enough have piled up). The ring's descriptor sits in the epoll
+ * instance, so completions are picked up, and their threads woken, wherever
+ * descriptor readiness is. Where io_uring is unavailable (or disabled by
+ * nk_host_attrs::io_uring_entries), a small pool of helper threads runs file
+ * operations synchronously instead.
+ */
+
+#define NK_FD_READ 1
+#define NK_FD_WRITE 2
+
+/**
+ * Parks the calling thread until the file descriptor is ready for any of the
+ * given events (NK_FD_READ, NK_FD_WRITE), or has an error or hangup pending.
+ * The descriptor must support epoll (e.g., a socket or pipe, but not a regular
+ * file), and only one thread may wait on a given descriptor at a time. Must be
+ * called in thread context. Returns NK_ERR_PARAM if the descriptor cannot be
+ * waited on.
+ */
+nk_status nk_fd_wait(int fd, int events);
+
+/**
+ * Reads up to `len` bytes at `offset` in the file, parking the calling thread
+ * until done, and stores how many were read in `*done` (if not NULL); as with
+ * pread(2), that may be fewer. Must be called in thread context. Returns
+ * NK_ERR_IO, with errno set, if the read fails.
+ */
+nk_status nk_file_read(int fd, void *buf, size_t len, uint64_t offset,
+                       size_t *done);
+
+/**
+ * Writes up to `len` bytes at `offset` in the file as nk_file_read() reads
+ * them.
+ */
+nk_status nk_file_write(int fd, const void *buf, size_t len, uint64_t offset,
+                        size_t *done);
+
+/**
+ * Flushes the file to storage, parking the calling thread until done. Must be
+ * called in thread context. Returns NK_ERR_IO, with errno set, on failure.
+ */
+nk_status nk_file_fsync(int fd);
+
+// Internal only. Sets up and tears down a host's epoll instance and io_uring
+// instance (or helper pool).
+nk_status nk_io_init(nk_host *h);
+void nk_io_destroy(nk_host *h);
+
+// Internal only. Waits up to `timeout_ns` (forever if negative, not at all if
+// zero) for file descriptors to become ready, and queues the threads waiting
+// on them. Returns how many threads were woken.
+int nk_io_poll(nk_host *h, int64_t timeout_ns);
+
+// Internal only. Hands file operations queued on the ring to the kernel.
+void nk_io_submit(nk_host *h);
+
+// Internal only. Interrupts a host-thread blocked in nk_io_poll().
+void nk_io_notify(nk_host *h);
+
+#endif // __NK_IO_H__
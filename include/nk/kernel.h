@@ -34,6 +34,7 @@ typedef enum nk_status {
   NK_ERR_NOMEM,  // no memory
   NK_ERR_UNIMPL, // not implemented
   NK_ERR_NORECV, // no DPC receiver set up on port
+  NK_ERR_IO,     // I/O error; errno has the details
 } nk_status;
 
 #define NK_ALLOC(type) ((type *)calloc(sizeof(type), 1))
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __NK_MPSCQ_H__
+#define __NK_MPSCQ_H__
+
+#include "nk/kernel.h"
+#include "nk/queue.h"
+
+/*
+ * An intrusive multi-producer, single-consumer queue (after Vyukov). Producers
+ * link entries in with a single atomic exchange and never block. Entries are
+ * ordinary queue_entry links; only the `next` pointer is used while an entry is
+ * on this queue.
+ *
+ * Consumers must serialize among themselves with nk_mpscq_trylock() /
+ * nk_mpscq_unlock(); a host-thread that loses the race simply looks for work
+ * elsewhere instead of waiting.
+ */
+
+typedef struct nk_mpscq {
+  // Most recently pushed entry. Swapped atomically by producers.
+  queue_entry *head;
+  char pad[64 - sizeof(queue_entry *)]; // keep producer/consumer ends apart.
+  // Next entry to pop. Owned by whoever holds the consumer lock.
+  queue_entry *tail;
+  queue_entry stub;
+  int consumer_lock;
+} nk_mpscq;
+
+void nk_mpscq_init(nk_mpscq *q);
+
+/**
+ * Pushes an entry. Lock-free; may be called from any thread.
+ */
+void nk_mpscq_push(nk_mpscq *q, queue_entry *e);
+
+/**
+ * Pops the oldest entry, or returns NULL if the queue is empty or a producer is
+ * midway through a push. Caller must hold the consumer lock.
+ */
+queue_entry *nk_mpscq_pop(nk_mpscq *q);
+
+/**
+ * Returns nonzero if no entry was queued at the time of the call. May be
+ * called from any thread.
+ */
+int nk_mpscq_empty(nk_mpscq *q);
+
+/**
+ * Attempts to become the consumer. Returns nonzero on success.
+ */
+int nk_mpscq_trylock(nk_mpscq *q);
+void nk_mpscq_unlock(nk_mpscq *q);
+
+#endif // __NK_MPSCQ_H__
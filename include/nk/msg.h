@@ -43,6 +43,8 @@ typedef struct nk_port {
   nk_port_type type;
   nk_dpc_func dpc_func;
   void *dpc_data;
+  // Host-thread that DPCs spawned by a DPC port run on, or NK_AFFINITY_NONE.
+  int affinity;
 } nk_port;
 
 typedef struct nk_msg {
@@ -87,6 +89,13 @@ void nk_port_destroy(nk_port *port);
  */
 void nk_port_set_dpc(nk_port *port, nk_dpc_func func, void *data);
 
+/**
+ * Pins the DPCs this port spawns to the host-thread with the given index (see
+ * nk_thd_set_affinity()), or unpins them with NK_AFFINITY_NONE. Only valid for
+ * DPC ports.
+ */
+void nk_port_set_affinity(nk_port *port, int hostthd);
+
 /**
  * Send a message to a port. Never blocks. However, must be called from within
  * the context of a thread or DPC running on the receiving thread/DPC's host
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __NK_NUMA_H__
+#define __NK_NUMA_H__
+
+#include "nk/kernel.h"
+
+/*
+ * CPU and NUMA topology, for placing host-threads and their memory.
+ *
+ * Nodes are numbered densely here (0..nnodes-1), in the kernel's order,
+ * counting only nodes with CPUs the host may use; node_id[] maps them back to
+ * the kernel's node numbers. Machines with more than NK_NUMA_MAX_NODES such
+ * nodes have the extra nodes' CPUs folded into the last one.
+ */
+
+#define NK_NUMA_MAX_NODES 16
+#define NK_NUMA_MAX_CPUS 1024
+
+typedef struct nk_numa {
+  int nnodes;
+  // Kernel node number of each node.
+  int node_id[NK_NUMA_MAX_NODES];
+  // The usable CPUs, grouped by node: node N has
+  // cpus[cpu_first[N]..cpu_first[N + 1]).
+  int ncpus;
+  int cpus[NK_NUMA_MAX_CPUS];
+  int cpu_first[NK_NUMA_MAX_NODES + 1];
+} nk_numa;
+
+/**
+ * Reads the topology of the CPUs in `cpus`, a list such as "0-3,8-11", or of
+ * all CPUs the calling process may run on if `cpus` is NULL. Returns
+ * NK_ERR_PARAM if the list is malformed or names no usable CPU.
+ */
+nk_status nk_numa_init(nk_numa *numa, const char *cpus);
+
+/**
+ * Restricts the calling system thread to the CPUs of a node or, if `slot` is
+ * not negative, to the node's CPU number `slot` (modulo the node's CPU count).
+ * Returns NK_ERR_PARAM if the kernel refuses.
+ */
+nk_status nk_numa_bind_thread(const nk_numa *numa, int node, int slot);
+
+/**
+ * Asks the kernel to back the given memory from `kernel_node` (a kernel node
+ * number) where possible. Best effort: does nothing on failure.
+ */
+void nk_numa_bind_memory(void *p, size_t len, int kernel_node);
+
+#endif // __NK_NUMA_H__
@@ -68,11 +68,10 @@ typedef struct queue_entry queue_head;
                              QUEUE_ENTRY_FROM_OBJ(type, field, obj));          \
   }                                                                            \
   static void type##_##field##_unshift(queue_head *head, type *obj) {          \
-    QUEUE_INSERT_ENTRY_AFTER(head->prev,                                       \
-                             QUEUE_ENTRY_FROM_OBJ(type, field, obj));          \
+    QUEUE_INSERT_ENTRY_AFTER(head, QUEUE_ENTRY_FROM_OBJ(type, field, obj));    \
   }                                                                            \
   static void type##_##field##_push(queue_head *head, type *obj) {             \
-    QUEUE_INSERT_ENTRY_AFTER(head->next,                                       \
+    QUEUE_INSERT_ENTRY_AFTER(head->prev,                                       \
                              QUEUE_ENTRY_FROM_OBJ(type, field, obj));          \
   }                                                                            \
   static int type##_##field##_empty(queue_head *head) {                        \
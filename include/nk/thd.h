@@ -25,6 +25,10 @@
 
 #include "nk/kernel.h"
 #include "nk/queue.h"
+#include "nk/deque.h"
+#include "nk/mpscq.h"
+#include "nk/timer.h"
+#include "nk/numa.h"
 #include "nk/alloc.h"
 
 // typedefs.
@@ -33,44 +37,57 @@ typedef struct nk_thd nk_thd;
 typedef struct nk_dpc nk_dpc;
 typedef struct nk_host nk_host;
 typedef struct nk_hostthd nk_hostthd;
+typedef struct nk_group nk_group;
+typedef struct nk_shared_stack nk_shared_stack;
 
 /*
  * A note on locking/atomicity:
  *
  * The following locks exist in the system:
  *
- * - A lock on every queue in the system: the run queue and every object on
- *   which a thread can wait.
+ * - A lock on every wait queue in the system: every object on which a thread
+ *   can wait. (The run queues are lock-free: each host-thread has a
+ *   work-stealing deque, see nk/deque.h, and the global run queue is an MPSC
+ *   queue, see nk/mpscq.h.)
  *
- * - A "running lock" on each thread, locked whenever the thread's context is
- *   active. This protects against a race condition where a thread puts itself
- *   on a wait-queue, releases the lock on that wait queue, and its about to
- *   yield, but another thread intervenes and moves it back to the run-queue
- *   and it is chosen by another host thread before it yields on the host
- *   thread.
+ * - A spinlock on the host's list of parked (idle) host-threads. Enqueuers
+ *   take it only to wake a parked host-thread, and only when no host-thread is
+ *   already spinning for work.
  *
- * That's it -- there is no thread state to atomically transition, and no
- * global locking (aside from the global-ness implicit in a global run queue).
+ * - A spinlock on the host's timing wheel. Sleeping threads and delayed DPCs
+ *   take it to add their timers; host-threads take it (with a trylock) only
+ *   when the earliest deadline has passed.
+ *
+ * That's it -- there is no global locking on the scheduling path.
+ *
+ * Each thread has an atomic state word (see nk_thd_state) with these
+ * transitions:
+ *
+ *   RUNNABLE -> RUNNING   when a host thread switches to it.
+ *   RUNNING  -> PARKING   just before it places itself on a wait queue.
+ *   PARKING  -> WAITING   by whichever context resumes after it switched away.
+ *   PARKING  -> RUNNABLE  by a waker that gets there first. The waker does not
+ *                         queue the thread: the thread carries on if it has
+ *                         not switched away yet, or else the context that
+ *                         resumes queues it.
+ *   WAITING  -> RUNNABLE  by a waker, which then queues the thread.
+ *
+ * So a thread is only placed on a run queue once its context is saved, and
+ * no host thread can switch to it while it is still leaving its stack. Wakers
+ * never wait for a context switch to complete.
  *
  * Any blocking operation will atomically place its thread on a wait queue,
- * then swap context back to the host thread's scheduling context. A standard
- * cooperative yield will pass another yield code indicating "still ready to
- * run". An exit will pass a third yield code indicating "please destroy".
+ * then swap context to the next runnable thread, or back to the host thread's
+ * scheduling context if there is none. A standard cooperative yield will pass
+ * another yield code indicating "still ready to run". An exit will pass a
+ * third yield code indicating "please destroy". Whichever context resumes
+ * acts on the code on the yielding thread's behalf.
  *
  * Any agent moving a thread between queues holds only one lock at a time.
  * There is no lock order because locks are never held together.
  *
- * The running state of a given user thread lags the on-queue state: the
- * scheduler will remove it from the run queue and then eventually switch to
- * it, but the switch back may occur after the thread is placed on some queue.
- * The running lock avoids the race condition inherent in this.
- *
- * (TODO: we can fix the above, and remove the need for the running lock, by
- * passing a more descriptive status back when yielding out of a thread to the
- * scheduler: "place me on this thread-queue guarded by this lock", where one
- * option is the global run-queue, or "destroy me" when exiting. We should
- * abstract scheduler queues and use them in all synchronization objects,
- * providing "wake up one" and "wake up all" operations.)
+ * (TODO: we should abstract wait queues and use them in all synchronization
+ * objects, providing "wake up one" and "wake up all" operations.)
  */
 
 // -------------- schobs: schedulable entities. --------------
@@ -80,40 +97,168 @@ typedef enum nk_schob_type {
   NK_SCHOB_TYPE_DPC, // deferred procedure call to execute only once.
 } nk_schob_type;
 
+/*
+ * Priority levels. Lower numbers are more urgent: host-threads pick from the
+ * most urgent non-empty level, but periodically serve the levels round-robin
+ * so that less urgent work still makes progress under sustained load.
+ */
+#define NK_PRIO_LEVELS 8
+#define NK_PRIO_HIGHEST 0
+#define NK_PRIO_DEFAULT 3
+#define NK_PRIO_LOWEST (NK_PRIO_LEVELS - 1)
+
+/*
+ * Host-thread affinity. A schob may be pinned to one host-thread, by its index
+ * in the host: it is then queued only in that host-thread's inbox, which no
+ * other host-thread takes from. A soft-affine thread instead prefers the
+ * host-thread it last ran on: woken elsewhere, it is queued there, but idle
+ * host-threads may still steal it.
+ */
+#define NK_AFFINITY_NONE (-1)
+#define NK_AFFINITY_SOFT (-2)
+
 struct nk_schob {
   nk_schob_type type;
+  // Priority level; selects the run queue the schob is placed on.
+  int prio;
 
-  // on a global scheduler queue, host-thread queue, msg or sem queue, join
-  // queue, or cleanup queue.
+  // on the global scheduler queue (which uses only the `next` link), msg or
+  // sem queue, join queue, or cleanup queue. (Host-thread run queues hold
+  // pointers and do not use this link.)
   queue_entry runq;
+  // When the schob was last made runnable (CLOCK_MONOTONIC ns). Kept only
+  // by hosts in elastic mode, to measure run-queue delay.
+  uint64_t queued_at;
+  // Home NUMA node (see nk_host::nnodes): where the schob was created, and
+  // whose freelist it returns to.
+  int node;
+  // Host-thread affinity: a host-thread index, NK_AFFINITY_SOFT or
+  // NK_AFFINITY_NONE.
+  int affinity;
+  // Index of the host-thread the schob last ran on, or -1.
+  int last_ran;
+  // Scheduling group, or NULL for the host's root group.
+  nk_group *group;
 };
 
 QUEUE_DEFINE(nk_schob, runq);
 
-// Internal -- used by msg code.
+// Internal -- used by msg code. Places the schob on the calling host-thread's
+// local run queue if the caller runs on `host`, else on the global run queue.
 void nk_schob_enqueue(nk_host *host, nk_schob *schob, int new_schob);
 
+// Internal -- used by msg and sync code to wake a thread taken off a wait
+// queue. If `handoff` is set and the caller runs on `host`, the thread goes
+// into the calling host-thread's run-next slot, so that it runs there as soon
+// as the caller yields; otherwise it is enqueued as by nk_schob_enqueue(). (If
+// the thread has not finished switching away yet, it is left to that switch
+// to make it runnable.)
+void nk_thd_wakeup(nk_host *host, nk_thd *thd, int handoff);
+
+// Internal -- used by io code. Wakes `n` threads as nk_thd_wakeup() does
+// without handoff, but queues them all before signaling at most one idle
+// host-thread to come and steal some.
+void nk_thd_wakeup_batch(nk_host *host, nk_thd **thds, int n);
+
+// Internal -- used by io code. Makes sure that some parked host-thread polls
+// for timers and file descriptors while any are pending; with `retime`, also
+// sends the current poller back to recompute how it waits.
+void nk_host_kick_poller(nk_host *host, int retime);
+
 // ----------------- thds: conventional green threads. ------------
 
+// Thread states; see the note on locking above.
+typedef enum nk_thd_state {
+  NK_THD_STATE_RUNNABLE, // on a run queue (or about to be).
+  NK_THD_STATE_RUNNING,  // context active on some host thread.
+  NK_THD_STATE_PARKING,  // placed on a wait queue; still leaving its context.
+  NK_THD_STATE_WAITING,  // on a wait queue, context saved.
+} nk_thd_state;
+
+typedef void (*nk_thd_entrypoint)(nk_thd *self, void *data);
+
 struct nk_thd {
   nk_schob schob; // parent class
-  // The running-lock is necessary because some operations that block may place
-  // the thread atomically in some other queue, and some other host thread may
-  // then wake it back up and place it back on the runqueue, before the
-  // blocking thread finally leaves its context in nk_thd_yield_ext(). The lock
-  // is locked before a host thread switches to a thread and is unlocked as
-  // soon as that thread returns.
-  pthread_spinlock_t running_lock;
+  // nk_thd_state. Updated atomically.
+  int state;
+  // Stack, or NULL if the thread is yet to run on a host with lazy stacks (see
+  // nk_host_attrs::lazy_stacks); its context is then built from `entry` and
+  // `data` when it first runs.
   void *stack;
   void *stacktop;
+  nk_thd_entrypoint entry;
+  void *data;
   void *recvslot; // received msg when woken up from a port recv queue.
+  // Inside a nk_blocking_begin() section? And the spare host-thread that
+  // stands in for ours meanwhile, if any.
+  int blocking;
+  nk_hostthd *cover;
+  // Inside a nk_preempt_enable() section? Read by the preemption signal
+  // handler.
+  int preemptible;
+  // Which of the global stack freelists the stack returns to: its size class
+  // (see nk_thd_attrs), and node. And the size of its guard region.
+  int stack_class;
+  int stack_node;
+  size_t stack_guard;
+  // For nk_thd_sleep(): on the host's timing wheel until due.
+  nk_timer timer;
+  // Shared-stack mode (see nk_thd_attrs::shared_stack): set if the thread
+  // runs on a shared stack; which one, once it has first run (stack is then
+  // NULL, and stacktop points into the shared stack); and a buffer, with its
+  // capacity, that holds the live part of the stack, from stacktop up, while
+  // another thread has the shared stack. While it has a shared stack, it is
+  // on its host-thread's `shared_thds` list.
+  int copy_stack;
+  nk_shared_stack *shared;
+  void *saved;
+  size_t saved_cap;
+  queue_entry shared_link;
 };
 
-typedef void (*nk_thd_entrypoint)(nk_thd *self, void *data);
+QUEUE_DEFINE(nk_thd, shared_link);
+
+// Thread attributes. Initialize with nk_thd_attrs_init(), then change what
+// differs from the defaults.
+typedef struct nk_thd_attrs {
+  // Usable stack size, in bytes; at least NK_THD_STACK_MIN. Stacks come in
+  // size classes, the powers of two from NK_THD_STACK_CLASS_MIN to
+  // NK_THD_STACK_CLASS_MAX: a thread gets the smallest that holds both its
+  // stack and its guard, and each class has freelists of its own.
+  size_t stack_size;
+  // Size of the inaccessible region below the stack, in bytes, rounded up to
+  // whole pages; 0 for none.
+  size_t guard_size;
+  // Shared-stack mode, if set: the thread has no stack of its own, but runs
+  // on one of the few shared stacks of the host-thread it first runs on (see
+  // nk_host_attrs::shared_stacks), to which it is then pinned for good. When
+  // another thread needs that shared stack, the live part of this one's is
+  // copied out to a buffer of just that size, and back when it next runs:
+  // a thread that waits at a shallow depth costs little memory, at the price
+  // of a copy per switch. stack_size and guard_size are ignored. Memory on
+  // the stack of such a thread is in place only while it runs: no other
+  // thread may use it meanwhile, and it must not be handed to
+  // nk_file_read() or nk_file_write().
+  int shared_stack;
+} nk_thd_attrs;
+
+#define NK_THD_DEFAULT_GUARD_SIZE 4096
+// With its guard, a default stack fills a 256 KiB class.
+#define NK_THD_DEFAULT_STACK_SIZE (256 * 1024 - NK_THD_DEFAULT_GUARD_SIZE)
+// A page: room above the guard for a free stack's bookkeeping and a new
+// thread's first frame.
+#define NK_THD_STACK_MIN 4096
+#define NK_THD_STACK_CLASS_MIN (16 * 1024)
+#define NK_THD_STACK_CLASS_MAX (8 * 1024 * 1024)
+#define NK_THD_STACK_CLASSES 10 // NK_THD_STACK_CLASS_MIN .. _MAX
+
+void nk_thd_attrs_init(nk_thd_attrs *attrs);
 
 /**
  * Creates a new thread. Must only be called from within a DPC or thread
- * context.
+ * context. The thread joins the scheduling group of the thread or DPC that
+ * creates it, as it does with all the functions below that create threads
+ * and DPCs (from outside the host, the root group).
  */
 nk_status nk_thd_create(nk_thd **ret, nk_thd_entrypoint entry, void *data);
 
@@ -124,11 +269,95 @@ nk_status nk_thd_create(nk_thd **ret, nk_thd_entrypoint entry, void *data);
 nk_status nk_thd_create_ext(nk_host *host, nk_thd **ret,
                             nk_thd_entrypoint entry, void *data);
 
+/**
+ * Like nk_thd_create_ext(), but with the given attributes. Returns
+ * NK_ERR_PARAM if no stack size class holds the stack and its guard.
+ */
+nk_status nk_thd_create_ext_attrs(nk_host *host, nk_thd **ret,
+                                  nk_thd_entrypoint entry, void *data,
+                                  const nk_thd_attrs *attrs);
+
+/**
+ * Like nk_thd_create() and nk_thd_create_ext(), but with the given priority
+ * level (NK_PRIO_HIGHEST through NK_PRIO_LOWEST) rather than NK_PRIO_DEFAULT.
+ */
+nk_status nk_thd_create_prio(nk_thd **ret, nk_thd_entrypoint entry,
+                             void *data, int prio);
+nk_status nk_thd_create_ext_prio(nk_host *host, nk_thd **ret,
+                                 nk_thd_entrypoint entry, void *data,
+                                 int prio);
+
+/**
+ * Like nk_thd_create_ext(), but the thread joins the given scheduling group
+ * (of the host it is created on).
+ */
+nk_status nk_thd_create_group(nk_group *group, nk_thd **ret,
+                              nk_thd_entrypoint entry, void *data);
+
+/**
+ * Changes a thread's priority level. Takes effect the next time the thread is
+ * placed on a run queue (e.g., when it next yields or is woken).
+ */
+nk_status nk_thd_set_priority(nk_thd *thd, int prio);
+
+/**
+ * Sets a thread's host-thread affinity: the index of a host-thread (0 up to
+ * the number of workers given to nk_host_run()) to run the thread only there;
+ * NK_AFFINITY_SOFT to prefer whichever host-thread it last ran on; or
+ * NK_AFFINITY_NONE. Takes effect the next time the thread is placed on a run
+ * queue. A pinned thread waits while its host-thread is blocked in a blocking
+ * section, but runs wherever it can while its host-thread is out of service:
+ * a spare back in the pool, or an idle worker that an elastic host let go.
+ */
+nk_status nk_thd_set_affinity(nk_thd *thd, int hostthd);
+
 /**
  * Yields to the scheduler. Control may return at any time.
  */
 void nk_thd_yield();
 
+/**
+ * A cheap yield point for long-running loops: yields as nk_thd_yield() does,
+ * but only if the calling thread has used up its time slice (see
+ * nk_host_attrs::slice_ns) or more urgent work is waiting. Otherwise costs a
+ * TLS load, a timestamp-counter read and a few compares. Defined inline below.
+ * Must be called in thread context.
+ */
+static inline void nk_thd_maybe_yield();
+
+/**
+ * Puts the calling thread to sleep for at least `ns` nanoseconds, letting its
+ * host-thread run other work meanwhile. Must be called in thread context.
+ */
+void nk_thd_sleep(uint64_t ns);
+
+/**
+ * Brackets a call that may block the calling system thread, such as one into
+ * a library that does its own blocking I/O. Between nk_blocking_begin() and
+ * nk_blocking_end(), a spare host-thread, if the host has one to spare (see
+ * nk_host_attrs::blocking_spares), runs the host's other work in place of the
+ * caller's; afterwards the caller carries on on its own host-thread, and the
+ * spare goes back to the pool the next time it comes to schedule. Sections do
+ * not nest, and the thread must not yield or wait inside one. Must be called
+ * in thread context.
+ */
+void nk_blocking_begin();
+void nk_blocking_end();
+
+/**
+ * Brackets a stretch of pure computation that may run for long, on a host
+ * with preemption on (see nk_host_attrs::preempt_ns). Once the thread has run
+ * for longer than the host's preempt_ns without yielding, it is switched away
+ * from asynchronously, as if it had called nk_thd_yield() at whatever point it
+ * had reached, and carries on from there later. Between the two calls the
+ * thread must therefore neither call into nk nor take locks, nor call library
+ * code that may (such as malloc()). A thread that is already overdue when it
+ * calls nk_preempt_enable() yields there and then. Sections do not nest. Must
+ * be called in thread context.
+ */
+void nk_preempt_enable();
+void nk_preempt_disable();
+
 // Internal only.
 typedef enum {
   NK_THD_YIELD_REASON_READY,
@@ -139,6 +368,11 @@ typedef enum {
 // Internal only.
 void nk_thd_yield_ext(nk_thd_yield_reason r);
 
+// Internal only. Marks the calling thread as about to wait. Must be called
+// before the thread places itself on a wait queue and yields with
+// NK_THD_YIELD_REASON_WAITING.
+void nk_thd_prepare_wait(nk_thd *self);
+
 /**
  * Exits the thread. Control will never return.
  */
@@ -156,6 +390,11 @@ struct nk_dpc {
   nk_schob schob; // parent class
   nk_dpc_func func;
   void *data;
+  // For delayed DPCs: on the host's timing wheel until due.
+  nk_timer timer;
+  // For periodic DPCs: nanoseconds between runs. Protected by the host's
+  // timer_lock; cleared when the DPC is cancelled.
+  uint64_t period;
 };
 
 /**
@@ -172,49 +411,459 @@ nk_status nk_dpc_create(nk_dpc **ret, nk_dpc_func func, void *data);
 nk_status nk_dpc_create_ext(nk_host *h, nk_dpc **ret, nk_dpc_func func,
                             void *data);
 
+/**
+ * Like nk_dpc_create() and nk_dpc_create_ext(), but with the given priority
+ * level rather than NK_PRIO_DEFAULT.
+ */
+nk_status nk_dpc_create_prio(nk_dpc **ret, nk_dpc_func func, void *data,
+                             int prio);
+nk_status nk_dpc_create_ext_prio(nk_host *h, nk_dpc **ret, nk_dpc_func func,
+                                 void *data, int prio);
+
+/**
+ * Like nk_dpc_create() and nk_dpc_create_ext(), but the DPC runs only on the
+ * host-thread with the given index (see nk_thd_set_affinity()), or anywhere if
+ * that is NK_AFFINITY_NONE.
+ */
+nk_status nk_dpc_create_on(nk_dpc **ret, int hostthd, nk_dpc_func func,
+                           void *data);
+nk_status nk_dpc_create_ext_on(nk_host *h, nk_dpc **ret, int hostthd,
+                               nk_dpc_func func, void *data);
+
+/**
+ * Like nk_dpc_create_ext(), but the DPC joins the given scheduling group.
+ */
+nk_status nk_dpc_create_group(nk_group *group, nk_dpc **ret, nk_dpc_func func,
+                              void *data);
+
+/**
+ * Like nk_dpc_create() and nk_dpc_create_ext(), but the DPC becomes runnable
+ * only at time `when`, as given by nk_now_ns(), or `delay` nanoseconds from
+ * now. Until then it waits on the host's timing wheel, and may be cancelled.
+ */
+nk_status nk_dpc_create_at(nk_dpc **ret, uint64_t when, nk_dpc_func func,
+                           void *data);
+nk_status nk_dpc_create_after(nk_dpc **ret, uint64_t delay, nk_dpc_func func,
+                              void *data);
+nk_status nk_dpc_create_ext_at(nk_host *h, nk_dpc **ret, uint64_t when,
+                               nk_dpc_func func, void *data);
+
+/**
+ * Creates a DPC that runs every `period` nanoseconds, first `period`
+ * nanoseconds from now, until cancelled. Runs never overlap: if a run ends
+ * after the next one was due, the missed runs are skipped.
+ */
+nk_status nk_dpc_create_periodic(nk_dpc **ret, uint64_t period,
+                                 nk_dpc_func func, void *data);
+nk_status nk_dpc_create_ext_periodic(nk_host *h, nk_dpc **ret,
+                                     uint64_t period, nk_dpc_func func,
+                                     void *data);
+
+/**
+ * Cancels a delayed or periodic DPC. Returns NK_OK if it was still waiting,
+ * in which case it is destroyed and never runs. Returns NK_ERR_STATE if it
+ * was already due: it then runs (or is running), but a periodic DPC is not
+ * rescheduled. A one-shot DPC must not be cancelled once it may have run,
+ * since it is destroyed after running.
+ */
+nk_status nk_dpc_cancel(nk_dpc *dpc);
+
+/**
+ * Returns the current time, in nanoseconds, on the clock that thread sleeps
+ * and delayed DPCs use (CLOCK_MONOTONIC).
+ */
+uint64_t nk_now_ns();
+
 /**
  * Returns the current DPC context, if any, or NULL if in thread or other
  * context.
  */
 nk_dpc *nk_dpc_self(); // get the current dpc, if any.
 
+// ---------- groups: fair shares of a host among workloads. ----------
+
+/*
+ * Scheduling groups share out a host's host-threads among workloads, such as
+ * the tenants of a shared host, in proportion to their weights: however much
+ * work one group queues, the others still get their share. Every thread and
+ * DPC belongs to a group; those created without one belong to the host's root
+ * group, which is served from the ordinary run queues at no extra cost until
+ * other groups are created.
+ *
+ * Groups are picked by weighted fair queuing: each group's virtual time
+ * advances by the CPU time its threads and DPCs consume, divided by its weight,
+ * and host-threads serve the group with work that is furthest behind. A group
+ * that goes idle does not bank credit: when it has work again, it starts no
+ * further behind than the groups that kept running. Priority levels order work
+ * within a group, not across groups.
+ *
+ * Work pinned to a host-thread (see nk_thd_set_affinity()) runs as pinned,
+ * ahead of the groups' shares, but is still charged to its group.
+ */
+
+// At most this many groups per host, besides the root group.
+#define NK_GROUP_MAX 64
+// Weights run from 1 to NK_GROUP_WEIGHT_MAX; the root group starts at
+// NK_GROUP_WEIGHT_DEFAULT.
+#define NK_GROUP_WEIGHT_DEFAULT 100
+#define NK_GROUP_WEIGHT_MAX 10000
+
+struct nk_group {
+  nk_host *host;
+  // Relative share of the host. Updated atomically.
+  int weight;
+  // Run queues, one per priority level, and a bitmap of the levels that may
+  // have work, as for the host's global run queues. (The root group's work is
+  // on the host's own queues; these stay unused.)
+  nk_mpscq runq[NK_PRIO_LEVELS];
+  unsigned prio_mask;
+  // Virtual time: CPU time consumed, in nanoseconds scaled by
+  // NK_GROUP_WEIGHT_DEFAULT / weight. Updated atomically.
+  uint64_t vtime;
+  // CPU time consumed by the group's threads and DPCs while the host had
+  // groups, in nanoseconds. Updated atomically.
+  uint64_t cpu_ns;
+};
+
+/**
+ * Creates a scheduling group on the host with the given weight. Groups last
+ * as long as the host. Returns NK_ERR_NOMEM if the host has NK_GROUP_MAX
+ * groups already. May be called from any thread.
+ */
+nk_status nk_group_create(nk_host *host, nk_group **ret, int weight);
+
+/**
+ * Returns the host's root group.
+ */
+nk_group *nk_host_root_group(nk_host *host);
+
+/**
+ * Changes a group's weight. Takes effect for CPU time consumed from then on.
+ */
+nk_status nk_group_set_weight(nk_group *group, int weight);
+
+/**
+ * Returns the CPU time, in nanoseconds, that the group's threads and DPCs
+ * have consumed since the host first had groups other than the root group.
+ */
+uint64_t nk_group_cpu_ns(nk_group *group);
+
 // ---------- host threads: these run thds and dpcs. ---------------
 
+// Upper bound on nk_host_attrs::batch.
+#define NK_HOSTTHD_BATCH_MAX 64
+
 struct nk_hostthd {
   // Host that owns this thread.
   nk_host *host;
   // List of all host-threads.
   queue_entry list;
+  // Index in the host's host-thread array.
+  int index;
+  // NUMA node the host-thread runs on (see nk_host::nnodes).
+  int node;
+  // Local run queues, one per priority level. Schobs spawned or re-queued on
+  // this host-thread go here; idle host-threads steal from them.
+  nk_deque runq[NK_PRIO_LEVELS];
+  // Run-next slot: a schob woken by the running schob, run ahead of the local
+  // run queue. Other host-threads may steal it once it has waited a little
+  // while (since `runnext_since`, in CLOCK_MONOTONIC ns).
+  nk_schob *runnext;
+  uint64_t runnext_since;
+  // How many schobs in a row were taken from the run-next slot.
+  unsigned runnext_chain;
+  // Inbox: schobs pinned to this host-thread, one queue per priority level.
+  // Only this host-thread takes from it, except to evict what is left while it
+  // is out of service. `inbox_mask` marks the levels that may have work, as
+  // the host's prio_mask does for the shared queues.
+  nk_mpscq inbox[NK_PRIO_LEVELS];
+  unsigned inbox_mask;
+  // Soft-affine schobs that last ran here and were woken elsewhere, one queue
+  // per level. Open to thieves, like the local run queues.
+  nk_mpscq affine[NK_PRIO_LEVELS];
+  // Set while the host-thread is in service: neither in the spare pool nor
+  // let go by an elastic host.
+  int serving;
+  // Private batch of schobs taken from the local run queue at once, run
+  // before going back to the queues: batch[batch_pos..batch_len).
+  nk_schob *batch[NK_HOSTTHD_BATCH_MAX];
+  int batch_pos, batch_len;
+  // When the running schob started running, if the host has groups to charge
+  // it to; else zero.
+  uint64_t run_start;
+  // End of the running schob's time slice, in timestamp-counter cycles, and
+  // the priority levels more urgent than it. Read by nk_thd_maybe_yield().
+  uint64_t slice_end;
+  unsigned urgent_levels;
+  // Set by the host's preemption monitor when the running thread has not
+  // yielded for the host's preempt_ns; cleared when the host-thread next picks
+  // work. And the dispatch counter as the monitor last saw it (the monitor's
+  // own).
+  int overdue;
+  unsigned preempt_tick;
+  // Dispatch counter, used to poll the global run queue and to serve the
+  // priority levels round-robin periodically.
+  unsigned tick;
+  // Next priority level to serve on a round-robin tick.
+  unsigned prio_cursor;
+  // PRNG state for picking steal victims.
+  unsigned steal_seed;
+  // Entry in the host's idle list while parked. Protected by the host's
+  // idle_lock, as is `parked`.
+  queue_entry idle;
+  int parked;
+  // Parking word: a futex the host-thread sleeps on while parked. Cleared when
+  // parking; set to 1 by the waker that takes the host-thread off the idle
+  // list, or to NK_HOSTTHD_PARK_RETIME by a timer that is due earlier than
+  // the host-thread's timeout.
+  int park;
+  // Set while the host-thread, as the host's poller, may be blocked in the
+  // epoll instance; wakers then also signal the host's eventfd.
+  int polling;
   // running schob -- thd or dpc.
   nk_schob *running;
+  // A DPC picked by a thread switching away, to be run from the scheduler
+  // context.
+  nk_schob *stash;
+  // Set when the host-thread is to give up its work and join the host's spare
+  // pool, as the thread whose blocking section it covered has left it. Set by
+  // that thread, on another host-thread; cleared by whoever claims it.
+  int retire;
+  // Entry in the host's spare pool, and a futex the host-thread sleeps on
+  // while in it: 1 until taken out. Protected by the host's runq_mutex.
+  queue_entry spare;
+  int spare_wait;
+  // Set when the host-thread is to exit as an idle worker of an elastic
+  // host, and once it has. Its system thread is then joined, and the
+  // structure reused, when the host next needs a host-thread.
+  int exiting;
+  int exited;
+  // Set once the system thread is joined (or claimed for joining).
+  // Protected by the host's runq_mutex.
+  int joined;
   // corresponding system thread.
   pthread_t pthread;
   // system thread stack on which scheduler and dpcs run.
   void *hoststack;
+  // Free thread stacks kept here for threads created or started here, per
+  // size class, linked through the stacks themselves; and how many. Filled
+  // by threads that exit here, and refilled from and spilled to the global
+  // stack freelists of `stack_cache_node` in batches. Used only by this
+  // host-thread, or under the host's runq_mutex while it is out of service or
+  // in the spare pool.
+  void *stack_cache[NK_THD_STACK_CLASSES];
+  int stack_cache_count[NK_THD_STACK_CLASSES];
+  int stack_cache_node;
+  // Set by nk_host_trim_stacks() for the host-thread to empty its stack cache
+  // at its next scheduling point, and trim the freelists it spills to.
+  int trim_stacks;
+  // Shared stacks, nk_host_attrs::shared_stacks of them, allocated when
+  // first needed; the next to give a thread; and the threads that have one
+  // here, and how many. A host-thread with such threads stays in service, as
+  // they cannot run anywhere else.
+  nk_shared_stack *shared_stacks;
+  int next_shared_stack;
+  queue_head shared_thds;
+  int nshared;
+};
+
+// A stack that threads in shared-stack mode take turns to run on. Used only
+// by its host-thread.
+struct nk_shared_stack {
+  // NULL until first used.
+  void *stack;
+  // The thread whose stack contents are in place, or NULL.
+  nk_thd *owner;
 };
 
 QUEUE_DEFINE(nk_hostthd, list);
+QUEUE_DEFINE(nk_hostthd, idle);
+QUEUE_DEFINE(nk_hostthd, spare);
 
 // Internal use only.
 nk_hostthd *nk_hostthd_self();
 
+// Tunable host parameters, fixed when the host is created.
+typedef struct nk_host_attrs {
+  // How long (in nanoseconds) a host-thread that runs out of work keeps
+  // looking for more before it parks. Zero parks immediately.
+  uint64_t idle_spin_ns;
+  // How many schobs (at most NK_HOSTTHD_BATCH_MAX) a host-thread takes from
+  // its local run queue at once, to run DPCs back to back. One disables
+  // batching.
+  int batch;
+  // Submission queue size of the host's io_uring instance for file I/O (see
+  // nk/io.h). Zero does without io_uring.
+  unsigned io_uring_entries;
+  // How many helper threads run file I/O if there is no io_uring instance.
+  int io_helpers;
+  // How many spare host-threads at most may be started, beyond the workers
+  // given to nk_host_run(), to stand in for host-threads blocked in
+  // nk_blocking_begin() sections. Zero lets blocking calls take workers out
+  // of service.
+  int blocking_spares;
+  // Elastic mode, if max_workers is nonzero: nk_host_run() starts its
+  // `workers` (clamped to min_workers..max_workers), then adds a worker
+  // whenever a schob has waited longer than grow_delay_ns on a run queue with
+  // no worker idle, and lets workers parked for longer than shrink_idle_ns
+  // exit, down to min_workers.
+  int min_workers;
+  int max_workers;
+  uint64_t grow_delay_ns;
+  uint64_t shrink_idle_ns;
+  // Placement of host-threads on CPUs. NK_HOST_AFFINITY_NONE leaves it to
+  // the OS. NK_HOST_AFFINITY_NODE deals host-threads out to the NUMA nodes of
+  // `cpus` in turn, each free to run on its node's CPUs in `cpus`;
+  // NK_HOST_AFFINITY_CPU further pins each to one of those CPUs. Either way,
+  // threads and DPCs then keep to the node they were created on where they
+  // can: host-threads steal from their own node first, and work stolen
+  // across nodes goes back home the next time it is queued. Thread stacks
+  // come from that node's memory (other structures do not).
+  int affinity;
+  // CPUs to place host-threads on, as a list such as "0-3,8-11", or NULL for
+  // all CPUs the process may run on. Read when the host is created.
+  const char *cpus;
+  // Preemption, if nonzero: a monitor thread checks on the host-threads every
+  // preempt_ns, and a thread that has run for that long without yielding is
+  // overdue. If it is inside a nk_preempt_enable() section, its host-thread
+  // gets a SIGURG, which switches it away. The process's SIGURG handler is
+  // then nk's own.
+  uint64_t preempt_ns;
+  // Time slice, in nanoseconds: how long a thread runs before
+  // nk_thd_maybe_yield() yields.
+  uint64_t slice_ns;
+  // For threads in shared-stack mode (see nk_thd_attrs::shared_stack): how
+  // many stacks each host-thread has for them to share, and their usable
+  // size. With none, creating such a thread fails.
+  int shared_stacks;
+  size_t shared_stack_size;
+  // Lazy stacks, if set: a new thread gets no stack until it first runs, and
+  // then takes one from its host-thread's stack cache, most likely the one
+  // left by the last thread that exited there. Threads that run to
+  // completion then hold a stack only while they run, and run on a stack
+  // still warm in cache. (If no stack can be had when a thread first runs,
+  // it sleeps for a while before it tries again.)
+  int lazy_stacks;
+  // What becomes of the memory of a thread's stack when the thread exits and
+  // the stack is kept for reuse: NK_STACK_RECLAIM_NONE keeps all of it warm
+  // for the next thread; NK_STACK_RECLAIM_LAZY lets the kernel take back all
+  // but the top stack_keep_bytes if it runs short (MADV_FREE);
+  // NK_STACK_RECLAIM_EAGER gives that back at once (MADV_DONTNEED). See also
+  // nk_host_trim_stacks().
+  int stack_reclaim;
+  size_t stack_keep_bytes;
+} nk_host_attrs;
+
+#define NK_HOST_AFFINITY_NONE 0
+#define NK_HOST_AFFINITY_NODE 1
+#define NK_HOST_AFFINITY_CPU 2
+
+#define NK_STACK_RECLAIM_NONE 0
+#define NK_STACK_RECLAIM_LAZY 1
+#define NK_STACK_RECLAIM_EAGER 2
+
 // Global host context.
 struct nk_host {
-  // Global runqueue.
+  nk_host_attrs attrs;
+  // Online CPUs when the host was created.
+  int ncpus;
+  // attrs.slice_ns in timestamp-counter cycles; 0 until the counter frequency
+  // is known.
+  uint64_t slice_cycles;
+  // Size class of the shared stacks, and their size.
+  int shared_stack_class;
+  size_t shared_stack_bytes;
+  // Global runqueues, one per priority level: schobs injected from outside
+  // the host, and overflow from full local run queues. Lock-free for
+  // producers; host-threads drain them in batches.
+  nk_mpscq runq[NK_PRIO_LEVELS];
+  // Bit N set if priority level N may have runnable schobs on any run queue.
+  // Set by enqueuers; cleared by host-threads that find the level empty.
+  unsigned prio_mask;
+  // Protects the host-thread list and count below.
   pthread_mutex_t runq_mutex;
-  pthread_cond_t runq_cond;
-  queue_head runq;
-  // How many threads and DPCs exist in total?
+  // Parked host-threads, most recently parked last. Enqueuers wake one only
+  // if no host-thread is already spinning for work.
+  pthread_spinlock_t idle_lock;
+  queue_head idle_hostthds;
+  // How many host-threads are parked, and how many are spinning for work?
+  // Updated atomically; read without idle_lock by enqueuers.
+  int nparked;
+  int nspinning;
+  // Timing wheel for sleeping threads and delayed DPCs. Protected by
+  // timer_lock.
+  pthread_spinlock_t timer_lock;
+  nk_timer_wheel timers;
+  // Earliest time at which a timer may be due, or UINT64_MAX if none is
+  // pending. Written under timer_lock; polled without it.
+  uint64_t timer_next;
+  // The parked host-thread that sleeps until timer_next to expire timers, and
+  // waits for file descriptors, if any; other parked host-threads sleep until
+  // woken. Updated atomically.
+  nk_hostthd *poller;
+  // epoll instance for file-descriptor waits (see nk/io.h), and an eventfd
+  // registered in it to interrupt the poller.
+  int epfd;
+  int io_eventfd;
+  // How many threads wait on file descriptors or file operations, and is a
+  // host-thread blocked in the epoll instance? Updated atomically.
+  int io_waiters;
+  int io_blocked;
+  // io_uring instance for file I/O, or NULL if unavailable, in which case
+  // helper threads do it (both opaque; see src/io.c).
+  struct nk_io_uring *io_uring;
+  struct nk_io_helpers *io_helpers;
+  // How many file operations are queued on the ring but not yet submitted.
+  // Updated atomically.
+  int io_sq_pending;
+  // How many threads and DPCs exist in total? Updated atomically.
   int schob_count;
-  // How many host-threads exist? Protected by runq_mutex.
+  // Scheduling groups: the root group, and `ngroups` others, filled in (under
+  // runq_mutex) and read atomically. `vtime_floor` is the least virtual time
+  // of any group with work lately, which groups that were idle catch up to.
+  nk_group root_group;
+  nk_group *groups[NK_GROUP_MAX];
+  int ngroups;
+  uint64_t vtime_floor;
+  // How many host-threads exist? Protected by runq_mutex; read atomically.
   int hostthd_count;
-  // Host-thread list. Protected by hostthd_mutex.
+  // Spare host-threads not currently in service. Protected by runq_mutex;
+  // nspare_idle is read atomically.
+  queue_head spare_hostthds;
+  int nspare_idle;
+  // How many threads are inside blocking sections? Updated atomically.
+  int nblocking;
+  // Host-thread list. Protected by runq_mutex.
   queue_head hostthds;
-  // Shutdown flag. Protected under, and signaled by, runq_lock / runq_cond.
+  // Host-thread array, indexed by nk_hostthd::index, for finding steal
+  // victims, with room for as many workers as the host may run plus its
+  // spares. Slots are filled in as host-threads start, and keep exited
+  // host-threads for reuse.
+  nk_hostthd **hostthd_array;
+  int hostthd_array_len;
+  // Shutdown flag. Set atomically before all parked host-threads are woken;
+  // busy host-threads poll it.
   int shutdown;
-  // Freelists.
-  nk_freelist thd_freelist;
-  nk_freelist dpc_freelist;
+  // Set, and futex-woken, once the host is due to exit; nk_host_run() waits
+  // on it before joining host-threads.
+  int exiting;
+  // Preemption monitor thread, if the host preempts.
+  pthread_t preempt_monitor;
+  // Elastic mode: when a worker was last added, and how many were added and
+  // exited in all. Updated atomically.
+  uint64_t last_grow;
+  uint64_t grown;
+  uint64_t shrunk;
+  // CPU and NUMA topology the host-threads are placed on, or NULL if they
+  // are not placed; and how many nodes that has (1 if not placed). Schobs
+  // created from outside the host are dealt out to nodes in turn, by
+  // next_node.
+  nk_numa *numa;
+  int nnodes;
+  unsigned next_node;
+  // Freelists. Threads and DPCs have one per node.
+  nk_freelist thd_freelist[NK_NUMA_MAX_NODES];
+  nk_freelist dpc_freelist[NK_NUMA_MAX_NODES];
   nk_freelist hostthd_freelist;
   nk_freelist msg_freelist;
   nk_freelist port_freelist;
@@ -228,6 +877,15 @@ struct nk_host {
  * threads/DPCs. Multiple host contexts may exist within one program.
  */
 nk_status nk_host_create(nk_host **ret);
+/**
+ * Fills in the default host parameters.
+ */
+void nk_host_attrs_init(nk_host_attrs *attrs);
+/**
+ * Like nk_host_create(), but with the given parameters rather than the
+ * defaults.
+ */
+nk_status nk_host_create_ext(nk_host **ret, const nk_host_attrs *attrs);
 /**
  * Runs the host instance, returning after the instance is shut down.  The host
  * instance will run as long as at least one thread or DPC exists, unless
@@ -247,13 +905,98 @@ void nk_host_destroy(nk_host *host);
  */
 void nk_host_shutdown(nk_host *host);
 
+// A snapshot of a host's load, as returned by nk_host_get_stats().
+typedef struct nk_host_stats {
+  // Host-threads in service -- running, looking for work or parked -- other
+  // than those blocked in nk_blocking_begin() sections.
+  int workers;
+  // Of those, how many are parked.
+  int parked;
+  // Host-threads blocked in nk_blocking_begin() sections.
+  int blocked;
+  // Spare host-threads out of service.
+  int spares;
+  // Threads and DPCs in existence.
+  int schobs;
+  // Elastic mode: how many workers were added, and how many exited, in all.
+  uint64_t grown;
+  uint64_t shrunk;
+  // Thread stacks, process-wide: bytes of address space reserved for them;
+  // and bytes of that handed out as stacks, to threads or to the caches that
+  // keep free stacks for reuse, less what has been given back to the kernel
+  // since (see nk_host_attrs::stack_reclaim).
+  size_t stack_reserved;
+  size_t stack_committed;
+} nk_host_stats;
+
+/**
+ * Takes a snapshot of the host's load. May be called from any thread; the
+ * fields are read one by one, so need not be exactly consistent with each
+ * other.
+ */
+void nk_host_get_stats(nk_host *host, nk_host_stats *stats);
+
+/**
+ * Gives the memory of all free thread stacks, kept for reuse, back to the
+ * kernel; e.g., under memory pressure, or once a load spike is over. The
+ * global caches of free stacks are shared by all hosts, and trimmed at once;
+ * those of the host's running host-threads are trimmed at each one's next
+ * scheduling point. May be called from any thread.
+ */
+void nk_host_trim_stacks(nk_host *host);
+
 // --------------- arch-specific stuff. ------------------
 
-// Returns new top-of-stack.
+// What the side that resumes after a context switch learns: why the previous
+// context switched away, and which thread it was (NULL for a host-thread's
+// scheduler context).
+typedef struct nk_arch_switch_ret {
+  nk_thd_yield_reason reason;
+  nk_thd *prev;
+} nk_arch_switch_ret;
+
+// Returns new top-of-stack. `entry` receives the result of the switch that
+// first runs the new context.
 void *nk_arch_create_ctx(void *stacktop,
-                         void (*entry)(void *data1, void *data2, void *data3),
+                         void (*entry)(void *data1, void *data2, void *data3,
+                                       nk_arch_switch_ret ret),
                          void *data1, void *data2, void *data3);
-nk_thd_yield_reason nk_arch_switch_ctx(void **fromstack, void *tostack,
-                                       nk_thd_yield_reason r);
+nk_arch_switch_ret nk_arch_switch_ctx(void **fromstack, void *tostack,
+                                      nk_thd_yield_reason r, nk_thd *prev);
+
+// Reads the timestamp counter.
+static inline uint64_t nk_arch_cycles() {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+// The calling system thread's host-thread, as nk_hostthd_self() returns, read
+// straight from TLS. The asm is volatile so that the compiler cannot reuse one
+// system thread's TLS address after the calling thread switched away and
+// resumed on another.
+extern __thread nk_hostthd *nk_hostthd_current
+    __attribute__((tls_model("initial-exec")));
+
+static inline nk_hostthd *nk_arch_hostthd_self() {
+  nk_hostthd *h;
+  __asm__ volatile("movq nk_hostthd_current@gottpoff(%%rip), %0\n\t"
+                   "movq %%fs:(%0), %0"
+                   : "=r"(h));
+  return h;
+}
+
+// --------------- inline yield points. ------------------
+
+static inline void nk_thd_maybe_yield() {
+  nk_hostthd *h = nk_arch_hostthd_self();
+  unsigned waiting = __atomic_load_n(&h->host->prio_mask, __ATOMIC_RELAXED) |
+                     __atomic_load_n(&h->inbox_mask, __ATOMIC_RELAXED);
+  if (__builtin_expect(nk_arch_cycles() >= h->slice_end ||
+                           (waiting & h->urgent_levels),
+                       0)) {
+    nk_thd_yield();
+  }
+}
 
 #endif // __NK_THD_H__
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __NK_TIMER_H__
+#define __NK_TIMER_H__
+
+#include "nk/kernel.h"
+#include "nk/queue.h"
+
+/*
+ * A hierarchical timing wheel in the style of Varghese and Lauck: timers are
+ * hashed by deadline into NK_TIMER_LEVELS wheels of NK_TIMER_SLOTS slots each,
+ * where a slot on level N spans NK_TIMER_SLOTS^N ticks. As time advances,
+ * the slots of higher levels are cascaded down into lower ones, so that adding
+ * and removing a timer are O(1) and expiring them costs O(1) per timer. A
+ * bitmap per level lets idle stretches be skipped quickly and the next
+ * deadline be found without scanning slots.
+ *
+ * Deadlines are in nanoseconds on the nk_now_ns() clock. Timers expire at tick
+ * granularity, never early. The wheel itself is not thread-safe.
+ */
+
+#define NK_TIMER_TICK_SHIFT 16 // a tick is 2^16 ns, about 65 us.
+#define NK_TIMER_LEVEL_BITS 6
+#define NK_TIMER_SLOTS (1 << NK_TIMER_LEVEL_BITS)
+// Five levels span 2^30 ticks, or about 19 hours. Later deadlines wait in the
+// top level and are re-hashed each time it comes round.
+#define NK_TIMER_LEVELS 5
+
+typedef struct nk_timer {
+  // In a wheel slot while pending; in the caller's list once expired.
+  queue_entry link;
+  // When the timer expires.
+  uint64_t deadline;
+  // For the wheel's user: what to do when the timer expires.
+  void *owner;
+  // Set while on the wheel, in slots[level][index].
+  int pending;
+  int level, index;
+} nk_timer;
+
+QUEUE_DEFINE(nk_timer, link);
+
+typedef struct nk_timer_wheel {
+  // Next tick to process: every timer due before it has expired.
+  uint64_t tick;
+  // How many timers are pending.
+  int count;
+  // Bit N of occupied[L] is set if slots[L][N] is non-empty.
+  uint64_t occupied[NK_TIMER_LEVELS];
+  queue_head slots[NK_TIMER_LEVELS][NK_TIMER_SLOTS];
+} nk_timer_wheel;
+
+/**
+ * Initializes an empty wheel, with time starting at `now`.
+ */
+void nk_timer_wheel_init(nk_timer_wheel *w, uint64_t now);
+
+/**
+ * Adds a timer with its `deadline` set. Returns 0, without adding it, if the
+ * timer is already due, in which case the caller should act on it directly.
+ */
+int nk_timer_wheel_add(nk_timer_wheel *w, nk_timer *t);
+
+/**
+ * Removes a pending timer.
+ */
+void nk_timer_wheel_remove(nk_timer_wheel *w, nk_timer *t);
+
+/**
+ * Advances the wheel to `now`, moving every timer that is due onto `expired`
+ * in deadline order (to tick granularity).
+ */
+void nk_timer_wheel_advance(nk_timer_wheel *w, uint64_t now,
+                            queue_head *expired);
+
+/**
+ * Returns the earliest time at which nk_timer_wheel_advance() may find work --
+ * a deadline, or a cascade of a higher level -- or UINT64_MAX if the wheel is
+ * empty.
+ */
+uint64_t nk_timer_wheel_next(nk_timer_wheel *w);
+
+/**
+ * Moves every pending timer onto `out`, emptying the wheel.
+ */
+void nk_timer_wheel_drain(nk_timer_wheel *w, queue_head *out);
+
+#endif // __NK_TIMER_H__
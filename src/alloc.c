@@ -46,6 +46,92 @@ static void nk_freelist_zero_default(const nk_freelist_attrs *attrs,
 #define FREELIST_NODE_FROM_OBJ(f, obj)                                         \
   ((void *)((char *)(obj) + (f)->attrs.freelist_header_offset))
 
+// Which cache of each freelist the calling system thread uses, or -1 until
+// it first needs one.
+static __thread int nk_freelist_cache_index = -1;
+// Global: the cache indices claimed by live threads, one bit each; and the
+// next to share once all are claimed.
+static unsigned nk_freelist_cache_claimed;
+static int nk_freelist_next_cache_index;
+// Global: the freelists with magazines. Protected by nk_freelist_list_mutex.
+static nk_freelist *nk_freelist_list;
+static pthread_mutex_t nk_freelist_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Holds a claimed cache index, plus one, for nk_freelist_cache_release().
+static pthread_key_t nk_freelist_cache_key;
+static pthread_once_t nk_freelist_cache_key_once = PTHREAD_ONCE_INIT;
+
+static void nk_freelist_cache_flush(nk_freelist *f, nk_freelist_cache *c);
+
+// Runs when a thread that claimed a cache index exits: moves what its caches
+// hold to the depots, and gives the index up.
+static void nk_freelist_cache_release(void *data) {
+  int i = (int)(intptr_t)data - 1;
+  pthread_mutex_lock(&nk_freelist_list_mutex);
+  for (nk_freelist *f = nk_freelist_list; f; f = f->next) {
+    nk_freelist_cache *c = &f->caches[i];
+    pthread_spin_lock(&c->lock);
+    nk_freelist_cache_flush(f, c);
+    pthread_spin_unlock(&c->lock);
+  }
+  pthread_mutex_unlock(&nk_freelist_list_mutex);
+  nk_freelist_cache_index = -1;
+  __atomic_and_fetch(&nk_freelist_cache_claimed, ~(1u << i), __ATOMIC_RELEASE);
+}
+
+static void setup_nk_freelist_cache_key() {
+  pthread_key_create(&nk_freelist_cache_key, nk_freelist_cache_release);
+}
+
+// Claims a cache index for the calling thread, for as long as it lives; or,
+// if all are claimed, picks one to share.
+static int nk_freelist_claim_cache_index() {
+  pthread_once(&nk_freelist_cache_key_once, setup_nk_freelist_cache_key);
+  unsigned all = (1u << NK_FREELIST_CACHES) - 1;
+  unsigned claimed = __atomic_load_n(&nk_freelist_cache_claimed,
+                                     __ATOMIC_RELAXED);
+  while (claimed != all) {
+    int i = __builtin_ctz(~claimed);
+    if (__atomic_compare_exchange_n(&nk_freelist_cache_claimed, &claimed,
+                                    claimed | (1u << i), /* weak = */ 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      if (!pthread_setspecific(nk_freelist_cache_key,
+                               (void *)(intptr_t)(i + 1))) {
+        return i;
+      }
+      // It could not be given up on exit: share one instead.
+      __atomic_and_fetch(&nk_freelist_cache_claimed, ~(1u << i),
+                         __ATOMIC_RELEASE);
+      break;
+    }
+  }
+  return __atomic_fetch_add(&nk_freelist_next_cache_index, 1,
+                            __ATOMIC_RELAXED) %
+         NK_FREELIST_CACHES;
+}
+
+static nk_freelist_cache *nk_freelist_my_cache(nk_freelist *f) {
+  int i = nk_freelist_cache_index;
+  if (i < 0) {
+    i = nk_freelist_claim_cache_index();
+    nk_freelist_cache_index = i;
+  }
+  return &f->caches[i];
+}
+
+static nk_freelist_magazine *nk_freelist_magazine_alloc(nk_freelist *f) {
+  return NK_ALLOCBYTES(nk_freelist_magazine,
+                       sizeof(nk_freelist_magazine) +
+                           f->attrs.magazine_size * sizeof(void *));
+}
+
+// Frees the objects in a magazine, leaving it empty.
+static void nk_freelist_magazine_empty(nk_freelist *f,
+                                       nk_freelist_magazine *m) {
+  while (m->rounds > 0) {
+    f->attrs.free_func(&f->attrs, f->cookie, m->objs[--m->rounds]);
+  }
+}
+
 nk_status nk_freelist_init(nk_freelist *f, const nk_freelist_attrs *attrs,
                            void *cookie) {
   if (pthread_spin_init(&f->lock, PTHREAD_PROCESS_PRIVATE)) {
@@ -66,6 +152,33 @@ nk_status nk_freelist_init(nk_freelist *f, const nk_freelist_attrs *attrs,
 
   f->count = 0;
   f->freelist_head = NULL;
+  f->full = NULL;
+  f->empty = NULL;
+  f->caches = NULL;
+  f->next = NULL;
+
+  if (f->attrs.magazine_size) {
+    // (Each cache gets its magazines when first used.)
+    f->caches = NK_ALLOCN(nk_freelist_cache, NK_FREELIST_CACHES);
+    if (!f->caches) {
+      pthread_spin_destroy(&f->lock);
+      return NK_ERR_NOMEM;
+    }
+    for (int i = 0; i < NK_FREELIST_CACHES; i++) {
+      if (pthread_spin_init(&f->caches[i].lock, PTHREAD_PROCESS_PRIVATE)) {
+        while (i-- > 0) {
+          pthread_spin_destroy(&f->caches[i].lock);
+        }
+        NK_FREE(f->caches);
+        pthread_spin_destroy(&f->lock);
+        return NK_ERR_NOMEM;
+      }
+    }
+    pthread_mutex_lock(&nk_freelist_list_mutex);
+    f->next = nk_freelist_list;
+    nk_freelist_list = f;
+    pthread_mutex_unlock(&nk_freelist_list_mutex);
+  }
 
   return NK_OK;
 }
@@ -75,12 +188,169 @@ void nk_freelist_destroy(nk_freelist *f) {
     next = n->next;
     f->attrs.free_func(&f->attrs, f->cookie, FREELIST_OBJ_FROM_NODE(f, n));
   }
+  if (f->caches) {
+    pthread_mutex_lock(&nk_freelist_list_mutex);
+    nk_freelist **link = &nk_freelist_list;
+    while (*link != f) {
+      link = &(*link)->next;
+    }
+    *link = f->next;
+    pthread_mutex_unlock(&nk_freelist_list_mutex);
+    for (int i = 0; i < NK_FREELIST_CACHES; i++) {
+      nk_freelist_cache *c = &f->caches[i];
+      if (c->loaded) {
+        nk_freelist_magazine_empty(f, c->loaded);
+        nk_freelist_magazine_empty(f, c->previous);
+        NK_FREE(c->loaded);
+        NK_FREE(c->previous);
+      }
+      pthread_spin_destroy(&c->lock);
+    }
+    NK_FREE(f->caches);
+  }
+  for (nk_freelist_magazine *m = f->full, *next = NULL; m; m = next) {
+    next = m->next;
+    nk_freelist_magazine_empty(f, m);
+    NK_FREE(m);
+  }
+  for (nk_freelist_magazine *m = f->empty, *next = NULL; m; m = next) {
+    next = m->next;
+    NK_FREE(m);
+  }
   pthread_spin_destroy(&f->lock);
 }
 
+// Gives a cache its two magazines, if it has none yet. Returns 0 if they
+// cannot be had. Called with the cache's lock held.
+static int nk_freelist_cache_load(nk_freelist *f, nk_freelist_cache *c) {
+  if (c->loaded) {
+    return 1;
+  }
+  nk_freelist_magazine *loaded = nk_freelist_magazine_alloc(f);
+  nk_freelist_magazine *previous = nk_freelist_magazine_alloc(f);
+  if (!loaded || !previous) {
+    NK_FREE(loaded);
+    NK_FREE(previous);
+    return 0;
+  }
+  c->loaded = loaded;
+  c->previous = previous;
+  return 1;
+}
+
+// Moves a cache's magazines to the depot, leaving it none until next used (see
+// nk_freelist_cache_load()). Objects past the depot's max_count are freed.
+// Called with the cache's lock held.
+static void nk_freelist_cache_flush(nk_freelist *f, nk_freelist_cache *c) {
+  nk_freelist_magazine *mags[2] = {c->loaded, c->previous};
+  c->loaded = NULL;
+  c->previous = NULL;
+  for (int i = 0; i < 2; i++) {
+    nk_freelist_magazine *m = mags[i];
+    if (!m) {
+      continue;
+    }
+    pthread_spin_lock(&f->lock);
+    int room = m->rounds && f->count + m->rounds <= f->attrs.max_count;
+    if (room) {
+      m->next = f->full;
+      f->full = m;
+      f->count += m->rounds;
+    }
+    pthread_spin_unlock(&f->lock);
+    if (room) {
+      continue;
+    }
+    nk_freelist_magazine_empty(f, m);
+    pthread_spin_lock(&f->lock);
+    m->next = f->empty;
+    f->empty = m;
+    pthread_spin_unlock(&f->lock);
+  }
+}
+
+// Takes an object from a cache's magazines, trading an empty one for a full
+// one from the depot if both are empty. Returns NULL if the depot has none.
+// Called with the cache's lock held.
+static void *nk_freelist_cache_alloc(nk_freelist *f, nk_freelist_cache *c) {
+  if (c->loaded->rounds == 0) {
+    if (c->previous->rounds == 0) {
+      pthread_spin_lock(&f->lock);
+      nk_freelist_magazine *full = f->full;
+      if (full) {
+        f->full = full->next;
+        f->count -= full->rounds;
+        c->previous->next = f->empty;
+        f->empty = c->previous;
+      }
+      pthread_spin_unlock(&f->lock);
+      if (!full) {
+        return NULL;
+      }
+      c->previous = full;
+    }
+    nk_freelist_magazine *m = c->loaded;
+    c->loaded = c->previous;
+    c->previous = m;
+  }
+  return c->loaded->objs[--c->loaded->rounds];
+}
+
+// Puts an object in a cache's magazines, trading a full one for an empty one
+// from the depot if both are full. If the depot is full itself, or no empty
+// magazine can be had, the full one's objects are freed instead. Called with
+// the cache's lock held.
+static void nk_freelist_cache_free(nk_freelist *f, nk_freelist_cache *c,
+                                   void *p) {
+  if (c->loaded->rounds == f->attrs.magazine_size) {
+    if (c->previous->rounds == f->attrs.magazine_size) {
+      nk_freelist_magazine *full = c->previous;
+      pthread_spin_lock(&f->lock);
+      int room = f->count + full->rounds <= f->attrs.max_count;
+      nk_freelist_magazine *empty = room ? f->empty : NULL;
+      if (empty) {
+        f->empty = empty->next;
+      }
+      pthread_spin_unlock(&f->lock);
+      if (room && !empty) {
+        empty = nk_freelist_magazine_alloc(f);
+      }
+      if (empty) {
+        pthread_spin_lock(&f->lock);
+        full->next = f->full;
+        f->full = full;
+        f->count += full->rounds;
+        pthread_spin_unlock(&f->lock);
+        c->previous = empty;
+      } else {
+        nk_freelist_magazine_empty(f, full);
+      }
+    }
+    nk_freelist_magazine *m = c->loaded;
+    c->loaded = c->previous;
+    c->previous = m;
+  }
+  c->loaded->objs[c->loaded->rounds++] = p;
+}
+
 void *nk_freelist_alloc(nk_freelist *f) {
+  if (f->caches) {
+    nk_freelist_cache *c = nk_freelist_my_cache(f);
+    pthread_spin_lock(&c->lock);
+    if (nk_freelist_cache_load(f, c)) {
+      void *obj = nk_freelist_cache_alloc(f, c);
+      pthread_spin_unlock(&c->lock);
+      if (obj) {
+        f->attrs.zero_func(&f->attrs, f->cookie, obj);
+        return obj;
+      }
+      return f->attrs.alloc_func(&f->attrs, f->cookie);
+    }
+    pthread_spin_unlock(&c->lock);
+  }
+
   pthread_spin_lock(&f->lock);
-  if (f->count > 0) {
+  if (f->freelist_head) {
     nk_freelist_node *n = f->freelist_head;
     f->freelist_head = n->next;
     f->count--;
@@ -95,6 +365,17 @@ void *nk_freelist_alloc(nk_freelist *f) {
 }
 
 void nk_freelist_free(nk_freelist *f, void *p) {
+  if (f->caches) {
+    nk_freelist_cache *c = nk_freelist_my_cache(f);
+    pthread_spin_lock(&c->lock);
+    if (nk_freelist_cache_load(f, c)) {
+      nk_freelist_cache_free(f, c, p);
+      pthread_spin_unlock(&c->lock);
+      return;
+    }
+    pthread_spin_unlock(&c->lock);
+  }
+
   size_t max_count = f->attrs.max_count;
   pthread_spin_lock(&f->lock);
   if (f->count >= max_count) {
@@ -108,3 +389,32 @@ void nk_freelist_free(nk_freelist *f, void *p) {
     pthread_spin_unlock(&f->lock);
   }
 }
+
+void nk_freelist_trim(nk_freelist *f, size_t keep) {
+  pthread_spin_lock(&f->lock);
+  size_t kept = 0;
+  nk_freelist_node **link = &f->freelist_head;
+  for (; kept < keep && *link; kept++) {
+    link = &(*link)->next;
+  }
+  nk_freelist_node *n = *link;
+  *link = NULL;
+  // (Whole magazines are kept, or not.)
+  nk_freelist_magazine **mlink = &f->full;
+  for (; kept < keep && *mlink; mlink = &(*mlink)->next) {
+    kept += (*mlink)->rounds;
+  }
+  nk_freelist_magazine *m = *mlink;
+  *mlink = NULL;
+  f->count = kept;
+  pthread_spin_unlock(&f->lock);
+  for (nk_freelist_node *next = NULL; n; n = next) {
+    next = n->next;
+    f->attrs.free_func(&f->attrs, f->cookie, FREELIST_OBJ_FROM_NODE(f, n));
+  }
+  for (nk_freelist_magazine *next = NULL; m; m = next) {
+    next = m->next;
+    nk_freelist_magazine_empty(f, m);
+    NK_FREE(m);
+  }
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "nk/deque.h"
+
+#define NK_DEQUE_MASK (NK_DEQUE_SIZE - 1)
+
+void nk_deque_init(nk_deque *d) {
+  d->top = 0;
+  d->bottom = 0;
+}
+
+int nk_deque_push(nk_deque *d, void *item) {
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  if (b - t >= NK_DEQUE_SIZE) {
+    return 0;
+  }
+  __atomic_store_n(&d->slots[b & NK_DEQUE_MASK], item, __ATOMIC_RELAXED);
+  // Publish the slot before the new bottom index.
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void *nk_deque_steal(nk_deque *d) {
+  while (1) {
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) {
+      return NULL;
+    }
+    // The slot may be overwritten by the owner once `top` moves past it, but
+    // in that case our CAS below fails and we retry with a fresh index.
+    void *item =
+        __atomic_load_n(&d->slots[t & NK_DEQUE_MASK], __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&d->top, &t, t + 1, /* weak = */ 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      return item;
+    }
+  }
+}
+
+int nk_deque_steal_batch(nk_deque *d, void **out, int max, int half) {
+  while (1) {
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    int64_t n = b - t;
+    if (n <= 0) {
+      return 0;
+    }
+    if (half) {
+      n = (n + 1) / 2;
+    }
+    if (n > max) {
+      n = max;
+    }
+    // As in nk_deque_steal(): the owner only overwrites slots that are
+    // already taken, so if the CAS succeeds, what we copied is what we took.
+    for (int64_t i = 0; i < n; i++) {
+      out[i] = __atomic_load_n(&d->slots[(t + i) & NK_DEQUE_MASK],
+                               __ATOMIC_RELAXED);
+    }
+    if (__atomic_compare_exchange_n(&d->top, &t, t + n, /* weak = */ 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      return (int)n;
+    }
+  }
+}
+
+int nk_deque_empty(nk_deque *d) {
+  int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  return t >= b;
+}
@@ -0,0 +1,593 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "nk/io.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// How many events one poll takes from the epoll instance at most.
+#define NK_IO_POLL_BATCH 64
+
+// The largest transfer one file operation asks for; longer ones come back
+// short, as they may from read(2) and write(2).
+#define NK_IO_MAX_LEN (1u << 30)
+
+// A file operation. Lives on the calling thread's stack until the thread is
+// woken with the result -- or on the heap, for a thread in shared-stack mode,
+// whose stack may not be in place meanwhile.
+typedef struct nk_io_req {
+  // On the helper pool's queue, if there is no ring.
+  queue_entry link;
+  nk_thd *thd;
+  // IORING_OP_READ, IORING_OP_WRITE or IORING_OP_FSYNC.
+  int op;
+  int fd;
+  void *buf;
+  size_t len;
+  uint64_t offset;
+  // Bytes transferred, or a negated errno.
+  int64_t res;
+} nk_io_req;
+
+QUEUE_DEFINE(nk_io_req, link);
+
+// A host's io_uring instance. The submission queue is filled under sq_lock by
+// threads about to park, and handed to the kernel in batches by whichever
+// host-thread gets to nk_io_submit() first; completions are reaped by
+// nk_io_poll(), under cq_lock, when the ring's descriptor polls ready in the
+// epoll instance.
+struct nk_io_uring {
+  int fd;
+  void *ring;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  pthread_spinlock_t sq_lock;
+  unsigned sq_entries;
+  unsigned sq_mask;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  pthread_spinlock_t cq_lock;
+  unsigned cq_entries;
+  unsigned cq_mask;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  struct io_uring_cqe *cqes;
+  // Operations submitted and not yet reaped, kept within cq_entries so that
+  // the completion queue cannot overflow. Protected by sq_lock; decremented
+  // atomically by reapers.
+  unsigned inflight;
+};
+
+// Fallback when io_uring is unavailable: a few system threads that run file
+// operations synchronously and wake their callers.
+struct nk_io_helpers {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  queue_head reqs;
+  int stop;
+  int count;
+  pthread_t threads[];
+};
+
+// Does the ring support all the operations we submit? READ and WRITE came in
+// 5.6, after the ring itself; so did the probe, so a failed probe means no.
+static int nk_io_uring_probe(int fd) {
+  static const int ops[] = {IORING_OP_READ, IORING_OP_WRITE,
+                            IORING_OP_FSYNC};
+  int nops = 256;
+  struct io_uring_probe *probe = NK_ALLOCBYTES(
+      struct io_uring_probe,
+      sizeof(*probe) + nops * sizeof(struct io_uring_probe_op));
+  if (!probe) {
+    return 0;
+  }
+  int ok = !syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                    nops);
+  for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+    ok = ops[i] < probe->ops_len &&
+         (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  NK_FREE(probe);
+  return ok;
+}
+
+static struct nk_io_uring *nk_io_uring_create(nk_host *h, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(SYS_io_uring_setup, entries, &p);
+  if (fd < 0) {
+    goto err;
+  }
+  // Kernels older than 5.4 map the two rings separately; not worth
+  // supporting when the helper pool works there.
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !nk_io_uring_probe(fd)) {
+    goto err2;
+  }
+  struct nk_io_uring *u = NK_ALLOC(struct nk_io_uring);
+  if (!u) {
+    goto err2;
+  }
+  u->fd = fd;
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (u->ring == MAP_FAILED) {
+    goto err3;
+  }
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    goto err4;
+  }
+  char *ring = u->ring;
+  u->sq_entries = p.sq_entries;
+  u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+  u->sq_head = (unsigned *)(ring + p.sq_off.head);
+  u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+  u->sq_array = (unsigned *)(ring + p.sq_off.array);
+  u->cq_entries = p.cq_entries;
+  u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+  u->cq_head = (unsigned *)(ring + p.cq_off.head);
+  u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+  u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+  // Submission slots are used in ring order, so the indirection array is
+  // the identity.
+  for (unsigned i = 0; i < u->sq_entries; i++) {
+    u->sq_array[i] = i;
+  }
+  pthread_spin_init(&u->sq_lock, PTHREAD_PROCESS_PRIVATE);
+  pthread_spin_init(&u->cq_lock, PTHREAD_PROCESS_PRIVATE);
+  // Level-triggered like the eventfd; told apart by its pointer.
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = u};
+  if (epoll_ctl(h->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    goto err5;
+  }
+  return u;
+
+err5:
+  pthread_spin_destroy(&u->cq_lock);
+  pthread_spin_destroy(&u->sq_lock);
+  munmap(u->sqes, u->sqes_size);
+err4:
+  munmap(u->ring, u->ring_size);
+err3:
+  NK_FREE(u);
+err2:
+  close(fd);
+err:
+  return NULL;
+}
+
+static void nk_io_uring_destroy(struct nk_io_uring *u) {
+  pthread_spin_destroy(&u->cq_lock);
+  pthread_spin_destroy(&u->sq_lock);
+  munmap(u->sqes, u->sqes_size);
+  munmap(u->ring, u->ring_size);
+  close(u->fd);
+  NK_FREE(u);
+}
+
+// Runs a file operation synchronously. Returns what the ring would.
+static int64_t nk_io_req_run(nk_io_req *req) {
+  ssize_t r;
+  switch (req->op) {
+  case IORING_OP_READ:
+    r = pread(req->fd, req->buf, req->len, req->offset);
+    break;
+  case IORING_OP_WRITE:
+    r = pwrite(req->fd, req->buf, req->len, req->offset);
+    break;
+  default:
+    r = fsync(req->fd);
+    break;
+  }
+  return r < 0 ? -errno : r;
+}
+
+static void *nk_io_helper_main(void *_arg) {
+  nk_host *h = _arg;
+  struct nk_io_helpers *hp = h->io_helpers;
+  pthread_mutex_lock(&hp->lock);
+  while (1) {
+    nk_io_req *req = nk_io_req_link_shift(&hp->reqs);
+    if (!req) {
+      if (hp->stop) {
+        break;
+      }
+      pthread_cond_wait(&hp->cond, &hp->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&hp->lock);
+    req->res = nk_io_req_run(req);
+    // The request may be on the thread's stack: do not touch it once the
+    // thread is woken.
+    nk_thd_wakeup(h, req->thd, /* handoff = */ 0);
+    pthread_mutex_lock(&hp->lock);
+  }
+  pthread_mutex_unlock(&hp->lock);
+  return NULL;
+}
+
+// Stops and joins the helpers once they have run what is queued.
+static void nk_io_helpers_destroy(nk_host *h) {
+  struct nk_io_helpers *hp = h->io_helpers;
+  pthread_mutex_lock(&hp->lock);
+  hp->stop = 1;
+  pthread_cond_broadcast(&hp->cond);
+  pthread_mutex_unlock(&hp->lock);
+  for (int i = 0; i < hp->count; i++) {
+    pthread_join(hp->threads[i], NULL);
+  }
+  pthread_cond_destroy(&hp->cond);
+  pthread_mutex_destroy(&hp->lock);
+  NK_FREE(hp);
+  h->io_helpers = NULL;
+}
+
+static nk_status nk_io_helpers_create(nk_host *h, int count) {
+  nk_status status;
+
+  status = NK_ERR_NOMEM;
+  struct nk_io_helpers *hp = NK_ALLOCBYTES(
+      struct nk_io_helpers,
+      sizeof(struct nk_io_helpers) + count * sizeof(pthread_t));
+  if (!hp) {
+    goto err;
+  }
+  pthread_mutex_init(&hp->lock, NULL);
+  pthread_cond_init(&hp->cond, NULL);
+  QUEUE_INIT(&hp->reqs);
+  h->io_helpers = hp;
+  for (; hp->count < count; hp->count++) {
+    if (pthread_create(&hp->threads[hp->count], NULL, nk_io_helper_main, h)) {
+      goto err2;
+    }
+  }
+  return NK_OK;
+
+err2:
+  nk_io_helpers_destroy(h);
+err:
+  return status;
+}
+
+nk_status nk_io_init(nk_host *h) {
+  nk_status status;
+
+  status = NK_ERR_NOMEM;
+  h->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (h->epfd < 0) {
+    goto err;
+  }
+  h->io_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (h->io_eventfd < 0) {
+    goto err2;
+  }
+  // Level-triggered, so that a notification is not lost if it lands before
+  // the host-thread blocks. Told apart from waiters by its NULL pointer.
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(h->epfd, EPOLL_CTL_ADD, h->io_eventfd, &ev)) {
+    goto err3;
+  }
+  if (h->attrs.io_uring_entries) {
+    h->io_uring = nk_io_uring_create(h, h->attrs.io_uring_entries);
+  }
+  if (!h->io_uring && nk_io_helpers_create(h, h->attrs.io_helpers) != NK_OK) {
+    goto err3;
+  }
+  return NK_OK;
+
+err3:
+  close(h->io_eventfd);
+err2:
+  close(h->epfd);
+err:
+  return status;
+}
+
+void nk_io_destroy(nk_host *h) {
+  if (h->io_uring) {
+    nk_io_uring_destroy(h->io_uring);
+  } else {
+    nk_io_helpers_destroy(h);
+  }
+  close(h->io_eventfd);
+  close(h->epfd);
+}
+
+void nk_io_notify(nk_host *h) {
+  uint64_t one = 1;
+  ssize_t r = write(h->io_eventfd, &one, sizeof(one));
+  (void)r; // EAGAIN: the counter is saturated, so a wakeup is pending anyway.
+}
+
+// epoll_wait() with a nanosecond timeout, if the kernel has epoll_pwait2();
+// otherwise the timeout is rounded up to milliseconds.
+static int nk_io_epoll_wait(int epfd, struct epoll_event *evs, int max,
+                            int64_t timeout_ns) {
+#ifdef SYS_epoll_pwait2
+  static int no_pwait2;
+  if (timeout_ns > 0 && !__atomic_load_n(&no_pwait2, __ATOMIC_RELAXED)) {
+    struct timespec ts = {timeout_ns / 1000000000, timeout_ns % 1000000000};
+    int n = syscall(SYS_epoll_pwait2, epfd, evs, max, &ts, NULL, 0);
+    if (n >= 0 || errno != ENOSYS) {
+      return n;
+    }
+    __atomic_store_n(&no_pwait2, 1, __ATOMIC_RELAXED);
+  }
+#endif
+  int ms = timeout_ns < 0 ? -1 : (int)((timeout_ns + 999999) / 1000000);
+  return epoll_wait(epfd, evs, max, ms);
+}
+
+// Takes what is in the completion queue and wakes the threads waiting on it.
+// Returns how many threads were woken.
+static int nk_io_reap(nk_host *h) {
+  struct nk_io_uring *u = h->io_uring;
+  // Another host-thread is reaping already; what it misses keeps the ring's
+  // descriptor ready.
+  if (pthread_spin_trylock(&u->cq_lock)) {
+    return 0;
+  }
+  nk_thd *ready[NK_IO_POLL_BATCH];
+  int nready = 0;
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail && nready < NK_IO_POLL_BATCH) {
+    struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+    nk_io_req *req = (nk_io_req *)(uintptr_t)cqe->user_data;
+    req->res = cqe->res;
+    ready[nready++] = req->thd;
+    head++;
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  pthread_spin_unlock(&u->cq_lock);
+  if (nready) {
+    __atomic_sub_fetch(&u->inflight, nready, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&h->io_waiters, nready, __ATOMIC_SEQ_CST);
+    nk_thd_wakeup_batch(h, ready, nready);
+  }
+  return nready;
+}
+
+void nk_io_submit(nk_host *h) {
+  struct nk_io_uring *u = h->io_uring;
+  if (!__atomic_exchange_n(&h->io_sq_pending, 0, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+  // Hands over everything in the submission queue, including entries other
+  // host-threads have queued since.
+  int r;
+  do {
+    r = syscall(SYS_io_uring_enter, u->fd, u->sq_entries, 0, 0, NULL, 0);
+  } while (r < 0 && errno == EINTR);
+  if (r < 0) {
+    // Out of kernel resources for now: try again at the next chance.
+    __atomic_add_fetch(&h->io_sq_pending, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  // Buffered I/O often completes during submission.
+  nk_io_reap(h);
+}
+
+int nk_io_poll(nk_host *h, int64_t timeout_ns) {
+  struct epoll_event evs[NK_IO_POLL_BATCH];
+  int n = nk_io_epoll_wait(h->epfd, evs, NK_IO_POLL_BATCH, timeout_ns);
+  if (n <= 0) {
+    return 0;
+  }
+  nk_thd *ready[NK_IO_POLL_BATCH];
+  int nready = 0;
+  int reaped = 0;
+  for (int i = 0; i < n; i++) {
+    // (A waiting thread registers itself.)
+    nk_thd *w = evs[i].data.ptr;
+    if (w && (void *)w == (void *)h->io_uring) {
+      reaped = nk_io_reap(h);
+      continue;
+    }
+    if (!w) {
+      // The notification is for the blocking poller: leave it to that one,
+      // lest it sleep through it.
+      if (timeout_ns != 0) {
+        uint64_t count;
+        ssize_t r = read(h->io_eventfd, &count, sizeof(count));
+        (void)r; // EAGAIN: drained already.
+      }
+      continue;
+    }
+    ready[nready++] = w;
+  }
+  if (nready) {
+    __atomic_sub_fetch(&h->io_waiters, nready, __ATOMIC_SEQ_CST);
+    nk_thd_wakeup_batch(h, ready, nready);
+  }
+  return nready + reaped;
+}
+
+nk_status nk_fd_wait(int fd, int events) {
+  nk_hostthd *hostthd = nk_hostthd_self();
+  assert(hostthd != NULL);
+  nk_thd *self = nk_thd_self();
+  assert(self != NULL);
+  nk_host *h = hostthd->host;
+
+  if (!events || (events & ~(NK_FD_READ | NK_FD_WRITE))) {
+    return NK_ERR_PARAM;
+  }
+
+  struct epoll_event ev = {
+      .events = EPOLLONESHOT | ((events & NK_FD_READ) ? EPOLLIN : 0) |
+                ((events & NK_FD_WRITE) ? EPOLLOUT : 0),
+      .data.ptr = self,
+  };
+  // Waiting before the registration is visible, since the event may fire
+  // right away on another host-thread.
+  nk_thd_prepare_wait(self);
+  int first = __atomic_add_fetch(&h->io_waiters, 1, __ATOMIC_SEQ_CST) == 1;
+  // A descriptor stays registered (disarmed) after its event fires, so
+  // re-arming it is the common case.
+  int r = epoll_ctl(h->epfd, EPOLL_CTL_MOD, fd, &ev);
+  if (r && errno == ENOENT) {
+    r = epoll_ctl(h->epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+  if (r) {
+    __atomic_sub_fetch(&h->io_waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&self->state, NK_THD_STATE_RUNNING, __ATOMIC_RELAXED);
+    return NK_ERR_PARAM;
+  }
+  if (first) {
+    // Get an idle host-thread to block in the epoll instance.
+    nk_host_kick_poller(h, /* retime = */ 1);
+  }
+  nk_thd_yield_ext(NK_THD_YIELD_REASON_WAITING);
+  return NK_OK;
+}
+
+// Queues a file operation on the ring. Returns 0 if the ring is full, in
+// which case the caller is still running.
+static int nk_io_uring_push(nk_host *h, nk_thd *self, nk_io_req *req) {
+  struct nk_io_uring *u = h->io_uring;
+  // Waiting before the entry can be submitted, since it may complete right
+  // away on another host-thread.
+  nk_thd_prepare_wait(self);
+  pthread_spin_lock(&u->sq_lock);
+  unsigned tail = *u->sq_tail;
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  if (tail - head == u->sq_entries ||
+      __atomic_load_n(&u->inflight, __ATOMIC_RELAXED) == u->cq_entries) {
+    pthread_spin_unlock(&u->sq_lock);
+    __atomic_store_n(&self->state, NK_THD_STATE_RUNNING, __ATOMIC_RELAXED);
+    return 0;
+  }
+  struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = req->op;
+  sqe->fd = req->fd;
+  sqe->addr = (uintptr_t)req->buf;
+  sqe->len = req->len;
+  sqe->off = req->offset;
+  sqe->user_data = (uintptr_t)req;
+  __atomic_add_fetch(&u->inflight, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  pthread_spin_unlock(&u->sq_lock);
+  // Counted as a waiter so that the poller blocks in the epoll instance,
+  // where the ring's descriptor reports completions.
+  if (__atomic_add_fetch(&h->io_waiters, 1, __ATOMIC_SEQ_CST) == 1) {
+    nk_host_kick_poller(h, /* retime = */ 1);
+  }
+  // Not submitted yet: other threads on this host may queue theirs before
+  // a host-thread next gets to nk_io_submit().
+  __atomic_add_fetch(&h->io_sq_pending, 1, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+// Runs a file operation on the ring or on a helper, parking the caller until
+// it completes. Returns bytes transferred, or a negated errno.
+static int64_t nk_io_file_op(int op, int fd, void *buf, size_t len,
+                             uint64_t offset) {
+  nk_hostthd *hostthd = nk_hostthd_self();
+  assert(hostthd != NULL);
+  nk_thd *self = nk_thd_self();
+  assert(self != NULL);
+  nk_host *h = hostthd->host;
+
+  nk_io_req local;
+  nk_io_req *req = &local;
+  if (self->copy_stack) {
+    req = NK_ALLOC(nk_io_req);
+    if (!req) {
+      return -ENOMEM;
+    }
+  }
+  *req = (nk_io_req){
+      .thd = self,
+      .op = op,
+      .fd = fd,
+      .buf = buf,
+      .len = len > NK_IO_MAX_LEN ? NK_IO_MAX_LEN : len,
+      .offset = offset,
+  };
+  if (h->io_uring) {
+    while (!nk_io_uring_push(h, self, req)) {
+      // Full: get what is queued going, take what has completed and let
+      // other threads run meanwhile.
+      nk_io_submit(h);
+      nk_io_reap(h);
+      nk_thd_yield();
+    }
+  } else {
+    struct nk_io_helpers *hp = h->io_helpers;
+    nk_thd_prepare_wait(self);
+    pthread_mutex_lock(&hp->lock);
+    nk_io_req_link_push(&hp->reqs, req);
+    pthread_cond_signal(&hp->cond);
+    pthread_mutex_unlock(&hp->lock);
+  }
+  nk_thd_yield_ext(NK_THD_YIELD_REASON_WAITING);
+  int64_t res = req->res;
+  if (req != &local) {
+    NK_FREE(req);
+  }
+  return res;
+}
+
+static nk_status nk_io_result(int64_t res, size_t *done) {
+  if (res < 0) {
+    errno = -res;
+    return NK_ERR_IO;
+  }
+  if (done) {
+    *done = res;
+  }
+  return NK_OK;
+}
+
+nk_status nk_file_read(int fd, void *buf, size_t len, uint64_t offset,
+                       size_t *done) {
+  return nk_io_result(nk_io_file_op(IORING_OP_READ, fd, buf, len, offset),
+                      done);
+}
+
+nk_status nk_file_write(int fd, const void *buf, size_t len, uint64_t offset,
+                        size_t *done) {
+  return nk_io_result(
+      nk_io_file_op(IORING_OP_WRITE, fd, (void *)buf, len, offset), done);
+}
+
+nk_status nk_file_fsync(int fd) {
+  return nk_io_result(nk_io_file_op(IORING_OP_FSYNC, fd, NULL, 0, 0), NULL);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "nk/mpscq.h"
+
+void nk_mpscq_init(nk_mpscq *q) {
+  q->stub.next = NULL;
+  q->stub.prev = NULL;
+  q->head = &q->stub;
+  q->tail = &q->stub;
+  q->consumer_lock = 0;
+}
+
+void nk_mpscq_push(nk_mpscq *q, queue_entry *e) {
+  __atomic_store_n(&e->next, NULL, __ATOMIC_RELAXED);
+  queue_entry *prev = __atomic_exchange_n(&q->head, e, __ATOMIC_ACQ_REL);
+  // Between the exchange and this store the queue is briefly disconnected;
+  // nk_mpscq_pop() reports "empty" for that window rather than waiting.
+  __atomic_store_n(&prev->next, e, __ATOMIC_RELEASE);
+}
+
+queue_entry *nk_mpscq_pop(nk_mpscq *q) {
+  queue_entry *tail = q->tail;
+  queue_entry *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (tail == &q->stub) {
+    if (!next) {
+      return NULL;
+    }
+    __atomic_store_n(&q->tail, next, __ATOMIC_RELAXED);
+    tail = next;
+    next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+  }
+  if (next) {
+    __atomic_store_n(&q->tail, next, __ATOMIC_RELEASE);
+    return tail;
+  }
+  // `tail` is the last linked entry. If it is not also the most recently
+  // pushed one, a producer is between its exchange and its link.
+  if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  // Re-insert the stub behind `tail` so that `tail` can be handed out.
+  nk_mpscq_push(q, &q->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    __atomic_store_n(&q->tail, next, __ATOMIC_RELEASE);
+    return tail;
+  }
+  return NULL;
+}
+
+int nk_mpscq_empty(nk_mpscq *q) {
+  // The stub is both the newest and the next entry only when nothing else is
+  // queued. (`head` alone is not enough: the consumer re-inserts the stub
+  // behind entries it has not yet popped.) Load order matters: if we observe
+  // the re-inserted stub at `head`, any entry pushed before it has been popped
+  // by the time `tail` reaches the stub.
+  return __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == &q->stub &&
+         __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) == &q->stub;
+}
+
+int nk_mpscq_trylock(nk_mpscq *q) {
+  if (__atomic_load_n(&q->consumer_lock, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  return !__atomic_exchange_n(&q->consumer_lock, 1, __ATOMIC_ACQUIRE);
+}
+
+void nk_mpscq_unlock(nk_mpscq *q) {
+  __atomic_store_n(&q->consumer_lock, 0, __ATOMIC_RELEASE);
+}
@@ -69,6 +69,7 @@ nk_status nk_port_create(nk_host *h, nk_port **ret, nk_port_type type) {
 
   p->type = type;
   p->host = h;
+  p->affinity = NK_AFFINITY_NONE;
 
   *ret = p;
   return NK_OK;
@@ -93,6 +94,12 @@ void nk_port_set_dpc(nk_port *port, nk_dpc_func func, void *data) {
   port->dpc_data = data;
 }
 
+void nk_port_set_affinity(nk_port *port, int hostthd) {
+  assert(port->type == NK_PORT_DPC);
+  assert(hostthd >= NK_AFFINITY_NONE);
+  port->affinity = hostthd;
+}
+
 nk_status nk_msg_send(nk_port *port, nk_port *from, void *data1, void *data2) {
   nk_hostthd *hostthd = nk_hostthd_self();
   assert(hostthd != NULL);
@@ -112,7 +119,7 @@ nk_status nk_msg_send(nk_port *port, nk_port *from, void *data1, void *data2) {
     if (port->dpc_func) {
       nk_dpc *new_dpc;
       msg->dpc_data = port->dpc_data;
-      return nk_dpc_create(&new_dpc, port->dpc_func, msg);
+      return nk_dpc_create_on(&new_dpc, port->affinity, port->dpc_func, msg);
     } else {
       return NK_ERR_NORECV;
     }
@@ -123,7 +130,7 @@ nk_status nk_msg_send(nk_port *port, nk_port *from, void *data1, void *data2) {
       nk_thd *t = (nk_thd *)nk_schob_runq_shift(&port->thds);
       pthread_spin_unlock(&port->lock);
       t->recvslot = msg;
-      nk_schob_enqueue(host, (nk_schob *)t, /* new_schob = */ 0);
+      nk_thd_wakeup(host, t, /* handoff = */ 1);
       return NK_OK;
     } else {
       // No threads are waiting to receive: enqueue the message.
@@ -147,6 +154,7 @@ nk_status nk_msg_recv(nk_port *port, nk_msg **ret) {
     *ret = m;
     return NK_OK;
   } else {
+    nk_thd_prepare_wait(self);
     nk_schob_runq_push(&port->thds, (nk_schob *)self);
     pthread_spin_unlock(&port->lock);
     // Note that this gap between unlock and yield is nevertheless safe from
@@ -154,11 +162,11 @@ nk_status nk_msg_recv(nk_port *port, nk_msg **ret) {
     // that we're waiting, so the host thread scheduler will not place us back
     // on the runqueue as it would for an ordinary yield. Rather, the port
     // itself logically owns this thread now. It could be the case that some
-    // other thread concurrently delivers a message and places us back on the
-    // runqueue before we even reach this yield, but that's OK, because then
-    // we'll simply wake up when next scheduled off the runqueue. (Note that
-    // the thread-running lock prevents another host thread from jumping to our
-    // context before we leave it here.)
+    // other thread concurrently delivers a message before we even reach this
+    // yield, but that's OK: it finds us still parking and leaves us to carry
+    // on (or to be requeued once we have left our context), rather than
+    // placing us on the runqueue where another host thread could jump to our
+    // context before we leave it here.
     nk_thd_yield_ext(NK_THD_YIELD_REASON_WAITING);
     assert(self->recvslot);
     *ret = self->recvslot;
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "nk/numa.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// From <linux/mempolicy.h>.
+#define NK_MPOL_PREFERRED 1
+
+// Parses a CPU list such as "0-3,8,10-11" into `set`. Returns 0 if malformed.
+static int nk_numa_parse_cpulist(const char *s, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*s && *s != '\n') {
+    if (!isdigit((unsigned char)*s)) {
+      return 0;
+    }
+    char *end;
+    long lo = strtol(s, &end, 10);
+    long hi = lo;
+    s = end;
+    if (*s == '-') {
+      s++;
+      if (!isdigit((unsigned char)*s)) {
+        return 0;
+      }
+      hi = strtol(s, &end, 10);
+      s = end;
+    }
+    if (hi < lo || hi >= NK_NUMA_MAX_CPUS) {
+      return 0;
+    }
+    for (long c = lo; c <= hi; c++) {
+      CPU_SET(c, set);
+    }
+    if (*s == ',') {
+      s++;
+    } else if (*s && *s != '\n') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Reads the CPU list of kernel node `id` into `set`. Returns 0 on failure.
+static int nk_numa_node_cpus(int id, cpu_set_t *set) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+  char buf[4096];
+  int ok = fgets(buf, sizeof(buf), f) != NULL &&
+           nk_numa_parse_cpulist(buf, set);
+  fclose(f);
+  return ok;
+}
+
+// Appends the CPUs in `set` to the topology as node `node`.
+static void nk_numa_add_cpus(nk_numa *numa, int node, const cpu_set_t *set) {
+  for (int c = 0; c < NK_NUMA_MAX_CPUS && numa->ncpus < NK_NUMA_MAX_CPUS;
+       c++) {
+    if (CPU_ISSET(c, set)) {
+      numa->cpus[numa->ncpus++] = c;
+    }
+  }
+  numa->cpu_first[node + 1] = numa->ncpus;
+}
+
+nk_status nk_numa_init(nk_numa *numa, const char *cpus) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    return NK_ERR_PARAM;
+  }
+  if (cpus) {
+    cpu_set_t wanted;
+    if (!nk_numa_parse_cpulist(cpus, &wanted)) {
+      return NK_ERR_PARAM;
+    }
+    CPU_AND(&allowed, &allowed, &wanted);
+  }
+  if (CPU_COUNT(&allowed) == 0) {
+    return NK_ERR_PARAM;
+  }
+
+  memset(numa, 0, sizeof(*numa));
+  // Kernel node numbers may be sparse; take them in order.
+  int max_id = -1;
+  DIR *d = opendir("/sys/devices/system/node");
+  if (d) {
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+      int id;
+      if (sscanf(e->d_name, "node%d", &id) == 1 && id > max_id) {
+        max_id = id;
+      }
+    }
+    closedir(d);
+  }
+  for (int id = 0; id <= max_id; id++) {
+    cpu_set_t set;
+    if (!nk_numa_node_cpus(id, &set)) {
+      continue;
+    }
+    CPU_AND(&set, &set, &allowed);
+    if (CPU_COUNT(&set) == 0) {
+      continue;
+    }
+    int node = numa->nnodes;
+    if (node == NK_NUMA_MAX_NODES) {
+      // Folded into the last node.
+      node--;
+    } else {
+      numa->node_id[node] = id;
+      numa->cpu_first[node] = numa->ncpus;
+      numa->nnodes++;
+    }
+    nk_numa_add_cpus(numa, node, &set);
+    CPU_XOR(&allowed, &allowed, &set);
+  }
+  // No topology information (or CPUs it left out): one more node, numbered
+  // as the kernel does on non-NUMA machines.
+  if (CPU_COUNT(&allowed) > 0) {
+    int node = numa->nnodes;
+    if (node == NK_NUMA_MAX_NODES) {
+      node--;
+    } else {
+      numa->node_id[node] = numa->nnodes ? -1 : 0;
+      numa->cpu_first[node] = numa->ncpus;
+      numa->nnodes++;
+    }
+    nk_numa_add_cpus(numa, node, &allowed);
+  }
+  return NK_OK;
+}
+
+nk_status nk_numa_bind_thread(const nk_numa *numa, int node, int slot) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  int first = numa->cpu_first[node];
+  int n = numa->cpu_first[node + 1] - first;
+  if (slot >= 0) {
+    CPU_SET(numa->cpus[first + slot % n], &set);
+  } else {
+    for (int i = 0; i < n; i++) {
+      CPU_SET(numa->cpus[first + i], &set);
+    }
+  }
+  if (sched_setaffinity(0, sizeof(set), &set)) {
+    return NK_ERR_PARAM;
+  }
+  return NK_OK;
+}
+
+void nk_numa_bind_memory(void *p, size_t len, int kernel_node) {
+  if (kernel_node < 0 || kernel_node >= 64) {
+    return;
+  }
+  unsigned long mask = 1ul << kernel_node;
+  syscall(SYS_mbind, p, len, NK_MPOL_PREFERRED, &mask, 64 + 1, 0);
+}
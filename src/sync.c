@@ -64,6 +64,7 @@ void nk_mutex_lock(nk_mutex *m) {
   while (1) {
     pthread_spin_lock(&m->lock);
     if (m->locked) {
+      nk_thd_prepare_wait(t);
       nk_schob_runq_push(&m->waiters, (nk_schob *)t);
       pthread_spin_unlock(&m->lock);
       nk_thd_yield_ext(NK_THD_YIELD_REASON_WAITING);
@@ -81,7 +82,7 @@ void nk_mutex_unlock(nk_mutex *m) {
   if (!nk_schob_runq_empty(&m->waiters)) {
     nk_thd *t = (nk_thd *)nk_schob_runq_shift(&m->waiters);
     pthread_spin_unlock(&m->lock);
-    nk_schob_enqueue(m->host, (nk_schob *)t, /* new_schob = */ 0);
+    nk_thd_wakeup(m->host, t, /* handoff = */ 1);
   } else {
     pthread_spin_unlock(&m->lock);
   }
@@ -122,6 +123,7 @@ void nk_cond_wait(nk_cond *c, nk_mutex *m) {
   nk_thd *self = nk_thd_self();
   assert(self != NULL);
   // We enqueue ourselves first and *then* unlock the mutex.
+  nk_thd_prepare_wait(self);
   pthread_spin_lock(&c->lock);
   nk_schob_runq_push(&c->waiters, (nk_schob *)self);
   pthread_spin_unlock(&c->lock);
@@ -139,7 +141,7 @@ void nk_cond_signal(nk_cond *c) {
   pthread_spin_lock(&c->lock);
   if (!nk_schob_runq_empty(&c->waiters)) {
     nk_thd *t = (nk_thd *)nk_schob_runq_shift(&c->waiters);
-    nk_schob_enqueue(c->host, (nk_schob *)t, /* new_schob = */ 0);
+    nk_thd_wakeup(c->host, t, /* handoff = */ 1);
   }
   pthread_spin_unlock(&c->lock);
 }
@@ -155,7 +157,7 @@ void nk_cond_broadcast(nk_cond *c) {
   pthread_spin_unlock(&c->lock);
   while (!nk_schob_runq_empty(&to_run)) {
     nk_thd *t = (nk_thd *)nk_schob_runq_shift(&to_run);
-    nk_schob_enqueue(c->host, (nk_schob *)t, /* new_schob = */ 0);
+    nk_thd_wakeup(c->host, t, /* handoff = */ 0);
   }
 }
 
@@ -209,9 +211,10 @@ void nk_barrier_wait(nk_barrier *b) {
     pthread_spin_unlock(&b->lock);
     while (!nk_schob_runq_empty(&to_run)) {
       nk_thd *t = (nk_thd *)nk_schob_runq_shift(&to_run);
-      nk_schob_enqueue(b->host, (nk_schob *)t, /* new_schob = */ 0);
+      nk_thd_wakeup(b->host, t, /* handoff = */ 0);
     }
   } else {
+    nk_thd_prepare_wait(self);
     nk_schob_runq_push(&b->waiters, (nk_schob *)self);
     pthread_spin_unlock(&b->lock);
     nk_thd_yield_ext(NK_THD_YIELD_REASON_WAITING);
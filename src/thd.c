@@ -23,27 +23,40 @@
 #include "nk/thd.h"
 #include "nk/msg.h"
 #include "nk/sync.h"
+#include "nk/io.h"
 
 #include <assert.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/mman.h>
-
-// Global: thread-stack freelist and associated lock.
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Global: thread-stack freelists and associated lock, one set per stack size
+// class (see nk_thd_attrs). Stacks of threads homed on kernel NUMA node N (if
+// N < NK_NUMA_MAX_NODES) come from freelist N + 1 of their class, and are
+// backed by that node's memory; all others come from freelist 0.
 static pthread_mutex_t nk_thd_stack_freelist_mutex = PTHREAD_MUTEX_INITIALIZER;
-static nk_freelist nk_thd_stack_freelist;
+static nk_freelist nk_thd_stack_freelist[NK_THD_STACK_CLASSES]
+                                        [NK_NUMA_MAX_NODES + 1];
 static pthread_once_t nk_thd_stack_freelist_once = PTHREAD_ONCE_INIT;
 
-// Global: pthreads TLS key for the "current host thread" pointer.
-static pthread_key_t nk_hostthd_self_key;
-static pthread_once_t nk_hostthd_self_key_once = PTHREAD_ONCE_INIT;
-
-static void setup_hostthd_self_key() {
-  pthread_key_create(&nk_hostthd_self_key, NULL);
-}
+// Global: the "current host thread" pointer, per system thread. Read inline
+// by nk_thd_maybe_yield(), see nk_arch_hostthd_self().
+__thread nk_hostthd *nk_hostthd_current
+    __attribute__((tls_model("initial-exec")));
 
-nk_hostthd *nk_hostthd_self() {
-  pthread_once(&nk_hostthd_self_key_once, setup_hostthd_self_key);
-  return (nk_hostthd *)pthread_getspecific(nk_hostthd_self_key);
+// Not inlined: a thread may resume on another system thread after any switch,
+// and the compiler would be free to keep the address of the previous one's
+// variable across the switch.
+__attribute__((noinline)) nk_hostthd *nk_hostthd_self() {
+  return nk_hostthd_current;
 }
 
 nk_thd *nk_thd_self() {
@@ -70,9 +83,16 @@ nk_dpc *nk_dpc_self() {
 
 // ------ schob ------
 
-static nk_status nk_schob_init(nk_schob *schob, nk_schob_type type) {
+static nk_status nk_schob_init(nk_schob *schob, nk_schob_type type,
+                               int prio) {
   // All fields zeroed on entry.
+  if (prio < 0 || prio >= NK_PRIO_LEVELS) {
+    return NK_ERR_PARAM;
+  }
   schob->type = type;
+  schob->prio = prio;
+  schob->affinity = NK_AFFINITY_NONE;
+  schob->last_ran = -1;
   return NK_OK;
 }
 
@@ -80,328 +100,3050 @@ static void nk_schob_destroy(nk_schob *schob) {
   // Nothing.
 }
 
-// This is the main scheduler. It picks a schob off to run of the nk_host
-// context. Assumes `runq_mutex` is already held.
-static nk_schob *nk_schob_next(nk_host *host) {
-  if (nk_schob_runq_empty(&host->runq)) {
-    return NULL;
+// How often (in dispatches) a host-thread polls the global run queue ahead of
+// its local one, so that injected work is not starved by a busy local queue.
+#define NK_HOSTTHD_GLOBAL_POLL_INTERVAL 61
+
+// How many file operations may be queued on the host's ring before a busy
+// host-thread submits them; otherwise that waits for the next global poll or
+// for a host-thread to run out of work.
+#define NK_IO_SUBMIT_BATCH 32
+
+// How often (in dispatches) a host-thread serves the priority levels
+// round-robin rather than most-urgent-first, so that less urgent levels are
+// never starved outright.
+#define NK_PRIO_STARVATION_INTERVAL 16
+
+#define NK_PRIO_ALL ((1u << NK_PRIO_LEVELS) - 1)
+
+uint64_t nk_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void nk_futex_wait(int *addr, int val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+// Like nk_futex_wait(), but gives up after `ns` nanoseconds.
+static void nk_futex_wait_timeout(int *addr, int val, uint64_t ns) {
+  struct timespec ts = {ns / 1000000000ull, ns % 1000000000ull};
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+static void nk_futex_wake(int *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void nk_futex_wake_all(int *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Wakes a parked host-thread after its parking word was changed: it sleeps on
+// that futex, or, as the host's poller, in the epoll instance. Pairs with
+// nk_hostthd_poll_io(): either the poller sees the new parking word before it
+// blocks, or we see that it is polling.
+static void nk_hostthd_wake(nk_hostthd *h) {
+  nk_futex_wake(&h->park);
+  if (__atomic_load_n(&h->polling, __ATOMIC_SEQ_CST)) {
+    nk_io_notify(h->host);
   }
-  nk_schob *n = nk_schob_runq_shift(&host->runq);
-  return n;
 }
 
-// This enqueues a schob onto the runqueue. It assumes no locks are held.
-void nk_schob_enqueue(nk_host *host, nk_schob *schob, int new_schob) {
+// Takes the most recently parked host-thread off the idle list and wakes it.
+// The caller must already have counted it in nspinning. Returns 0 if no
+// host-thread was parked.
+static int nk_host_unpark(nk_host *host) {
+  pthread_spin_lock(&host->idle_lock);
+  nk_hostthd *h = nk_hostthd_idle_pop(&host->idle_hostthds);
+  if (h) {
+    h->parked = 0;
+    __atomic_sub_fetch(&host->nparked, 1, __ATOMIC_SEQ_CST);
+    // Set under the lock so that it cannot land after the host-thread has
+    // parked again.
+    __atomic_store_n(&h->park, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_spin_unlock(&host->idle_lock);
+  if (h) {
+    nk_hostthd_wake(h);
+  }
+  return h != NULL;
+}
+
+// Takes the given host-thread off the idle list and wakes it, if it is parked,
+// counting it as spinning as nk_host_unpark() does. Pairs with the fence in
+// nk_hostthd_park(), as nk_host_wake_idle() does. Returns 0 if it was not
+// parked. Assumes no locks are held.
+static int nk_hostthd_unpark_other(nk_hostthd *h) {
+  nk_host *host = h->host;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&h->parked, __ATOMIC_SEQ_CST)) {
+    return 0;
+  }
+  __atomic_add_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST);
+  pthread_spin_lock(&host->idle_lock);
+  int parked = h->parked;
+  if (parked) {
+    nk_hostthd_idle_remove(h);
+    h->parked = 0;
+    __atomic_sub_fetch(&host->nparked, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&h->park, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_spin_unlock(&host->idle_lock);
+  if (parked) {
+    nk_hostthd_wake(h);
+  } else {
+    __atomic_sub_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST);
+  }
+  return parked;
+}
+
+// Wakes every parked host-thread, and takes every spare out of the spare
+// pool, so that they notice the host exiting; and wakes nk_host_run().
+static void nk_host_unpark_all(nk_host *host) {
+  __atomic_store_n(&host->exiting, 1, __ATOMIC_SEQ_CST);
+  // nk_host_run(), and the preemption monitor if any.
+  nk_futex_wake_all(&host->exiting);
+  while (1) {
+    __atomic_add_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST);
+    if (!nk_host_unpark(host)) {
+      __atomic_sub_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+  }
   pthread_mutex_lock(&host->runq_mutex);
-  nk_schob_runq_push(&host->runq, schob);
-  if (new_schob) {
-    host->schob_count++;
+  nk_hostthd *h;
+  while ((h = nk_hostthd_spare_shift(&host->spare_hostthds)) != NULL) {
+    __atomic_sub_fetch(&host->nspare_idle, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&h->spare_wait, 0, __ATOMIC_SEQ_CST);
+    nk_futex_wake(&h->spare_wait);
   }
-  pthread_cond_signal(&host->runq_cond);
   pthread_mutex_unlock(&host->runq_mutex);
 }
 
-// ------ thd ------
+// Wakes one parked host-thread, if any, so that it comes to steal newly
+// queued work -- unless some host-thread is already spinning for work, in
+// which case that one will find it. Assumes no locks are held.
+static void nk_host_wake_idle(nk_host *host) {
+  // Pairs with the fence in nk_hostthd_park(): either we see the parked
+  // host-thread here, or it sees our schob when it rescans.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&host->nspinning, __ATOMIC_SEQ_CST) > 0 ||
+      __atomic_load_n(&host->nparked, __ATOMIC_SEQ_CST) == 0) {
+    return;
+  }
+  // Only the enqueuer that takes the spinner count from zero wakes anyone, so
+  // that a burst of enqueues does not wake a herd.
+  int zero = 0;
+  if (!__atomic_compare_exchange_n(&host->nspinning, &zero, 1, /* weak = */ 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return;
+  }
+  if (!nk_host_unpark(host)) {
+    __atomic_sub_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST);
+  }
+}
 
-#define NK_THD_STACKSIZE (256 * 1024)
-#define NK_THD_GUARDSIZE 4096
+// Parking-word value that sends the poller back to recompute its timeout,
+// without taking it off the idle list.
+#define NK_HOSTTHD_PARK_RETIME 2
 
-static void *allocstack(const nk_freelist_attrs *attrs, void *cookie) {
-  void *p = mmap(NULL, NK_THD_STACKSIZE, PROT_READ | PROT_WRITE,
-                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
-  if (!p) {
+// Returns `now + ns`, saturating rather than wrapping.
+static uint64_t nk_deadline_after(uint64_t now, uint64_t ns) {
+  return ns > UINT64_MAX - now ? UINT64_MAX : now + ns;
+}
+
+// Makes sure that, while a timer or file-descriptor wait is pending, some
+// parked host-thread polls for it: if there is no poller, wakes a parked
+// host-thread to take that role. If `retime` is set (timer_next moved earlier,
+// or the first descriptor wait began), nudges the poller to recompute how it
+// waits. (Busy host-threads poll timers and descriptors themselves.) Assumes no
+// locks are held.
+void nk_host_kick_poller(nk_host *host, int retime) {
+  // Pairs with the claim in nk_hostthd_park(): either we see the new poller,
+  // or it sees the new timer_next and io_waiters.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&host->timer_next, __ATOMIC_SEQ_CST) == UINT64_MAX &&
+      __atomic_load_n(&host->io_waiters, __ATOMIC_SEQ_CST) == 0) {
+    return;
+  }
+  nk_hostthd *poller = __atomic_load_n(&host->poller, __ATOMIC_SEQ_CST);
+  if (poller) {
+    int zero = 0;
+    if (retime &&
+        __atomic_compare_exchange_n(&poller->park, &zero,
+                                    NK_HOSTTHD_PARK_RETIME, /* weak = */ 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      nk_hostthd_wake(poller);
+    }
+    return;
+  }
+  if (__atomic_load_n(&host->nparked, __ATOMIC_SEQ_CST) == 0) {
+    return;
+  }
+  __atomic_add_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST);
+  if (!nk_host_unpark(host)) {
+    __atomic_sub_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Like nk_host_timer_add(), but with timer_lock held. Sets `*earlier` if the
+// timer is now the first due, in which case the caller must call
+// nk_host_kick_poller() once it has dropped the lock.
+static int nk_host_timer_add_locked(nk_host *host, nk_timer *t,
+                                    int *earlier) {
+  int added = nk_timer_wheel_add(&host->timers, t);
+  *earlier = added && t->deadline < host->timer_next;
+  if (*earlier) {
+    __atomic_store_n(&host->timer_next, t->deadline, __ATOMIC_SEQ_CST);
+  }
+  return added;
+}
+
+// Places a timer on the host's wheel. Returns 0 if it is already due, in which
+// case the caller acts on it directly. Assumes no locks are held.
+static int nk_host_timer_add(nk_host *host, nk_timer *t) {
+  int earlier;
+  pthread_spin_lock(&host->timer_lock);
+  int added = nk_host_timer_add_locked(host, t, &earlier);
+  pthread_spin_unlock(&host->timer_lock);
+  if (earlier) {
+    nk_host_kick_poller(host, /* retime = */ 1);
+  }
+  return added;
+}
+
+// Expires the host's due timers, if any: wakes sleeping threads and queues
+// delayed DPCs. Costs a clock read when a timer is pending and nothing
+// otherwise. Assumes no locks are held.
+static void nk_host_poll_timers(nk_host *host) {
+  uint64_t next = __atomic_load_n(&host->timer_next, __ATOMIC_SEQ_CST);
+  if (next == UINT64_MAX) {
+    return;
+  }
+  uint64_t now = nk_now_ns();
+  // If the lock is busy, whoever holds it is adding a timer or expiring them
+  // already; the next poll will catch up.
+  if (now < next || pthread_spin_trylock(&host->timer_lock)) {
+    return;
+  }
+  queue_head expired;
+  QUEUE_INIT(&expired);
+  nk_timer_wheel_advance(&host->timers, now, &expired);
+  __atomic_store_n(&host->timer_next, nk_timer_wheel_next(&host->timers),
+                   __ATOMIC_SEQ_CST);
+  pthread_spin_unlock(&host->timer_lock);
+
+  nk_timer *t;
+  while ((t = nk_timer_link_shift(&expired)) != NULL) {
+    // A sleeping thread's timer is its own again once it is woken: do not
+    // touch it then.
+    nk_schob *s = t->owner;
+    if (s->type == NK_SCHOB_TYPE_THD) {
+      nk_thd_wakeup(host, (nk_thd *)s, /* handoff = */ 0);
+    } else {
+      nk_schob_enqueue(host, s, /* new_schob = */ 0);
+    }
+  }
+}
+
+// Marks a priority level as possibly non-empty. Called after queueing a schob
+// at that level.
+static void nk_host_prio_set(nk_host *host, int prio) {
+  unsigned bit = 1u << prio;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!(__atomic_load_n(&host->prio_mask, __ATOMIC_SEQ_CST) & bit)) {
+    __atomic_or_fetch(&host->prio_mask, bit, __ATOMIC_SEQ_CST);
+  }
+}
+
+static int nk_host_prio_empty(nk_host *host, int prio) {
+  if (!nk_mpscq_empty(&host->runq[prio])) {
+    return 0;
+  }
+  for (int i = 0; i < host->hostthd_array_len; i++) {
+    nk_hostthd *h = __atomic_load_n(&host->hostthd_array[i], __ATOMIC_ACQUIRE);
+    if (h && (!nk_deque_empty(&h->runq[prio]) ||
+              !nk_mpscq_empty(&h->affine[prio]))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Clears the bit for a priority level that was found empty, then rescans the
+// level: an enqueuer that raced with us may have seen the bit still set and
+// skipped setting it.
+static void nk_host_prio_clear(nk_host *host, int prio) {
+  unsigned bit = 1u << prio;
+  __atomic_and_fetch(&host->prio_mask, ~bit, __ATOMIC_SEQ_CST);
+  if (!nk_host_prio_empty(host, prio)) {
+    __atomic_or_fetch(&host->prio_mask, bit, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Takes a schob off a host-thread's inbox or affine queue. Returns NULL if the
+// queue is empty or another host-thread is taking from it. Assumes no locks
+// are held.
+static nk_schob *nk_schob_pop(nk_mpscq *q) {
+  if (nk_mpscq_empty(q) || !nk_mpscq_trylock(q)) {
     return NULL;
   }
+  queue_entry *e = nk_mpscq_pop(q);
+  nk_mpscq_unlock(q);
+  return e ? QUEUE_OBJ_FROM_ENTRY(nk_schob, runq, e) : NULL;
+}
+
+// Clears the host-thread's inbox bit for a level that was found empty, then
+// rechecks the inbox, as nk_host_prio_clear() does for the host's bits.
+static void nk_hostthd_inbox_clear(nk_hostthd *self, int prio) {
+  unsigned bit = 1u << prio;
+  __atomic_and_fetch(&self->inbox_mask, ~bit, __ATOMIC_SEQ_CST);
+  if (!nk_mpscq_empty(&self->inbox[prio])) {
+    __atomic_or_fetch(&self->inbox_mask, bit, __ATOMIC_SEQ_CST);
+  }
+}
 
-  // protect the guard page.
-  if (mprotect(p, NK_THD_GUARDSIZE, PROT_NONE)) {
-    munmap(p, NK_THD_STACKSIZE);
+// How many schobs a host-thread moves from the global run queue to its local
+// run queue at once.
+#define NK_HOSTTHD_INJECT_BATCH 32
+
+static int nk_schob_enqueue_affine(nk_host *host, nk_hostthd *self,
+                                   nk_schob *schob);
+
+// Passes on a schob taken from the global run queue that is pinned to another
+// host-thread, if that one is in service: pinned work lands on the global run
+// queue while its host-thread is out of service, or before the host runs.
+// Returns 0 if the caller is to run it.
+static int nk_schob_redirect(nk_hostthd *self, nk_schob *schob) {
+  int affinity = __atomic_load_n(&schob->affinity, __ATOMIC_RELAXED);
+  return affinity >= 0 && affinity != self->index &&
+         nk_schob_enqueue_affine(self->host, self, schob);
+}
+
+// Takes a schob off the given level of the global run queue, if any, and moves
+// up to a batch more onto the local run queue. Returns NULL if the queue is
+// empty or another host-thread is draining it. Assumes no locks are held.
+static nk_schob *nk_schob_next_global(nk_hostthd *self, int prio) {
+  nk_host *host = self->host;
+  nk_mpscq *q = &host->runq[prio];
+  if (nk_mpscq_empty(q) || !nk_mpscq_trylock(q)) {
     return NULL;
   }
+  nk_schob *n = NULL;
+  int moved = 0;
+  queue_entry *e;
+  while (moved < NK_HOSTTHD_INJECT_BATCH - 1 && (e = nk_mpscq_pop(q))) {
+    nk_schob *s = QUEUE_OBJ_FROM_ENTRY(nk_schob, runq, e);
+    if (nk_schob_redirect(self, s)) {
+      continue;
+    }
+    if (!n) {
+      n = s;
+      continue;
+    }
+    if (!nk_deque_push(&self->runq[prio], s)) {
+      nk_mpscq_push(q, e);
+      break;
+    }
+    moved++;
+  }
+  nk_mpscq_unlock(q);
+  if (moved > 0) {
+    // The level's bit may have been cleared while the batch was in flight.
+    nk_host_prio_set(host, prio);
+    nk_host_wake_idle(host);
+  }
+  return n;
+}
 
-  return p;
+// Like Go's scheduler, thieves take half of the victim's run queue at once,
+// so that work spreads out in few steals: as much of it as fits in the unused
+// part of the thief's batch buffer. (Not in a buffer of its own on the stack:
+// stealing can run on a thread's stack, which may be small.)
+
+// Steals schobs of the given level from some other host-thread's local run
+// queue: returns one, and places the rest of the stolen half on our own.
+// Victims are scanned from a random starting point so that idle host-threads
+// do not all converge on the same one; on a host with several NUMA nodes,
+// those on our own node are all tried first. Assumes no locks are held.
+static nk_schob *nk_schob_steal(nk_hostthd *self, int prio) {
+  nk_host *host = self->host;
+  int n = host->hostthd_array_len;
+  self->steal_seed = self->steal_seed * 1103515245 + 12345;
+  int start = (self->steal_seed >> 16) % n;
+  int passes = host->nnodes > 1 ? 2 : 1;
+  for (int k = 0; k < passes * n; k++) {
+    int i = k % n;
+    nk_hostthd *victim = __atomic_load_n(
+        &host->hostthd_array[(start + i) % n], __ATOMIC_ACQUIRE);
+    if (!victim || victim == self) {
+      continue;
+    }
+    if (passes > 1 && (victim->node == self->node) != (k < n)) {
+      continue;
+    }
+    nk_schob *one;
+    nk_schob **stolen = &one;
+    int got;
+    if (self->batch_len < NK_HOSTTHD_BATCH_MAX) {
+      stolen = self->batch + self->batch_len;
+      got = nk_deque_steal_batch(&victim->runq[prio], (void **)stolen,
+                                 NK_HOSTTHD_BATCH_MAX - self->batch_len,
+                                 /* half = */ 1);
+    } else {
+      // (The batch buffer is full.)
+      one = nk_deque_steal(&victim->runq[prio]);
+      got = one != NULL;
+    }
+    if (got == 0) {
+      // Soft-affine work waiting for a busy host-thread.
+      nk_schob *n = nk_schob_pop(&victim->affine[prio]);
+      if (n) {
+        return n;
+      }
+      continue;
+    }
+    for (int j = 1; j < got; j++) {
+      if (!nk_deque_push(&self->runq[prio], stolen[j])) {
+        nk_mpscq_push(&host->runq[prio], &stolen[j]->runq);
+      }
+    }
+    if (got > 1) {
+      nk_host_prio_set(host, prio);
+    }
+    return stolen[0];
+  }
+  return NULL;
 }
 
-static void freestack(const nk_freelist_attrs *attrs, void *cookie, void *p) {
-  munmap(p, NK_THD_STACKSIZE);
+// Takes a schob of the given level from the host-thread's own run queue. With
+// batching on, takes up to a batch at once into the private batch: all of the
+// queue if there are no other host-threads, else at most half of it, leaving
+// the rest for thieves.
+static nk_schob *nk_hostthd_take_local(nk_hostthd *self, int prio) {
+  nk_host *host = self->host;
+  if (host->attrs.batch <= 1 || self->batch_pos < self->batch_len) {
+    return nk_deque_steal(&self->runq[prio]);
+  }
+  int k = nk_deque_steal_batch(&self->runq[prio], (void **)self->batch,
+                               host->attrs.batch,
+                               /* half = */ host->hostthd_array_len > 1);
+  if (k == 0) {
+    return NULL;
+  }
+  self->batch_pos = 1;
+  self->batch_len = k;
+  return self->batch[0];
 }
 
-static void zerostack(const nk_freelist_attrs *attrs, void *cookie, void *p) {
-  // Nothing.
+// Returns what is left of the private batch to the global run queue, where
+// other host-threads can get at it.
+static void nk_hostthd_flush_batch(nk_hostthd *self) {
+  nk_host *host = self->host;
+  if (self->batch_pos == self->batch_len) {
+    return;
+  }
+  for (; self->batch_pos < self->batch_len; self->batch_pos++) {
+    nk_schob *s = self->batch[self->batch_pos];
+    int prio = __atomic_load_n(&s->prio, __ATOMIC_RELAXED);
+    nk_mpscq_push(&host->runq[prio], &s->runq);
+    nk_host_prio_set(host, prio);
+  }
+  self->batch_pos = self->batch_len = 0;
+  nk_host_wake_idle(host);
 }
 
-static nk_freelist_attrs nk_thd_stack_freelist_attrs = {
-    .node_size = 0, // unused, since we use custom alloc/free/zero funcs
-    .max_count = 1000,
-    // `next`-ptr header after guard page
-    .freelist_header_offset = NK_THD_GUARDSIZE,
-    .alloc_func = allocstack,
-    .free_func = freestack,
-    .zero_func = zerostack,
-};
+// Takes the next schob from the private batch, if it is no less urgent than
+// `limit`. If the batch would hold back work that the queues would serve
+// first -- a more urgent level has work, or a round-robin pick of another
+// level is due -- the rest of the batch is flushed instead.
+static nk_schob *nk_hostthd_take_batch(nk_hostthd *self, unsigned mask,
+                                       int limit) {
+  if (self->batch_pos == self->batch_len) {
+    return NULL;
+  }
+  nk_schob *n = self->batch[self->batch_pos];
+  int prio = __atomic_load_n(&n->prio, __ATOMIC_RELAXED);
+  if (prio > limit) {
+    return NULL;
+  }
+  if ((mask & ((1u << prio) - 1)) ||
+      ((mask & ~(1u << prio)) &&
+       self->tick % NK_PRIO_STARVATION_INTERVAL == 0)) {
+    nk_hostthd_flush_batch(self);
+    return NULL;
+  }
+  self->batch_pos++;
+  return n;
+}
 
-static void setup_nk_thd_stack_freelist() {
-  nk_freelist_init(&nk_thd_stack_freelist, &nk_thd_stack_freelist_attrs, NULL);
+// Takes a schob of the given level: first from the local run queue or the
+// inbox, then from the affine queue, then from the global run queue, and
+// finally by stealing from another host-thread. Pinned work and the rest take
+// turns, so that neither can starve the other.
+static nk_schob *nk_schob_next_level(nk_hostthd *self, int prio) {
+  nk_schob *n = NULL;
+  int inbox = __atomic_load_n(&self->inbox_mask, __ATOMIC_RELAXED) &
+              (1u << prio);
+  if (inbox && (self->tick & 1)) {
+    n = nk_schob_pop(&self->inbox[prio]);
+  }
+  if (!n && self->tick % NK_HOSTTHD_GLOBAL_POLL_INTERVAL == 0) {
+    n = nk_schob_next_global(self, prio);
+  }
+  if (!n) {
+    n = nk_hostthd_take_local(self, prio);
+  }
+  if (!n && inbox) {
+    n = nk_schob_pop(&self->inbox[prio]);
+  }
+  if (!n) {
+    n = nk_schob_pop(&self->affine[prio]);
+  }
+  if (!n) {
+    n = nk_schob_next_global(self, prio);
+  }
+  if (!n) {
+    n = nk_schob_steal(self, prio);
+  }
+  return n;
 }
 
-static __attribute__((noreturn)) void nk_thd_entry(void *data1, void *data2,
-                                                   void *data3) {
-  nk_thd *t = (nk_thd *)data1;
-  nk_thd_entrypoint f = (nk_thd_entrypoint)data2;
-  void *f_data = data3;
+// How long (in ns) a schob waits in a host-thread's run-next slot before other
+// host-threads may steal it.
+#define NK_HOSTTHD_RUNNEXT_STEAL_NS 10000
+
+// How many schobs in a row a host-thread runs from its run-next slot before
+// wakeups go to the back of its local run queue instead, so that a pair of
+// threads handing off to each other cannot starve the rest of the queue.
+#define NK_HOSTTHD_RUNNEXT_CHAIN 16
+
+// Takes the schob in the host-thread's own run-next slot, unless it is less
+// urgent than `limit` or a more urgent priority level than its own has work.
+static nk_schob *nk_hostthd_take_runnext(nk_hostthd *self, unsigned mask,
+                                         int limit) {
+  nk_schob *n = __atomic_load_n(&self->runnext, __ATOMIC_ACQUIRE);
+  if (!n) {
+    return NULL;
+  }
+  int prio = __atomic_load_n(&n->prio, __ATOMIC_RELAXED);
+  if (prio > limit || (mask & ((1u << prio) - 1))) {
+    return NULL;
+  }
+  return __atomic_exchange_n(&self->runnext, NULL, __ATOMIC_ACQ_REL);
+}
 
-  f(t, f_data);
-  nk_thd_exit();
+// Steals a schob no less urgent than `limit` that has been waiting in another
+// host-thread's run-next slot for longer than NK_HOSTTHD_RUNNEXT_STEAL_NS.
+// Assumes no locks are held.
+static nk_schob *nk_schob_steal_runnext(nk_hostthd *self, int limit) {
+  nk_host *host = self->host;
+  uint64_t now = 0;
+  for (int i = 0; i < host->hostthd_array_len; i++) {
+    nk_hostthd *victim =
+        __atomic_load_n(&host->hostthd_array[i], __ATOMIC_ACQUIRE);
+    if (!victim || victim == self) {
+      continue;
+    }
+    nk_schob *n = __atomic_load_n(&victim->runnext, __ATOMIC_ACQUIRE);
+    if (!n || __atomic_load_n(&n->prio, __ATOMIC_RELAXED) > limit) {
+      continue;
+    }
+    if (!now) {
+      now = nk_now_ns();
+    }
+    uint64_t since = __atomic_load_n(&victim->runnext_since, __ATOMIC_RELAXED);
+    if (now - since >= NK_HOSTTHD_RUNNEXT_STEAL_NS &&
+        __atomic_compare_exchange_n(&victim->runnext, &n, NULL,
+                                    /* weak = */ 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED)) {
+      return n;
+    }
+  }
+  return NULL;
 }
 
-nk_status nk_thd_create(nk_thd **ret, nk_thd_entrypoint entry, void *data) {
-  nk_hostthd *host = nk_hostthd_self();
-  assert(host != NULL);
-  return nk_thd_create_ext(host->host, ret, entry, data);
+// Raises `*p` to at least `v`.
+static void nk_atomic_max(uint64_t *p, uint64_t v) {
+  uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+  while (old < v &&
+         !__atomic_compare_exchange_n(p, &old, v, /* weak = */ 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
 }
 
-nk_status nk_thd_create_ext(nk_host *host, nk_thd **ret,
-                            nk_thd_entrypoint entry, void *data) {
-  nk_status status;
+static nk_group *nk_schob_group(nk_host *host, nk_schob *schob) {
+  return schob->group ? schob->group : &host->root_group;
+}
 
-  status = NK_ERR_NOMEM;
-  nk_thd *t = nk_freelist_alloc(&host->thd_freelist);
-  if (!t) {
-    goto err;
+// Takes a schob at one of the given levels off a group's run queues. Returns
+// NULL if there is none, or another host-thread is taking from the queue.
+// Assumes no locks are held.
+static nk_schob *nk_group_take(nk_group *g, unsigned levels) {
+  unsigned mask = __atomic_load_n(&g->prio_mask, __ATOMIC_SEQ_CST) & levels;
+  while (mask) {
+    int prio = __builtin_ctz(mask);
+    unsigned bit = 1u << prio;
+    mask &= mask - 1;
+    nk_schob *n = nk_schob_pop(&g->runq[prio]);
+    if (n) {
+      return n;
+    }
+    // As nk_host_prio_clear() does, but a queue that is busy rather than empty
+    // keeps its bit.
+    if (nk_mpscq_empty(&g->runq[prio])) {
+      __atomic_and_fetch(&g->prio_mask, ~bit, __ATOMIC_SEQ_CST);
+      if (!nk_mpscq_empty(&g->runq[prio])) {
+        __atomic_or_fetch(&g->prio_mask, bit, __ATOMIC_SEQ_CST);
+      }
+    }
   }
+  return NULL;
+}
 
-  if (pthread_spin_init(&t->running_lock, PTHREAD_PROCESS_PRIVATE)) {
-    goto err;
+// Which levels of a group's work may be picked? A yielding thread gives way
+// only to work at least as urgent as itself within its own group (`own`), but
+// to any work of another group that is due.
+static unsigned nk_group_levels(nk_group *g, nk_group *own, int limit) {
+  return g == own ? (2u << limit) - 1 : NK_PRIO_ALL;
+}
+
+// Picks the group to serve next, if the host has groups other than the root
+// group: the one with work that has the least virtual time. Returns a schob of
+// that group, or NULL if the root group is due (or the pick came up empty), in
+// which case the caller goes on to the host's own queues -- at all levels, if
+// the root group is not the yielding thread's own. `mask` is the caller's view
+// of the root group's levels. Assumes no locks are held.
+static nk_schob *nk_group_pick(nk_hostthd *self, unsigned mask, int *limit) {
+  nk_host *host = self->host;
+  nk_group *root = &host->root_group;
+  nk_group *own = self->running ? nk_schob_group(host, self->running) : NULL;
+  uint64_t floor = __atomic_load_n(&host->vtime_floor, __ATOMIC_RELAXED);
+  uint64_t best_vtime = UINT64_MAX;
+  nk_group *best = NULL;
+  if ((mask & nk_group_levels(root, own, *limit)) ||
+      __atomic_load_n(&self->runnext, __ATOMIC_RELAXED) ||
+      self->batch_pos < self->batch_len) {
+    best_vtime = __atomic_load_n(&root->vtime, __ATOMIC_RELAXED);
+    best = root;
+  } else {
+    // An idle group banks no credit.
+    nk_atomic_max(&root->vtime, floor);
+  }
+  int n = __atomic_load_n(&host->ngroups, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < n; i++) {
+    nk_group *g = __atomic_load_n(&host->groups[i], __ATOMIC_ACQUIRE);
+    if (!(__atomic_load_n(&g->prio_mask, __ATOMIC_RELAXED) &
+          nk_group_levels(g, own, *limit))) {
+      continue;
+    }
+    uint64_t vtime = __atomic_load_n(&g->vtime, __ATOMIC_RELAXED);
+    if (vtime < best_vtime) {
+      best_vtime = vtime;
+      best = g;
+    }
+  }
+  if (!best) {
+    return NULL;
+  }
+  nk_atomic_max(&host->vtime_floor, best_vtime);
+  if (best == root) {
+    if (own != root) {
+      *limit = NK_PRIO_LOWEST;
+    }
+    return NULL;
   }
+  return nk_group_take(best, nk_group_levels(best, own, *limit));
+}
 
-  status = NK_ERR_NOMEM;
-  pthread_mutex_lock(&nk_thd_stack_freelist_mutex);
-  pthread_once(&nk_thd_stack_freelist_once, &setup_nk_thd_stack_freelist);
-  t->stack = nk_freelist_alloc(&nk_thd_stack_freelist);
-  pthread_mutex_unlock(&nk_thd_stack_freelist_mutex);
-  t->stacktop = (char *)t->stack + NK_THD_STACKSIZE;
-  if (!t->stack) {
-    goto err2;
+// Takes a schob from any group other than the root group, once the host's own
+// queues have come up empty.
+static nk_schob *nk_group_take_any(nk_hostthd *self, int limit) {
+  nk_host *host = self->host;
+  nk_group *own = self->running ? nk_schob_group(host, self->running) : NULL;
+  int n = __atomic_load_n(&host->ngroups, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < n; i++) {
+    nk_group *g = __atomic_load_n(&host->groups[i], __ATOMIC_ACQUIRE);
+    nk_schob *s = nk_group_take(g, nk_group_levels(g, own, limit));
+    if (s) {
+      return s;
+    }
   }
+  return NULL;
+}
 
-  status = nk_schob_init(&t->schob, NK_SCHOB_TYPE_THD);
-  if (status != NK_OK) {
-    goto err3;
+// Does any group other than the root group have work queued?
+static int nk_host_groups_pending(nk_host *host) {
+  int n = __atomic_load_n(&host->ngroups, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < n; i++) {
+    nk_group *g = __atomic_load_n(&host->groups[i], __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&g->prio_mask, __ATOMIC_SEQ_CST)) {
+      return 1;
+    }
   }
+  return 0;
+}
 
-  t->stacktop = nk_arch_create_ctx(t->stacktop, nk_thd_entry, /* data1 = */ t,
-                                   /* data2 = */ entry, /* data3 = */ data);
+static uint64_t nk_host_slice_cycles(nk_host *host);
 
-  nk_schob_enqueue(host, (nk_schob *)t, /* new_schob = */ 1);
+// Starts the time slice of the schob the host-thread is about to run (see
+// nk_thd_maybe_yield()), and times it if the host has groups to charge it to.
+static void nk_hostthd_run_begin(nk_hostthd *self) {
+  nk_host *host = self->host;
+  int prio = __atomic_load_n(&self->running->prio, __ATOMIC_RELAXED);
+  self->urgent_levels = (1u << prio) - 1;
+  self->slice_end = nk_arch_cycles() + nk_host_slice_cycles(host);
+  self->run_start =
+      __atomic_load_n(&host->ngroups, __ATOMIC_RELAXED) ? nk_now_ns() : 0;
+}
 
-  *ret = t;
-  return NK_OK;
+// Charges the CPU time that a schob took since nk_hostthd_run_begin() to its
+// group.
+static void nk_hostthd_run_end(nk_hostthd *self, nk_schob *schob) {
+  if (!self->run_start) {
+    return;
+  }
+  uint64_t ns = nk_now_ns() - self->run_start;
+  self->run_start = 0;
+  nk_group *g = nk_schob_group(self->host, schob);
+  int weight = __atomic_load_n(&g->weight, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g->cpu_ns, ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g->vtime, ns * NK_GROUP_WEIGHT_DEFAULT / weight,
+                     __ATOMIC_RELAXED);
+}
 
-err3:
-  pthread_mutex_lock(&nk_thd_stack_freelist_mutex);
-  nk_freelist_free(&nk_thd_stack_freelist, t->stack);
-  pthread_mutex_unlock(&nk_thd_stack_freelist_mutex);
-err2:
-  pthread_spin_destroy(&t->running_lock);
-err:
-  if (t) {
-    nk_freelist_free(&host->thd_freelist, t);
+// This is the main scheduler. It picks a schob to run on the given host-thread:
+// first the run-next slot, then the private batch, then the most urgent
+// non-empty priority level, found in O(1) from the host's level bitmap and
+// the host-thread's inbox bitmap. Every NK_PRIO_STARVATION_INTERVAL
+// dispatches it instead serves the next non-empty level after the previous
+// such pick, round-robin. If the host has groups, all that serves the root
+// group, when it is the root group's turn.
+//
+// Levels less urgent than `limit` are passed over, except by the round-robin
+// pick: a yielding thread gives way only to work at least as urgent as itself,
+// but threads yielding to each other must not starve the other levels.
+// Assumes no locks are held.
+static nk_schob *nk_schob_pick(nk_hostthd *self, int limit) {
+  nk_host *host = self->host;
+  self->tick++;
+  if (__atomic_load_n(&self->overdue, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&self->overdue, 0, __ATOMIC_RELAXED);
+  }
+  // File operations queued by threads that parked on this or other
+  // host-threads go to the kernel together, once enough pile up.
+  if (__atomic_load_n(&host->io_sq_pending, __ATOMIC_RELAXED) >=
+      NK_IO_SUBMIT_BATCH) {
+    nk_io_submit(host);
+  }
+  if (self->tick % NK_HOSTTHD_GLOBAL_POLL_INTERVAL == 0) {
+    nk_io_submit(host);
+    nk_host_poll_timers(host);
+    // Descriptors too, unless a parked host-thread is blocked on them.
+    if (__atomic_load_n(&host->io_waiters, __ATOMIC_RELAXED) &&
+        !__atomic_load_n(&host->io_blocked, __ATOMIC_RELAXED)) {
+      nk_io_poll(host, 0);
+    }
+  }
+  unsigned mask = __atomic_load_n(&host->prio_mask, __ATOMIC_SEQ_CST) |
+                  __atomic_load_n(&self->inbox_mask, __ATOMIC_SEQ_CST);
+  int groups = __atomic_load_n(&host->ngroups, __ATOMIC_RELAXED);
+  nk_schob *n = NULL;
+  if (groups) {
+    n = nk_group_pick(self, mask, &limit);
+    if (n) {
+      return n;
+    }
+  }
+  n = nk_hostthd_take_runnext(self, mask, limit);
+  if (n) {
+    self->runnext_chain++;
+    return n;
+  }
+  self->runnext_chain = 0;
+  n = nk_hostthd_take_batch(self, mask, limit);
+  if (n) {
+    return n;
+  }
+  if (mask && self->tick % NK_PRIO_STARVATION_INTERVAL == 0) {
+    unsigned c = self->prio_cursor;
+    unsigned rot = ((mask >> c) | (mask << (NK_PRIO_LEVELS - c))) & NK_PRIO_ALL;
+    int prio = (c + __builtin_ctz(rot)) % NK_PRIO_LEVELS;
+    self->prio_cursor = (prio + 1) % NK_PRIO_LEVELS;
+    n = nk_schob_next_level(self, prio);
+    if (n) {
+      return n;
+    }
+  }
+  mask &= (2u << limit) - 1;
+  while (mask) {
+    int prio = __builtin_ctz(mask);
+    mask &= mask - 1;
+    n = nk_schob_next_level(self, prio);
+    if (n) {
+      return n;
+    }
+    nk_host_prio_clear(host, prio);
+    if (__atomic_load_n(&self->inbox_mask, __ATOMIC_RELAXED) & (1u << prio)) {
+      nk_hostthd_inbox_clear(self, prio);
+    }
+  }
+  // The more urgent levels that held back the run-next slot may have turned
+  // out to be empty.
+  n = nk_hostthd_take_runnext(self, 0, limit);
+  if (n) {
+    return n;
+  }
+  n = nk_schob_steal_runnext(self, limit);
+  if (!n && groups) {
+    n = nk_group_take_any(self, limit);
+  }
+  return n;
+}
+
+static nk_schob *nk_schob_next(nk_hostthd *self) {
+  return nk_schob_pick(self, NK_PRIO_LOWEST);
+}
+
+// Notes when a schob became runnable, if the host grows with run-queue delay.
+static void nk_schob_stamp(nk_host *host, nk_schob *schob) {
+  if (host->attrs.max_workers) {
+    schob->queued_at = nk_now_ns();
+  }
+}
+
+// Queues a schob on its group's run queue. Returns 0 if it is in the root
+// group, in which case the caller queues it as usual. Assumes no locks are
+// held.
+static int nk_group_enqueue(nk_host *host, nk_schob *schob) {
+  nk_group *g = schob->group;
+  if (!g) {
+    return 0;
+  }
+  nk_schob_stamp(host, schob);
+  int prio = __atomic_load_n(&schob->prio, __ATOMIC_RELAXED);
+  unsigned bit = 1u << prio;
+  nk_mpscq_push(&g->runq[prio], &schob->runq);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!(__atomic_load_n(&g->prio_mask, __ATOMIC_SEQ_CST) & bit) &&
+      !__atomic_fetch_or(&g->prio_mask, bit, __ATOMIC_SEQ_CST)) {
+    // Back from idle: no credit for the time spent there.
+    nk_atomic_max(&g->vtime,
+                  __atomic_load_n(&host->vtime_floor, __ATOMIC_RELAXED));
+  }
+  nk_host_wake_idle(host);
+  return 1;
+}
+
+static void nk_schob_enqueue_global(nk_host *host, nk_schob *schob) {
+  if (nk_group_enqueue(host, schob)) {
+    return;
+  }
+  nk_schob_stamp(host, schob);
+  int prio = __atomic_load_n(&schob->prio, __ATOMIC_RELAXED);
+  nk_mpscq_push(&host->runq[prio], &schob->runq);
+  nk_host_prio_set(host, prio);
+  nk_host_wake_idle(host);
+}
+
+// Moves everything in a host-thread's inbox to the global run queue, once the
+// host-thread is out of service. Waits out other consumers rather than give up
+// on the inbox, so that nothing queued before the call is left behind.
+static void nk_hostthd_evict_inbox(nk_hostthd *h) {
+  for (int i = 0; i < NK_PRIO_LEVELS; i++) {
+    nk_mpscq *q = &h->inbox[i];
+    while (!nk_mpscq_empty(q)) {
+      if (!nk_mpscq_trylock(q)) {
+        __builtin_ia32_pause();
+        continue;
+      }
+      queue_entry *e;
+      while ((e = nk_mpscq_pop(q)) != NULL) {
+        nk_schob_enqueue_global(h->host,
+                                QUEUE_OBJ_FROM_ENTRY(nk_schob, runq, e));
+      }
+      nk_mpscq_unlock(q);
+    }
+  }
+}
+
+// Takes the host-thread out of service, ahead of it joining the spare pool or
+// exiting: work pinned to it is queued as if unpinned from now on.
+static void nk_hostthd_leave_service(nk_hostthd *self) {
+  __atomic_store_n(&self->serving, 0, __ATOMIC_SEQ_CST);
+  nk_hostthd_evict_inbox(self);
+}
+
+// Queues a schob in a host-thread's affine queue, where that host-thread looks
+// for it before other work, and others steal it only if idle.
+static void nk_schob_push_affine(nk_host *host, nk_hostthd *h,
+                                 nk_schob *schob) {
+  nk_schob_stamp(host, schob);
+  int prio = __atomic_load_n(&schob->prio, __ATOMIC_RELAXED);
+  nk_mpscq_push(&h->affine[prio], &schob->runq);
+  nk_host_prio_set(host, prio);
+  // Its host-thread if that is idle, else whoever would steal it.
+  if (!nk_hostthd_unpark_other(h)) {
+    nk_host_wake_idle(host);
+  }
+}
+
+// Queues a schob on the host-thread it has affinity to: in that host-thread's
+// inbox if pinned there, or in its affine queue if the schob last ran there
+// and prefers to, unless the caller already runs there. `self` is the
+// caller's host-thread, or NULL if not on `host`. Returns 0 if the schob has
+// no affinity to act on, or its host-thread is out of service, in which case
+// the caller queues it as usual. Assumes no locks are held.
+static int nk_schob_enqueue_affine(nk_host *host, nk_hostthd *self,
+                                   nk_schob *schob) {
+  int affinity = __atomic_load_n(&schob->affinity, __ATOMIC_RELAXED);
+  if (affinity == NK_AFFINITY_NONE) {
+    return 0;
+  }
+  int soft = affinity == NK_AFFINITY_SOFT;
+  int index = soft ? schob->last_ran : affinity;
+  if (index < 0 || index >= host->hostthd_array_len ||
+      (soft && self && self->index == index)) {
+    return 0;
+  }
+  nk_hostthd *h =
+      __atomic_load_n(&host->hostthd_array[index], __ATOMIC_ACQUIRE);
+  if (!h || !__atomic_load_n(&h->serving, __ATOMIC_SEQ_CST)) {
+    return 0;
+  }
+  if (soft) {
+    nk_schob_push_affine(host, h, schob);
+    return 1;
+  }
+  nk_schob_stamp(host, schob);
+  int prio = __atomic_load_n(&schob->prio, __ATOMIC_RELAXED);
+  nk_mpscq_push(&h->inbox[prio], &schob->runq);
+  __atomic_or_fetch(&h->inbox_mask, 1u << prio, __ATOMIC_SEQ_CST);
+  // Pairs with nk_hostthd_leave_service(): either it evicts our schob, or we
+  // see that it is out of service and do so ourselves.
+  if (!__atomic_load_n(&h->serving, __ATOMIC_SEQ_CST)) {
+    nk_hostthd_evict_inbox(h);
+  } else if (h != self) {
+    nk_hostthd_unpark_other(h);
+  }
+  return 1;
+}
+
+// Sends a schob homed on another NUMA node than the caller's back to its home
+// node, to the affine queue of one of that node's host-threads in service, so
+// that work stolen across nodes returns home the next time it is queued.
+// Returns 0 if the schob is at home, or its node has no host-thread in
+// service, in which case the caller queues it as usual.
+static int nk_schob_enqueue_home(nk_hostthd *self, nk_schob *schob) {
+  nk_host *host = self->host;
+  int node = schob->node;
+  if (host->nnodes == 1 || node == self->node) {
+    return 0;
+  }
+  // Host-thread N is on node N % nnodes.
+  int n = (host->hostthd_array_len - node + host->nnodes - 1) / host->nnodes;
+  if (n <= 0) {
+    return 0;
+  }
+  self->steal_seed = self->steal_seed * 1103515245 + 12345;
+  int start = (self->steal_seed >> 16) % n;
+  for (int k = 0; k < n; k++) {
+    int index = node + (start + k) % n * host->nnodes;
+    nk_hostthd *h =
+        __atomic_load_n(&host->hostthd_array[index], __ATOMIC_ACQUIRE);
+    if (h && __atomic_load_n(&h->serving, __ATOMIC_SEQ_CST)) {
+      nk_schob_push_affine(host, h, schob);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Is the schob pinned to a host-thread in service other than `self`?
+static int nk_schob_pinned_elsewhere(nk_hostthd *self, nk_schob *schob) {
+  nk_host *host = self->host;
+  int affinity = __atomic_load_n(&schob->affinity, __ATOMIC_RELAXED);
+  if (affinity < 0 || affinity == self->index ||
+      affinity >= host->hostthd_array_len) {
+    return 0;
+  }
+  nk_hostthd *h =
+      __atomic_load_n(&host->hostthd_array[affinity], __ATOMIC_ACQUIRE);
+  return h && __atomic_load_n(&h->serving, __ATOMIC_SEQ_CST);
+}
+
+// Places a schob on the host-thread's local run queue, spilling to the global
+// run queue if the local one is full; or, if it has affinity elsewhere, on the
+// host-thread it has affinity to; or, if it is in a group, on its group's run
+// queue; or, if it is homed on another node, on that node. If `wake` is set,
+// an idle host-thread is signaled so that the new work can be stolen.
+static void nk_schob_enqueue_local(nk_hostthd *self, nk_schob *schob,
+                                   int wake) {
+  if (nk_schob_enqueue_affine(self->host, self, schob) ||
+      nk_group_enqueue(self->host, schob) ||
+      nk_schob_enqueue_home(self, schob)) {
+    return;
+  }
+  nk_schob_stamp(self->host, schob);
+  int prio = __atomic_load_n(&schob->prio, __ATOMIC_RELAXED);
+  if (!nk_deque_push(&self->runq[prio], schob)) {
+    nk_schob_enqueue_global(self->host, schob);
+    return;
+  }
+  nk_host_prio_set(self->host, prio);
+  if (wake) {
+    nk_host_wake_idle(self->host);
+  }
+}
+
+// This enqueues a schob onto a runqueue. It assumes no locks are held.
+void nk_schob_enqueue(nk_host *host, nk_schob *schob, int new_schob) {
+  if (new_schob) {
+    __atomic_add_fetch(&host->schob_count, 1, __ATOMIC_SEQ_CST);
+  }
+  nk_hostthd *self = nk_hostthd_self();
+  if (self && self->host == host) {
+    nk_schob_enqueue_local(self, schob, /* wake = */ 1);
+  } else if (!nk_schob_enqueue_affine(host, NULL, schob)) {
+    nk_schob_enqueue_global(host, schob);
+  }
+}
+
+// Places a schob in the calling host-thread's run-next slot, if it runs on
+// `host`; otherwise enqueues it as usual.
+static void nk_schob_handoff(nk_host *host, nk_schob *schob) {
+  nk_hostthd *self = nk_hostthd_self();
+  // Grouped work waits its group's turn.
+  if (!self || self->host != host || schob->group ||
+      self->runnext_chain >= NK_HOSTTHD_RUNNEXT_CHAIN) {
+    nk_schob_enqueue(host, schob, /* new_schob = */ 0);
+    return;
+  }
+  // The run-next slot is open to thieves: no place for pinned work. Nor for
+  // work from another node, which goes home.
+  if (nk_schob_enqueue_affine(host, self, schob) ||
+      nk_schob_enqueue_home(self, schob)) {
+    return;
+  }
+  nk_schob_stamp(host, schob);
+  __atomic_store_n(&self->runnext_since, nk_now_ns(), __ATOMIC_RELAXED);
+  nk_schob *old = __atomic_exchange_n(&self->runnext, schob, __ATOMIC_ACQ_REL);
+  // No wakeup for the slot itself: we run it as soon as the caller yields, and
+  // idle host-threads that are spinning steal it if that takes too long. A
+  // schob bumped out of the slot is ordinary queued work, though.
+  if (old) {
+    nk_schob_enqueue_local(self, old, /* wake = */ 1);
+  }
+}
+
+// ------ thd ------
+
+static void nk_hostthd_finish_switch(nk_hostthd *self, nk_arch_switch_ret ret);
+static void nk_host_schob_destroyed(nk_host *host);
+static void nk_host_check_delay(nk_host *host, nk_schob *next);
+
+// New stacks have a one-page guard. Free stacks keep whatever guard they last
+// had, and record its size in their top word (out of reach of any guard),
+// under the freelist link.
+#define NK_THD_GUARDSIZE 4096
+#define NK_THD_PAGESIZE 4096
+
+// Each size class keeps up to as many bytes of free stacks cached as there
+// were when all stacks were 256 KiB and 1000 were kept.
+#define NK_THD_STACK_CACHE_BYTES (1000 * 256 * 1024)
+
+static size_t nk_thd_stack_class_size(int stack_class) {
+  return (size_t)NK_THD_STACK_CLASS_MIN << stack_class;
+}
+
+// Returns the size class that holds a stack with the given attributes, or -1.
+static int nk_thd_stack_class(const nk_thd_attrs *attrs) {
+  size_t guard = (attrs->guard_size + NK_THD_PAGESIZE - 1) &
+                 ~(size_t)(NK_THD_PAGESIZE - 1);
+  if (attrs->stack_size < NK_THD_STACK_MIN ||
+      attrs->stack_size > NK_THD_STACK_CLASS_MAX ||
+      guard > NK_THD_STACK_CLASS_MAX) {
+    return -1;
+  }
+  for (int c = 0; c < NK_THD_STACK_CLASSES; c++) {
+    if (attrs->stack_size + guard <= nk_thd_stack_class_size(c)) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+static size_t *nk_thd_stack_guard_word(void *stack, size_t size) {
+  return (size_t *)((char *)stack + size) - 1;
+}
+
+// A free stack's link in the freelist, or host-thread stack cache, that holds
+// it. (See setup_nk_thd_stack_freelist().)
+static void **nk_thd_stack_link(void *stack, size_t size) {
+  return (void **)(nk_thd_stack_guard_word(stack, size) - 1);
+}
+
+// A free stack records, below its guard word and link, how many bytes of it
+// were given back to the kernel when it was freed.
+static size_t *nk_thd_stack_reclaimed_word(void *stack, size_t size) {
+  return nk_thd_stack_guard_word(stack, size) - 2;
+}
+
+// Bytes of address space reserved for stacks, and bytes of that committed to
+// stacks, all told (see nk_host_stats).
+static size_t nk_thd_stack_reserved;
+static size_t nk_thd_stack_committed;
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#define MADV_GUARD_REMOVE 103
+#endif
+
+// How stack guards are made: with guard markers where the kernel has them,
+// which leave the arena one mapping; else by protection, which splits it at
+// every guard. Decided at the first guard installed.
+#define NK_THD_GUARD_UNKNOWN 0
+#define NK_THD_GUARD_MARKERS 1
+#define NK_THD_GUARD_PROTECT 2
+static int nk_thd_guard_mode = NK_THD_GUARD_UNKNOWN;
+
+// Changes the guard region at the bottom of a stack from `from` bytes to `to`.
+// Returns 0 on failure, with the stack unchanged. The protection fallback only
+// keeps guards working: each guarded stack then costs up to two mappings, so
+// vm.max_map_count still bounds how many stacks a process can have.
+static int nk_thd_stack_set_guard(void *stack, size_t from, size_t to) {
+  if (to == from) {
+    return 1;
+  }
+  char *p = (char *)stack + (to > from ? from : to);
+  size_t len = to > from ? to - from : from - to;
+  int mode = __atomic_load_n(&nk_thd_guard_mode, __ATOMIC_RELAXED);
+  if (mode != NK_THD_GUARD_PROTECT) {
+    if (!madvise(p, len, to > from ? MADV_GUARD_INSTALL : MADV_GUARD_REMOVE)) {
+      __atomic_store_n(&nk_thd_guard_mode, NK_THD_GUARD_MARKERS,
+                       __ATOMIC_RELAXED);
+      return 1;
+    }
+    if (errno != EINVAL || mode == NK_THD_GUARD_MARKERS) {
+      return 0;
+    }
+    __atomic_store_n(&nk_thd_guard_mode, NK_THD_GUARD_PROTECT,
+                     __ATOMIC_RELAXED);
+  }
+  return !mprotect(p, len, to > from ? PROT_NONE : PROT_READ | PROT_WRITE);
+}
+
+// Stacks are carved out of arenas: large reservations, listed per size class
+// and freelist, split into slots of the class size with a bitmap of those in
+// use. Memory is committed as the stacks touch it, and released when a slot
+// goes back to its arena. A slot gets its one-page guard the first time it is
+// handed out, and keeps it from then on. Arenas last as long as the process.
+// Protected by nk_thd_stack_freelist_mutex, like the freelists they feed.
+#define NK_THD_ARENA_SIZE ((size_t)1 << 30)
+
+typedef struct nk_thd_arena nk_thd_arena;
+struct nk_thd_arena {
+  nk_thd_arena *next;
+  char *base;
+  size_t slot_size;
+  int nslots, nfree;
+  // Bit N of the bitmaps: slot N is in use; slot N has its guard.
+  uint64_t *used, *guarded;
+  // No free slot below word `hint` of `used`.
+  int hint;
+};
+
+static nk_thd_arena *nk_thd_arenas[NK_THD_STACK_CLASSES]
+                                  [NK_NUMA_MAX_NODES + 1];
+
+static nk_thd_arena *nk_thd_arena_create(size_t slot_size, int kernel_node) {
+  nk_thd_arena *a = NK_ALLOC(nk_thd_arena);
+  if (!a) {
+    goto err;
+  }
+  a->slot_size = slot_size;
+  a->nslots = a->nfree = NK_THD_ARENA_SIZE / slot_size;
+  a->used = NK_ALLOCN(uint64_t, (a->nslots + 63) / 64);
+  a->guarded = NK_ALLOCN(uint64_t, (a->nslots + 63) / 64);
+  if (!a->used || !a->guarded) {
+    goto err;
+  }
+  a->base = mmap(NULL, NK_THD_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1,
+                 0);
+  if (a->base == MAP_FAILED) {
+    goto err;
+  }
+  nk_numa_bind_memory(a->base, NK_THD_ARENA_SIZE, kernel_node);
+  __atomic_fetch_add(&nk_thd_stack_reserved, NK_THD_ARENA_SIZE,
+                     __ATOMIC_RELAXED);
+  return a;
+
+err:
+  if (a) {
+    NK_FREE(a->used);
+    NK_FREE(a->guarded);
+    NK_FREE(a);
+  }
+  return NULL;
+}
+
+static void *allocstack(const nk_freelist_attrs *attrs, void *cookie) {
+  // (node_size is the size of the class. The cookie is the kernel node to
+  // back the stack from, or -1, which also tells which freelist this is.)
+  size_t size = attrs->node_size;
+  int kernel_node = (int)(intptr_t)cookie;
+  nk_thd_arena **list =
+      &nk_thd_arenas[__builtin_ctzl(size / NK_THD_STACK_CLASS_MIN)]
+                    [kernel_node + 1];
+  nk_thd_arena *a = *list;
+  while (a && !a->nfree) {
+    a = a->next;
+  }
+  if (!a) {
+    a = nk_thd_arena_create(size, kernel_node);
+    if (!a) {
+      return NULL;
+    }
+    a->next = *list;
+    *list = a;
+  }
+  while (!~a->used[a->hint]) {
+    a->hint++;
+  }
+  int slot = a->hint * 64 + __builtin_ctzll(~a->used[a->hint]);
+  uint64_t bit = 1ull << (slot % 64);
+  char *p = a->base + (size_t)slot * size;
+
+  if (!(a->guarded[slot / 64] & bit)) {
+    if (!nk_thd_stack_set_guard(p, 0, NK_THD_GUARDSIZE)) {
+      return NULL;
+    }
+    a->guarded[slot / 64] |= bit;
+  }
+  a->used[slot / 64] |= bit;
+  a->nfree--;
+  *nk_thd_stack_guard_word(p, size) = NK_THD_GUARDSIZE;
+  *nk_thd_stack_reclaimed_word(p, size) = 0;
+  __atomic_fetch_add(&nk_thd_stack_committed, size, __ATOMIC_RELAXED);
+
+  return p;
+}
+
+static void freestack(const nk_freelist_attrs *attrs, void *cookie, void *p) {
+  size_t size = attrs->node_size;
+  int kernel_node = (int)(intptr_t)cookie;
+  nk_thd_arena *a = nk_thd_arenas[__builtin_ctzl(size / NK_THD_STACK_CLASS_MIN)]
+                                 [kernel_node + 1];
+  while ((char *)p < a->base || (char *)p >= a->base + NK_THD_ARENA_SIZE) {
+    a = a->next;
+  }
+  // Back to the slot's guard, or, failing that, never reuse the slot.
+  if (!nk_thd_stack_set_guard(p, *nk_thd_stack_guard_word(p, size),
+                              NK_THD_GUARDSIZE)) {
+    return;
+  }
+  __atomic_fetch_sub(&nk_thd_stack_committed,
+                     size - *nk_thd_stack_reclaimed_word(p, size),
+                     __ATOMIC_RELAXED);
+  madvise((char *)p + NK_THD_GUARDSIZE, size - NK_THD_GUARDSIZE,
+          MADV_DONTNEED);
+  int slot = ((char *)p - a->base) / size;
+  a->used[slot / 64] &= ~(1ull << (slot % 64));
+  a->nfree++;
+  if (slot / 64 < a->hint) {
+    a->hint = slot / 64;
+  }
+}
+
+static void zerostack(const nk_freelist_attrs *attrs, void *cookie, void *p) {
+  // Nothing.
+}
+
+static nk_freelist_attrs nk_thd_stack_freelist_attrs = {
+    .node_size = 0, // set per size class: the size of its stacks.
+    .max_count = 0, // set per size class.
+    // set per size class: the `next`-ptr header goes below the guard word.
+    .freelist_header_offset = 0,
+    .alloc_func = allocstack,
+    .free_func = freestack,
+    .zero_func = zerostack,
+    // None: the host-threads' stack caches play their part.
+    .magazine_size = 0,
+};
+
+static void setup_nk_thd_stack_freelist() {
+  for (int c = 0; c < NK_THD_STACK_CLASSES; c++) {
+    nk_freelist_attrs attrs = nk_thd_stack_freelist_attrs;
+    attrs.node_size = nk_thd_stack_class_size(c);
+    attrs.max_count = NK_THD_STACK_CACHE_BYTES / attrs.node_size;
+    attrs.freelist_header_offset = attrs.node_size - 2 * sizeof(void *);
+    for (int i = 0; i <= NK_NUMA_MAX_NODES; i++) {
+      nk_freelist_init(&nk_thd_stack_freelist[c][i], &attrs,
+                       (void *)(intptr_t)(i - 1));
+    }
+  }
+}
+
+// Picks the home node for a new schob: the creating host-thread's, or the
+// next in turn if created from outside the host.
+static int nk_host_home_node(nk_host *host) {
+  if (host->nnodes == 1) {
+    return 0;
+  }
+  nk_hostthd *self = nk_hostthd_self();
+  if (self && self->host == host) {
+    return self->node;
+  }
+  return __atomic_fetch_add(&host->next_node, 1, __ATOMIC_RELAXED) %
+         host->nnodes;
+}
+
+// The group that schobs created by the caller join: that of the running thread
+// or DPC, if the caller runs on `host`.
+static nk_group *nk_host_current_group(nk_host *host) {
+  nk_hostthd *self = nk_hostthd_self();
+  if (!self || self->host != host || !self->running) {
+    return NULL;
+  }
+  return self->running->group;
+}
+
+// Which stack freelist serves threads homed on the given node?
+static int nk_host_stack_node(nk_host *host, int node) {
+  if (!host->numa) {
+    return 0;
+  }
+  int id = host->numa->node_id[node];
+  return (id >= 0 && id < NK_NUMA_MAX_NODES) ? id + 1 : 0;
+}
+
+// Changes the guard of a free stack of the given size class, as recorded in
+// the stack. Returns 0 on failure, with the stack unchanged.
+static int nk_thd_stack_reguard(void *stack, int stack_class, size_t guard) {
+  size_t *word =
+      nk_thd_stack_guard_word(stack, nk_thd_stack_class_size(stack_class));
+  if (!nk_thd_stack_set_guard(stack, *word, guard)) {
+    return 0;
+  }
+  *word = guard;
+  return 1;
+}
+
+// Readies a free stack of the given size class for use with the given guard.
+// Returns 0 on failure, with the stack unchanged.
+static int nk_thd_stack_prepare(void *stack, int stack_class, size_t guard) {
+  if (!nk_thd_stack_reguard(stack, stack_class, guard)) {
+    return 0;
+  }
+  // What was given back will be committed again as the stack is used.
+  size_t *reclaimed =
+      nk_thd_stack_reclaimed_word(stack, nk_thd_stack_class_size(stack_class));
+  __atomic_fetch_add(&nk_thd_stack_committed, *reclaimed, __ATOMIC_RELAXED);
+  *reclaimed = 0;
+  return 1;
+}
+
+// Takes a stack of the given size class from the given global freelist, with
+// the given guard. Returns NULL if none can be had.
+static void *nk_thd_stack_get(int stack_class, int stack_node, size_t guard) {
+  nk_freelist *f = &nk_thd_stack_freelist[stack_class][stack_node];
+  pthread_mutex_lock(&nk_thd_stack_freelist_mutex);
+  pthread_once(&nk_thd_stack_freelist_once, &setup_nk_thd_stack_freelist);
+  void *stack = nk_freelist_alloc(f);
+  pthread_mutex_unlock(&nk_thd_stack_freelist_mutex);
+  if (stack && !nk_thd_stack_prepare(stack, stack_class, guard)) {
+    pthread_mutex_lock(&nk_thd_stack_freelist_mutex);
+    nk_freelist_free(f, stack);
+    pthread_mutex_unlock(&nk_thd_stack_freelist_mutex);
+    stack = NULL;
+  }
+  return stack;
+}
+
+// Gives the memory of a free stack of the given size class back to the
+// kernel, as the host's reclaim policy says, all but the top
+// stack_keep_bytes, where the next thread's first frames will go.
+static void nk_thd_stack_reclaim(nk_host *host, void *stack, int stack_class) {
+  if (host->attrs.stack_reclaim == NK_STACK_RECLAIM_NONE) {
+    return;
+  }
+  size_t size = nk_thd_stack_class_size(stack_class);
+  size_t guard = *nk_thd_stack_guard_word(stack, size);
+  if (guard + host->attrs.stack_keep_bytes >= size) {
+    return;
+  }
+  size_t len = size - host->attrs.stack_keep_bytes - guard;
+  int advice = host->attrs.stack_reclaim == NK_STACK_RECLAIM_LAZY
+                   ? MADV_FREE
+                   : MADV_DONTNEED;
+  if (!madvise((char *)stack + guard, len, advice)) {
+    *nk_thd_stack_reclaimed_word(stack, size) = len;
+    __atomic_fetch_sub(&nk_thd_stack_committed, len, __ATOMIC_RELAXED);
+  }
+}
+
+// Returns a stack to its global freelist. Its guard is as last recorded.
+static void nk_thd_stack_put(void *stack, int stack_class, int stack_node) {
+  pthread_mutex_lock(&nk_thd_stack_freelist_mutex);
+  nk_freelist_free(&nk_thd_stack_freelist[stack_class][stack_node], stack);
+  pthread_mutex_unlock(&nk_thd_stack_freelist_mutex);
+}
+
+// A host-thread keeps up to this many bytes of free stacks of each size class
+// in its cache (but always room for one), and moves half as many at a time
+// to or from the global freelists.
+#define NK_HOSTTHD_STACK_CACHE_BYTES (2 * 1024 * 1024)
+
+static int nk_hostthd_stack_cache_max(int stack_class) {
+  int max = NK_HOSTTHD_STACK_CACHE_BYTES / nk_thd_stack_class_size(stack_class);
+  return max > 1 ? max : 1;
+}
+
+// Moves up to `n` free stacks of the given size class from the global
+// freelist of a host-thread's node into its cache, taking the lock once.
+static void nk_hostthd_refill_stacks(nk_hostthd *thd, int stack_class, int n) {
+  size_t size = nk_thd_stack_class_size(stack_class);
+  nk_freelist *f =
+      &nk_thd_stack_freelist[stack_class][thd->stack_cache_node];
+  pthread_mutex_lock(&nk_thd_stack_freelist_mutex);
+  pthread_once(&nk_thd_stack_freelist_once, &setup_nk_thd_stack_freelist);
+  for (int i = 0; i < n; i++) {
+    void *stack = nk_freelist_alloc(f);
+    if (!stack) {
+      break;
+    }
+    *nk_thd_stack_link(stack, size) = thd->stack_cache[stack_class];
+    thd->stack_cache[stack_class] = stack;
+    thd->stack_cache_count[stack_class]++;
+  }
+  pthread_mutex_unlock(&nk_thd_stack_freelist_mutex);
+}
+
+// Moves up to `n` free stacks of the given size class from a host-thread's
+// cache back to the global freelist of its node, taking the lock once.
+static void nk_hostthd_spill_stacks(nk_hostthd *thd, int stack_class, int n) {
+  size_t size = nk_thd_stack_class_size(stack_class);
+  nk_freelist *f =
+      &nk_thd_stack_freelist[stack_class][thd->stack_cache_node];
+  pthread_mutex_lock(&nk_thd_stack_freelist_mutex);
+  for (int i = 0; i < n && thd->stack_cache[stack_class]; i++) {
+    void *stack = thd->stack_cache[stack_class];
+    thd->stack_cache[stack_class] = *nk_thd_stack_link(stack, size);
+    thd->stack_cache_count[stack_class]--;
+    nk_freelist_free(f, stack);
+  }
+  pthread_mutex_unlock(&nk_thd_stack_freelist_mutex);
+}
+
+// Moves all of a host-thread's cached stacks back to the global freelists.
+static void nk_hostthd_flush_stacks(nk_hostthd *thd) {
+  for (int c = 0; c < NK_THD_STACK_CLASSES; c++) {
+    nk_hostthd_spill_stacks(thd, c, thd->stack_cache_count[c]);
+  }
+}
+
+// Gives the memory of the free stacks on the global freelists of the given
+// node back to the kernel.
+static void nk_thd_stack_trim(int stack_node) {
+  pthread_mutex_lock(&nk_thd_stack_freelist_mutex);
+  pthread_once(&nk_thd_stack_freelist_once, &setup_nk_thd_stack_freelist);
+  for (int c = 0; c < NK_THD_STACK_CLASSES; c++) {
+    nk_freelist_trim(&nk_thd_stack_freelist[c][stack_node], 0);
+  }
+  pthread_mutex_unlock(&nk_thd_stack_freelist_mutex);
+}
+
+// Acts on nk_host_trim_stacks() for the calling host-thread, if it asked: moves
+// its cached stacks to the global freelists, and trims those. Runs on the
+// host-thread's own stack.
+static void nk_hostthd_trim_stacks(nk_hostthd *self) {
+  if (__builtin_expect(!__atomic_load_n(&self->trim_stacks, __ATOMIC_RELAXED),
+                       1)) {
+    return;
+  }
+  __atomic_store_n(&self->trim_stacks, 0, __ATOMIC_RELAXED);
+  nk_hostthd_flush_stacks(self);
+  nk_thd_stack_trim(self->stack_cache_node);
+}
+
+// The calling host-thread, if its stack cache serves the given global stack
+// freelist; else NULL.
+static nk_hostthd *nk_hostthd_stack_cache(int stack_node) {
+  nk_hostthd *self = nk_hostthd_self();
+  return self && self->stack_cache_node == stack_node ? self : NULL;
+}
+
+// Takes a free stack of the given size class from a host-thread's cache,
+// refilling the cache first if empty. Returns NULL if none can be had.
+static void *nk_hostthd_stack_cache_get(nk_hostthd *thd, int stack_class) {
+  if (!thd->stack_cache[stack_class]) {
+    nk_hostthd_refill_stacks(thd, stack_class,
+                             (nk_hostthd_stack_cache_max(stack_class) + 1) / 2);
+  }
+  void *stack = thd->stack_cache[stack_class];
+  if (stack) {
+    thd->stack_cache[stack_class] =
+        *nk_thd_stack_link(stack, nk_thd_stack_class_size(stack_class));
+    thd->stack_cache_count[stack_class]--;
+  }
+  return stack;
+}
+
+// Puts a free stack of the given size class in a host-thread's cache,
+// spilling half of the cache first if full.
+static void nk_hostthd_stack_cache_put(nk_hostthd *thd, void *stack,
+                                       int stack_class) {
+  int max = nk_hostthd_stack_cache_max(stack_class);
+  if (thd->stack_cache_count[stack_class] >= max) {
+    nk_hostthd_spill_stacks(thd, stack_class, (max + 1) / 2);
+  }
+  *nk_thd_stack_link(stack, nk_thd_stack_class_size(stack_class)) =
+      thd->stack_cache[stack_class];
+  thd->stack_cache[stack_class] = stack;
+  thd->stack_cache_count[stack_class]++;
+}
+
+// Gives a thread a stack of its size class from the calling host-thread's
+// cache, if that serves the given global freelist, or else from that
+// freelist. Returns 0 if none can be had.
+static int nk_thd_alloc_stack(nk_thd *t, int stack_node) {
+  nk_hostthd *self = nk_hostthd_stack_cache(stack_node);
+  t->stack_node = stack_node;
+  if (!self) {
+    t->stack = nk_thd_stack_get(t->stack_class, stack_node, t->stack_guard);
+    return t->stack != NULL;
+  }
+  void *stack = nk_hostthd_stack_cache_get(self, t->stack_class);
+  if (stack && !nk_thd_stack_prepare(stack, t->stack_class, t->stack_guard)) {
+    nk_hostthd_stack_cache_put(self, stack, t->stack_class);
+    stack = NULL;
+  }
+  t->stack = stack;
+  return stack != NULL;
+}
+
+// Takes a thread's stack, if it has one, recording its guard in it again (the
+// thread's frames overwrote it). Returns NULL if it has none.
+static void *nk_thd_take_stack(nk_thd *t) {
+  void *stack = t->stack;
+  if (stack) {
+    size_t size = nk_thd_stack_class_size(t->stack_class);
+    *nk_thd_stack_guard_word(stack, size) = t->stack_guard;
+    *nk_thd_stack_reclaimed_word(stack, size) = 0;
+    t->stack = NULL;
+  }
+  return stack;
+}
+
+// Returns a thread's stack, if it has one, to the calling host-thread's cache,
+// if that serves the stack's global freelist, or else to that freelist.
+static void nk_thd_free_stack(nk_host *host, nk_thd *t) {
+  void *stack = nk_thd_take_stack(t);
+  if (!stack) {
+    return;
+  }
+  nk_thd_stack_reclaim(host, stack, t->stack_class);
+  nk_hostthd *self = nk_hostthd_stack_cache(t->stack_node);
+  if (self) {
+    nk_hostthd_stack_cache_put(self, stack, t->stack_class);
+  } else {
+    nk_thd_stack_put(stack, t->stack_class, t->stack_node);
+  }
+}
+
+static __attribute__((noreturn)) void
+nk_thd_entry(void *data1, void *data2, void *data3, nk_arch_switch_ret ret);
+
+// Gives a thread in shared-stack mode, about to run on the given host-thread
+// for the first time, one of its shared stacks: preferably one that no thread
+// has in place, else the next in turn. The thread is pinned to the
+// host-thread for good. Returns 0 if the stack cannot be allocated.
+static int nk_thd_assign_shared(nk_hostthd *self, nk_thd *t) {
+  nk_host *host = self->host;
+  int n = host->attrs.shared_stacks;
+  if (!self->shared_stacks) {
+    self->shared_stacks = NK_ALLOCN(nk_shared_stack, n);
+    if (!self->shared_stacks) {
+      return 0;
+    }
+  }
+  nk_shared_stack *s = NULL;
+  for (int i = 0; i < n && !s; i++) {
+    if (!self->shared_stacks[i].owner) {
+      s = &self->shared_stacks[i];
+    }
+  }
+  if (!s) {
+    s = &self->shared_stacks[self->next_shared_stack++ % n];
+  }
+  if (!s->stack) {
+    s->stack = nk_thd_stack_get(host->shared_stack_class,
+                                nk_host_stack_node(host, self->node),
+                                NK_THD_GUARDSIZE);
+    if (!s->stack) {
+      return 0;
+    }
+  }
+  t->shared = s;
+  nk_thd_shared_link_push(&self->shared_thds, t);
+  __atomic_store_n(&t->schob.affinity, self->index, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&self->nshared, 1, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+// Copies the live part of a thread's stack out of its shared stack, which it
+// then no longer has in place. Returns 0 if there is no memory for the copy.
+static int nk_thd_save_shared(nk_host *host, nk_thd *t) {
+  char *top = (char *)t->shared->stack + host->shared_stack_bytes;
+  size_t len = top - (char *)t->stacktop;
+  // Keep the buffer just big enough.
+  if (len > t->saved_cap || len < t->saved_cap / 2) {
+    NK_FREE(t->saved);
+    t->saved_cap = 0;
+    t->saved = NK_ALLOCBYTES(char, len);
+    if (!t->saved) {
+      return 0;
+    }
+    t->saved_cap = len;
+  }
+  memcpy(t->saved, t->stacktop, len);
+  t->shared->owner = NULL;
+  return 1;
+}
+
+// Puts the stack of a thread in shared-stack mode in place on its shared
+// stack, first copying out that of the thread that had it; or, for one yet to
+// run, builds its context there. Must not be called on the shared stack in
+// question. Returns 0 if this cannot be done for now.
+static int nk_thd_load_shared(nk_hostthd *self, nk_thd *t) {
+  nk_host *host = self->host;
+  if (!t->shared && !nk_thd_assign_shared(self, t)) {
+    return 0;
+  }
+  nk_shared_stack *s = t->shared;
+  if (s->owner == t) {
+    return 1;
+  }
+  if (s->owner && !nk_thd_save_shared(host, s->owner)) {
+    return 0;
+  }
+  char *top = (char *)s->stack + host->shared_stack_bytes;
+  if (!t->stacktop) {
+    t->stacktop = nk_arch_create_ctx(top, nk_thd_entry, /* data1 = */ t,
+                                     /* data2 = */ t->entry,
+                                     /* data3 = */ t->data);
+  } else {
+    memcpy(t->stacktop, t->saved, top - (char *)t->stacktop);
+  }
+  s->owner = t;
+  return 1;
+}
+
+// Gives a thread in shared-stack mode up its shared stack, for good. Nothing
+// to give up once its host-thread is destroyed (see nk_hostthd_destroy()).
+static void nk_thd_release_shared(nk_thd *t) {
+  NK_FREE(t->saved);
+  t->saved = NULL;
+  nk_shared_stack *s = t->shared;
+  if (!s) {
+    return;
+  }
+  if (s->owner == t) {
+    s->owner = NULL;
+  }
+  t->shared = NULL;
+  nk_thd_shared_link_remove(t);
+  // Only ever released on its own host-thread.
+  __atomic_sub_fetch(&nk_hostthd_self()->nshared, 1, __ATOMIC_SEQ_CST);
+}
+
+static int nk_thd_ensure_stack(nk_hostthd *self, nk_thd *t);
+
+// Can a thread running on the given host-thread switch straight to the given
+// one? Not if that one needs its shared stack put in place: only the host
+// thread does that, as the running thread may be on that very stack.
+static int nk_thd_can_switch_to(nk_hostthd *self, nk_thd *t) {
+  if (t->copy_stack) {
+    return t->shared && t->shared->owner == t;
+  }
+  return nk_thd_ensure_stack(self, t);
+}
+
+// Makes sure that a thread about to run on the given host-thread has a stack.
+// One that is yet to run on a host with lazy stacks gets one from the
+// host-thread's stack cache, and its context is built there. One in
+// shared-stack mode gets its stack put in place. Returns 0 if no stack can be
+// had.
+static int nk_thd_ensure_stack(nk_hostthd *self, nk_thd *t) {
+  if (t->copy_stack) {
+    return nk_thd_load_shared(self, t);
+  }
+  if (t->stack) {
+    return 1;
+  }
+  if (!nk_thd_alloc_stack(t, self->stack_cache_node)) {
+    return 0;
+  }
+  t->stacktop =
+      nk_arch_create_ctx((char *)t->stack +
+                             nk_thd_stack_class_size(t->stack_class),
+                         nk_thd_entry,
+                         /* data1 = */ t, /* data2 = */ t->entry,
+                         /* data3 = */ t->data);
+  return 1;
+}
+
+// How long (in ns) a thread that could not get a stack waits on the host's
+// timing wheel before it is tried again.
+#define NK_HOSTTHD_STACK_RETRY_NS 1000000
+
+// Puts a thread that could not get a stack to sleep for a while, rather than
+// back on a run queue where host-threads would spin picking it up.
+static void nk_thd_wait_for_stack(nk_host *host, nk_thd *t) {
+  t->timer.deadline =
+      nk_deadline_after(nk_now_ns(), NK_HOSTTHD_STACK_RETRY_NS);
+  t->timer.owner = &t->schob;
+  __atomic_store_n(&t->state, NK_THD_STATE_WAITING, __ATOMIC_RELEASE);
+  if (!nk_host_timer_add(host, &t->timer)) {
+    nk_thd_wakeup(host, t, /* handoff = */ 0);
+  }
+}
+
+static __attribute__((noreturn)) void
+nk_thd_entry(void *data1, void *data2, void *data3, nk_arch_switch_ret ret) {
+  nk_thd *t = (nk_thd *)data1;
+  nk_thd_entrypoint f = (nk_thd_entrypoint)data2;
+  void *f_data = data3;
+
+  nk_hostthd_finish_switch(nk_hostthd_self(), ret);
+  f(t, f_data);
+  nk_thd_exit();
+}
+
+nk_status nk_thd_create(nk_thd **ret, nk_thd_entrypoint entry, void *data) {
+  return nk_thd_create_prio(ret, entry, data, NK_PRIO_DEFAULT);
+}
+
+nk_status nk_thd_create_prio(nk_thd **ret, nk_thd_entrypoint entry,
+                             void *data, int prio) {
+  nk_hostthd *host = nk_hostthd_self();
+  assert(host != NULL);
+  return nk_thd_create_ext_prio(host->host, ret, entry, data, prio);
+}
+
+nk_status nk_thd_create_ext(nk_host *host, nk_thd **ret,
+                            nk_thd_entrypoint entry, void *data) {
+  return nk_thd_create_ext_prio(host, ret, entry, data, NK_PRIO_DEFAULT);
+}
+
+void nk_thd_attrs_init(nk_thd_attrs *attrs) {
+  memset(attrs, 0, sizeof(*attrs));
+  attrs->stack_size = NK_THD_DEFAULT_STACK_SIZE;
+  attrs->guard_size = NK_THD_DEFAULT_GUARD_SIZE;
+}
+
+static const nk_thd_attrs nk_thd_default_attrs = {
+    .stack_size = NK_THD_DEFAULT_STACK_SIZE,
+    .guard_size = NK_THD_DEFAULT_GUARD_SIZE,
+};
+
+static nk_status nk_thd_create_in(nk_host *host, nk_thd **ret,
+                                  nk_thd_entrypoint entry, void *data,
+                                  int prio, nk_group *group,
+                                  const nk_thd_attrs *attrs) {
+  nk_status status;
+
+  int stack_class = attrs->shared_stack ? host->shared_stack_class
+                                         : nk_thd_stack_class(attrs);
+  if (stack_class < 0 ||
+      (attrs->shared_stack && host->attrs.shared_stacks <= 0)) {
+    return NK_ERR_PARAM;
+  }
+
+  int node = nk_host_home_node(host);
+  status = NK_ERR_NOMEM;
+  nk_thd *t = nk_freelist_alloc(&host->thd_freelist[node]);
+  if (!t) {
+    goto err;
+  }
+  t->schob.node = node;
+  t->entry = entry;
+  t->data = data;
+  t->stack_class = stack_class;
+  t->stack_guard = (attrs->guard_size + NK_THD_PAGESIZE - 1) &
+                   ~(size_t)(NK_THD_PAGESIZE - 1);
+
+  t->copy_stack = attrs->shared_stack;
+
+  // With lazy or shared stacks, the thread gets its stack when it first runs.
+  t->stack = NULL;
+  t->stacktop = NULL;
+  if (!host->attrs.lazy_stacks && !t->copy_stack &&
+      !nk_thd_alloc_stack(t, nk_host_stack_node(host, node))) {
+    status = NK_ERR_NOMEM;
+    goto err;
+  }
+
+  status = nk_schob_init(&t->schob, NK_SCHOB_TYPE_THD, prio);
+  if (status != NK_OK) {
+    goto err2;
+  }
+  t->schob.group = group;
+  t->state = NK_THD_STATE_RUNNABLE;
+  t->blocking = 0;
+
+  if (t->stack) {
+    t->stacktop = nk_arch_create_ctx(
+        (char *)t->stack + nk_thd_stack_class_size(stack_class), nk_thd_entry,
+        /* data1 = */ t, /* data2 = */ entry, /* data3 = */ data);
+  }
+
+  nk_schob_enqueue(host, (nk_schob *)t, /* new_schob = */ 1);
+
+  *ret = t;
+  return NK_OK;
+
+err2:
+  nk_thd_free_stack(host, t);
+err:
+  if (t) {
+    nk_freelist_free(&host->thd_freelist[node], t);
+  }
+  return status;
+}
+
+nk_status nk_thd_create_ext_prio(nk_host *host, nk_thd **ret,
+                                 nk_thd_entrypoint entry, void *data,
+                                 int prio) {
+  return nk_thd_create_in(host, ret, entry, data, prio,
+                          nk_host_current_group(host), &nk_thd_default_attrs);
+}
+
+nk_status nk_thd_create_ext_attrs(nk_host *host, nk_thd **ret,
+                                  nk_thd_entrypoint entry, void *data,
+                                  const nk_thd_attrs *attrs) {
+  return nk_thd_create_in(host, ret, entry, data, NK_PRIO_DEFAULT,
+                          nk_host_current_group(host), attrs);
+}
+
+nk_status nk_thd_create_group(nk_group *group, nk_thd **ret,
+                              nk_thd_entrypoint entry, void *data) {
+  nk_host *host = group->host;
+  return nk_thd_create_in(host, ret, entry, data, NK_PRIO_DEFAULT,
+                          group == &host->root_group ? NULL : group,
+                          &nk_thd_default_attrs);
+}
+
+static void nk_thd_destroy(nk_host *host, nk_thd *t) {
+  nk_thd_free_stack(host, t);
+  nk_thd_release_shared(t);
+  nk_schob_destroy(&t->schob);
+  nk_freelist_free(&host->thd_freelist[t->schob.node], t);
+}
+
+nk_status nk_thd_set_priority(nk_thd *thd, int prio) {
+  if (prio < 0 || prio >= NK_PRIO_LEVELS) {
+    return NK_ERR_PARAM;
+  }
+  // Takes effect the next time the thread is queued.
+  __atomic_store_n(&thd->schob.prio, prio, __ATOMIC_RELAXED);
+  return NK_OK;
+}
+
+nk_status nk_thd_set_affinity(nk_thd *thd, int hostthd) {
+  // (A thread in shared-stack mode is pinned where its shared stack is.)
+  if (hostthd < NK_AFFINITY_SOFT || thd->copy_stack) {
+    return NK_ERR_PARAM;
+  }
+  // Takes effect the next time the thread is queued.
+  __atomic_store_n(&thd->schob.affinity, hostthd, __ATOMIC_RELAXED);
+  return NK_OK;
+}
+
+void nk_thd_prepare_wait(nk_thd *self) {
+  __atomic_store_n(&self->state, NK_THD_STATE_PARKING, __ATOMIC_RELEASE);
+}
+
+// Marks a waiting thread runnable. Returns 0 if it is still leaving its
+// context, in which case the switch away queues it; otherwise the caller must.
+static int nk_thd_make_runnable(nk_thd *thd) {
+  int state = __atomic_load_n(&thd->state, __ATOMIC_ACQUIRE);
+  do {
+    assert(state == NK_THD_STATE_PARKING || state == NK_THD_STATE_WAITING);
+  } while (!__atomic_compare_exchange_n(&thd->state, &state,
+                                        NK_THD_STATE_RUNNABLE, /* weak = */ 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  return state == NK_THD_STATE_WAITING;
+}
+
+void nk_thd_wakeup(nk_host *host, nk_thd *thd, int handoff) {
+  if (!nk_thd_make_runnable(thd)) {
+    return;
+  }
+  if (handoff) {
+    nk_schob_handoff(host, &thd->schob);
+  } else {
+    nk_schob_enqueue(host, &thd->schob, /* new_schob = */ 0);
+  }
+}
+
+void nk_thd_wakeup_batch(nk_host *host, nk_thd **thds, int n) {
+  nk_hostthd *self = nk_hostthd_self();
+  int local = self && self->host == host;
+  int queued = 0;
+  for (int i = 0; i < n; i++) {
+    if (!nk_thd_make_runnable(thds[i])) {
+      continue;
+    }
+    nk_schob *s = &thds[i]->schob;
+    if (nk_schob_enqueue_affine(host, local ? self : NULL, s) ||
+        nk_group_enqueue(host, s)) {
+      continue;
+    }
+    nk_schob_stamp(host, s);
+    int prio = __atomic_load_n(&s->prio, __ATOMIC_RELAXED);
+    if (!local || !nk_deque_push(&self->runq[prio], s)) {
+      nk_mpscq_push(&host->runq[prio], &s->runq);
+    }
+    nk_host_prio_set(host, prio);
+    queued++;
+  }
+  // On the host, the caller runs the first one itself.
+  if (queued > local) {
+    nk_host_wake_idle(host);
+  }
+}
+
+void nk_thd_yield_ext(nk_thd_yield_reason r) {
+  nk_hostthd *host = nk_hostthd_self();
+  assert(host != NULL);
+  nk_thd *self = nk_thd_self();
+  assert(self != NULL);
+
+  if (r == NK_THD_YIELD_REASON_WAITING &&
+      __atomic_load_n(&self->state, __ATOMIC_ACQUIRE) ==
+          NK_THD_STATE_RUNNABLE) {
+    // Woken before we even switched away.
+    __atomic_store_n(&self->state, NK_THD_STATE_RUNNING, __ATOMIC_RELAXED);
+    return;
+  }
+
+  nk_hostthd_run_end(host, &self->schob);
+
+  // Pick the next schob right here, so that we can switch straight to it
+  // rather than through the host thread's scheduler context. A thread that is
+  // still ready gives way only to work at least as urgent as itself, and
+  // carries on if there is none -- unless it is pinned to another host-thread.
+  // (A host-thread about to retire to the spare pool, or to trim its stack
+  // cache, takes nothing more: it does that in its scheduler context.)
+  nk_schob *next = NULL;
+  if (!__atomic_load_n(&host->host->shutdown, __ATOMIC_RELAXED) &&
+      !__atomic_load_n(&host->retire, __ATOMIC_SEQ_CST) &&
+      !__atomic_load_n(&host->trim_stacks, __ATOMIC_RELAXED)) {
+    int limit = (r == NK_THD_YIELD_REASON_READY)
+                    ? __atomic_load_n(&self->schob.prio, __ATOMIC_RELAXED)
+                    : NK_PRIO_LOWEST;
+    next = nk_schob_pick(host, limit);
+    assert(next != &self->schob);
+    if (!next && r == NK_THD_YIELD_REASON_READY &&
+        !nk_schob_pinned_elsewhere(host, &self->schob)) {
+      nk_hostthd_run_begin(host);
+      return;
+    }
+  }
+
+  if (next) {
+    nk_host_check_delay(host->host, next);
+    next->last_ran = host->index;
+  }
+
+  nk_arch_switch_ret ret;
+  if (next && next->type == NK_SCHOB_TYPE_THD &&
+      nk_thd_can_switch_to(host, (nk_thd *)next)) {
+    nk_thd *t = (nk_thd *)next;
+    __atomic_store_n(&t->state, NK_THD_STATE_RUNNING, __ATOMIC_RELAXED);
+    host->running = next;
+    nk_hostthd_run_begin(host);
+    ret = nk_arch_switch_ctx(&self->stacktop, t->stacktop, r, self);
+  } else {
+    // No thread to switch to directly: go back to the host thread, which will
+    // run `next` (a DPC, or a thread still without its stack in place, if
+    // any) or look for work.
+    host->stash = next;
+    host->running = NULL;
+    ret = nk_arch_switch_ctx(&self->stacktop, host->hoststack, r, self);
+  }
+  // We may now be on a different host thread.
+  nk_hostthd_finish_switch(nk_hostthd_self(), ret);
+}
+
+void nk_thd_yield() { nk_thd_yield_ext(NK_THD_YIELD_REASON_READY); }
+
+void nk_thd_sleep(uint64_t ns) {
+  nk_hostthd *host = nk_hostthd_self();
+  assert(host != NULL);
+  nk_thd *self = nk_thd_self();
+  assert(self != NULL);
+
+  // Not on our stack, which may not be in place while we wait (see
+  // nk_thd_attrs::shared_stack). We cannot return before it expires.
+  nk_timer *timer = &self->timer;
+  timer->deadline = nk_deadline_after(nk_now_ns(), ns);
+  timer->owner = &self->schob;
+  // Waiting before the timer is visible, since it may expire right away on
+  // another host-thread.
+  nk_thd_prepare_wait(self);
+  if (!nk_host_timer_add(host->host, timer)) {
+    __atomic_store_n(&self->state, NK_THD_STATE_RUNNING, __ATOMIC_RELAXED);
+    nk_thd_yield();
+    return;
+  }
+  nk_thd_yield_ext(NK_THD_YIELD_REASON_WAITING);
+}
+
+void nk_thd_exit() {
+  // Should never return.
+  nk_thd_yield_ext(NK_THD_YIELD_REASON_ZOMBIE);
+  while (1) {
+    assert(0);
+  }
+}
+
+static void nk_hostthd_shed(nk_hostthd *self);
+static nk_hostthd *nk_host_activate_spare(nk_host *host);
+
+void nk_blocking_begin() {
+  nk_hostthd *host = nk_hostthd_self();
+  assert(host != NULL);
+  nk_thd *self = nk_thd_self();
+  assert(self != NULL);
+  assert(!self->blocking);
+
+  // Nothing queued here should wait for the blocking call.
+  nk_hostthd_shed(host);
+  __atomic_add_fetch(&host->host->nblocking, 1, __ATOMIC_SEQ_CST);
+  self->blocking = 1;
+  self->cover = nk_host_activate_spare(host->host);
+}
+
+void nk_blocking_end() {
+  nk_hostthd *host = nk_hostthd_self();
+  assert(host != NULL);
+  nk_thd *self = nk_thd_self();
+  assert(self != NULL);
+  assert(self->blocking);
+
+  nk_hostthd *cover = self->cover;
+  self->blocking = 0;
+  self->cover = NULL;
+  __atomic_sub_fetch(&host->host->nblocking, 1, __ATOMIC_SEQ_CST);
+  if (cover) {
+    // Rather than run one host-thread too many, send the spare back to the
+    // pool once it next comes to schedule. (The spare, not ours: work pinned
+    // to ours should not lose its host-thread.) Unless another thread's
+    // blocking section claims it first, see nk_host_activate_spare().
+    __atomic_store_n(&cover->retire, 1, __ATOMIC_SEQ_CST);
+    nk_hostthd_unpark_other(cover);
+  }
+}
+
+void nk_preempt_enable() {
+  nk_hostthd *host = nk_hostthd_self();
+  assert(host != NULL);
+  nk_thd *self = nk_thd_self();
+  assert(self != NULL);
+  assert(!self->preemptible);
+
+  if (__atomic_load_n(&host->overdue, __ATOMIC_RELAXED)) {
+    nk_thd_yield();
+  }
+  // Only the signal handler, on this same system thread, looks at the flag.
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  __atomic_store_n(&self->preemptible, 1, __ATOMIC_RELAXED);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+void nk_preempt_disable() {
+  nk_thd *self = nk_thd_self();
+  assert(self != NULL);
+  assert(self->preemptible);
+
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  __atomic_store_n(&self->preemptible, 0, __ATOMIC_RELAXED);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+// ------------- dpc -----------
+
+nk_status nk_dpc_create(nk_dpc **ret, nk_dpc_func func, void *data) {
+  return nk_dpc_create_prio(ret, func, data, NK_PRIO_DEFAULT);
+}
+
+nk_status nk_dpc_create_prio(nk_dpc **ret, nk_dpc_func func, void *data,
+                             int prio) {
+  nk_hostthd *host = nk_hostthd_self();
+  assert(host != NULL);
+  return nk_dpc_create_ext_prio(host->host, ret, func, data, prio);
+}
+
+nk_status nk_dpc_create_ext(nk_host *host, nk_dpc **ret, nk_dpc_func func,
+                            void *data) {
+  return nk_dpc_create_ext_prio(host, ret, func, data, NK_PRIO_DEFAULT);
+}
+
+nk_status nk_dpc_create_on(nk_dpc **ret, int hostthd, nk_dpc_func func,
+                           void *data) {
+  nk_hostthd *host = nk_hostthd_self();
+  assert(host != NULL);
+  return nk_dpc_create_ext_on(host->host, ret, hostthd, func, data);
+}
+
+static nk_status nk_dpc_create_in(nk_host *host, nk_dpc **ret,
+                                  nk_dpc_func func, void *data, int prio,
+                                  int affinity, nk_group *group) {
+  nk_status status;
+
+  int node = nk_host_home_node(host);
+  status = NK_ERR_NOMEM;
+  nk_dpc *d = nk_freelist_alloc(&host->dpc_freelist[node]);
+  if (!d) {
+    goto err;
+  }
+  d->schob.node = node;
+
+  d->func = func;
+  d->data = data;
+
+  status = nk_schob_init(&d->schob, NK_SCHOB_TYPE_DPC, prio);
+  if (status != NK_OK) {
+    goto err;
+  }
+  d->schob.affinity = affinity;
+  d->schob.group = group;
+
+  nk_schob_enqueue(host, (nk_schob *)d, /* new_schob = */ 1);
+
+  *ret = d;
+  return NK_OK;
+
+err:
+  if (d) {
+    nk_freelist_free(&host->dpc_freelist[node], d);
+  }
+  return status;
+}
+
+nk_status nk_dpc_create_ext_prio(nk_host *host, nk_dpc **ret,
+                                 nk_dpc_func func, void *data, int prio) {
+  return nk_dpc_create_in(host, ret, func, data, prio, NK_AFFINITY_NONE,
+                          nk_host_current_group(host));
+}
+
+nk_status nk_dpc_create_ext_on(nk_host *host, nk_dpc **ret, int hostthd,
+                               nk_dpc_func func, void *data) {
+  if (hostthd < NK_AFFINITY_NONE) {
+    return NK_ERR_PARAM;
+  }
+  return nk_dpc_create_in(host, ret, func, data, NK_PRIO_DEFAULT, hostthd,
+                          nk_host_current_group(host));
+}
+
+nk_status nk_dpc_create_group(nk_group *group, nk_dpc **ret, nk_dpc_func func,
+                              void *data) {
+  nk_host *host = group->host;
+  return nk_dpc_create_in(host, ret, func, data, NK_PRIO_DEFAULT,
+                          NK_AFFINITY_NONE,
+                          group == &host->root_group ? NULL : group);
+}
+
+static void nk_dpc_destroy(nk_host *host, nk_dpc *dpc) {
+  nk_schob_destroy(&dpc->schob);
+  nk_freelist_free(&host->dpc_freelist[dpc->schob.node], dpc);
+}
+
+// Creates a DPC that waits on the host's timing wheel until `when`, and then
+// every `period` ns after that if `period` is nonzero.
+static nk_status nk_dpc_create_timed(nk_host *host, nk_dpc **ret,
+                                     uint64_t when, uint64_t period,
+                                     nk_dpc_func func, void *data) {
+  nk_status status;
+
+  int node = nk_host_home_node(host);
+  status = NK_ERR_NOMEM;
+  nk_dpc *d = nk_freelist_alloc(&host->dpc_freelist[node]);
+  if (!d) {
+    goto err;
+  }
+  d->schob.node = node;
+
+  d->func = func;
+  d->data = data;
+  d->period = period;
+  d->timer.deadline = when;
+  d->timer.owner = d;
+
+  status = nk_schob_init(&d->schob, NK_SCHOB_TYPE_DPC, NK_PRIO_DEFAULT);
+  if (status != NK_OK) {
+    goto err;
+  }
+  d->schob.group = nk_host_current_group(host);
+
+  __atomic_add_fetch(&host->schob_count, 1, __ATOMIC_SEQ_CST);
+  *ret = d;
+  if (!nk_host_timer_add(host, &d->timer)) {
+    nk_schob_enqueue(host, (nk_schob *)d, /* new_schob = */ 0);
+  }
+  return NK_OK;
+
+err:
+  if (d) {
+    nk_freelist_free(&host->dpc_freelist[node], d);
+  }
+  return status;
+}
+
+nk_status nk_dpc_create_at(nk_dpc **ret, uint64_t when, nk_dpc_func func,
+                           void *data) {
+  nk_hostthd *host = nk_hostthd_self();
+  assert(host != NULL);
+  return nk_dpc_create_timed(host->host, ret, when, 0, func, data);
+}
+
+nk_status nk_dpc_create_after(nk_dpc **ret, uint64_t delay, nk_dpc_func func,
+                              void *data) {
+  return nk_dpc_create_at(ret, nk_deadline_after(nk_now_ns(), delay), func,
+                          data);
+}
+
+nk_status nk_dpc_create_ext_at(nk_host *host, nk_dpc **ret, uint64_t when,
+                               nk_dpc_func func, void *data) {
+  return nk_dpc_create_timed(host, ret, when, 0, func, data);
+}
+
+nk_status nk_dpc_create_periodic(nk_dpc **ret, uint64_t period,
+                                 nk_dpc_func func, void *data) {
+  nk_hostthd *host = nk_hostthd_self();
+  assert(host != NULL);
+  return nk_dpc_create_ext_periodic(host->host, ret, period, func, data);
+}
+
+nk_status nk_dpc_create_ext_periodic(nk_host *host, nk_dpc **ret,
+                                     uint64_t period, nk_dpc_func func,
+                                     void *data) {
+  if (period == 0) {
+    return NK_ERR_PARAM;
+  }
+  return nk_dpc_create_timed(host, ret,
+                             nk_deadline_after(nk_now_ns(), period), period,
+                             func, data);
+}
+
+nk_status nk_dpc_cancel(nk_dpc *dpc) {
+  nk_hostthd *self = nk_hostthd_self();
+  assert(self != NULL);
+  nk_host *host = self->host;
+
+  pthread_spin_lock(&host->timer_lock);
+  int pending = dpc->timer.pending;
+  if (pending) {
+    nk_timer_wheel_remove(&host->timers, &dpc->timer);
+  }
+  dpc->period = 0;
+  pthread_spin_unlock(&host->timer_lock);
+
+  if (!pending) {
+    return NK_ERR_STATE;
+  }
+  nk_dpc_destroy(host, dpc);
+  nk_host_schob_destroyed(host);
+  return NK_OK;
+}
+
+// Puts a periodic DPC that has just run back on the timing wheel. Returns 0
+// if it is not periodic (any more), in which case the caller destroys it.
+static int nk_dpc_rearm(nk_host *host, nk_dpc *dpc) {
+  uint64_t now = nk_now_ns();
+  int added = 0, earlier = 0;
+  // Under the lock, so that a concurrent nk_dpc_cancel() either stops us here
+  // or finds the DPC back on the wheel.
+  pthread_spin_lock(&host->timer_lock);
+  uint64_t period = dpc->period;
+  if (period) {
+    uint64_t deadline = nk_deadline_after(dpc->timer.deadline, period);
+    if (deadline <= now) {
+      // Overran: skip the runs we missed.
+      deadline = nk_deadline_after(now, period);
+    }
+    dpc->timer.deadline = deadline;
+    added = nk_host_timer_add_locked(host, &dpc->timer, &earlier);
+  }
+  pthread_spin_unlock(&host->timer_lock);
+  if (earlier) {
+    nk_host_kick_poller(host, /* retime = */ 1);
+  }
+  if (period && !added) {
+    nk_schob_enqueue(host, &dpc->schob, /* new_schob = */ 0);
+  }
+  return period != 0;
+}
+
+// ------------- group -----------
+
+static void nk_group_init(nk_host *host, nk_group *g, int weight) {
+  g->host = host;
+  g->weight = weight;
+  for (int i = 0; i < NK_PRIO_LEVELS; i++) {
+    nk_mpscq_init(&g->runq[i]);
+  }
+}
+
+nk_status nk_group_create(nk_host *host, nk_group **ret, int weight) {
+  nk_status status;
+
+  status = NK_ERR_PARAM;
+  nk_group *g = NULL;
+  if (weight < 1 || weight > NK_GROUP_WEIGHT_MAX) {
+    goto err;
+  }
+
+  status = NK_ERR_NOMEM;
+  g = NK_ALLOC(nk_group);
+  if (!g) {
+    goto err;
+  }
+  nk_group_init(host, g, weight);
+  // Starts level with the groups that are running.
+  g->vtime = __atomic_load_n(&host->vtime_floor, __ATOMIC_RELAXED);
+
+  status = NK_ERR_NOMEM;
+  pthread_mutex_lock(&host->runq_mutex);
+  int n = host->ngroups;
+  if (n < NK_GROUP_MAX) {
+    __atomic_store_n(&host->groups[n], g, __ATOMIC_RELEASE);
+    __atomic_store_n(&host->ngroups, n + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&host->runq_mutex);
+  if (n == NK_GROUP_MAX) {
+    goto err;
+  }
+
+  *ret = g;
+  return NK_OK;
+
+err:
+  if (g) {
+    NK_FREE(g);
+  }
+  return status;
+}
+
+nk_group *nk_host_root_group(nk_host *host) { return &host->root_group; }
+
+nk_status nk_group_set_weight(nk_group *group, int weight) {
+  if (weight < 1 || weight > NK_GROUP_WEIGHT_MAX) {
+    return NK_ERR_PARAM;
+  }
+  __atomic_store_n(&group->weight, weight, __ATOMIC_RELAXED);
+  return NK_OK;
+}
+
+uint64_t nk_group_cpu_ns(nk_group *group) {
+  return __atomic_load_n(&group->cpu_ns, __ATOMIC_RELAXED);
+}
+
+// --------------- hostthd ---------------
+
+// Drops the host's schob count after a thd or DPC is destroyed. When the last
+// one goes away, all parked host-threads are woken so that they can exit.
+static void nk_host_schob_destroyed(nk_host *host) {
+  if (__atomic_sub_fetch(&host->schob_count, 1, __ATOMIC_SEQ_CST) == 0) {
+    nk_host_unpark_all(host);
+  }
+}
+
+static int nk_host_should_exit(nk_host *host) {
+  return __atomic_load_n(&host->shutdown, __ATOMIC_RELAXED) ||
+         __atomic_load_n(&host->schob_count, __ATOMIC_SEQ_CST) == 0;
+}
+
+// How many host-threads are in service and not blocked?
+static int nk_host_workers(nk_host *host) {
+  return __atomic_load_n(&host->hostthd_count, __ATOMIC_SEQ_CST) -
+         __atomic_load_n(&host->nspare_idle, __ATOMIC_SEQ_CST) -
+         __atomic_load_n(&host->nblocking, __ATOMIC_SEQ_CST);
+}
+
+// Starts counting the host-thread as spinning for work. Returns 0 if it should
+// park straight away instead: spinning is disabled or pointless (one CPU), or
+// enough host-threads are spinning already. As in Go's scheduler, spinners are
+// capped at half of the host-threads that are not parked, so that a mostly
+// idle host does not burn every CPU.
+static int nk_hostthd_spin_begin(nk_hostthd *self) {
+  nk_host *host = self->host;
+  if (host->attrs.idle_spin_ns == 0 || host->ncpus <= 1) {
+    return 0;
+  }
+  int active = nk_host_workers(host) -
+               __atomic_load_n(&host->nparked, __ATOMIC_SEQ_CST);
+  if (active > host->ncpus) {
+    active = host->ncpus;
+  }
+  if (2 * __atomic_load_n(&host->nspinning, __ATOMIC_SEQ_CST) >= active) {
+    return 0;
+  }
+  __atomic_add_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+// Stops counting the host-thread as spinning. Enqueuers do not wake anyone
+// while a host-thread spins, so if this was the last spinner and it found
+// work, it wakes another host-thread if more work is queued. (An enqueuer
+// that saw us spinning set its level's bit before looking.)
+static void nk_hostthd_spin_end(nk_hostthd *self, int found) {
+  nk_host *host = self->host;
+  if (__atomic_sub_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST) == 0 &&
+      found && (__atomic_load_n(&host->prio_mask, __ATOMIC_SEQ_CST) ||
+                nk_host_groups_pending(host))) {
+    nk_host_wake_idle(host);
+  }
+}
+
+// Looks for work until some is found, the spin period elapses, or the host
+// exits.
+static nk_schob *nk_hostthd_spin(nk_hostthd *self) {
+  nk_host *host = self->host;
+  uint64_t deadline = nk_now_ns() + host->attrs.idle_spin_ns;
+  do {
+    nk_schob *next = nk_schob_next(self);
+    if (next) {
+      return next;
+    }
+    if (nk_host_should_exit(host)) {
+      break;
+    }
+    __builtin_ia32_pause();
+  } while (nk_now_ns() < deadline);
+  return NULL;
+}
+
+// Removes the host-thread from the idle list. Returns 0 if a waker already
+// took it off (and so counted it as spinning).
+static int nk_hostthd_unpark_self(nk_hostthd *self) {
+  nk_host *host = self->host;
+  pthread_spin_lock(&host->idle_lock);
+  int parked = self->parked;
+  if (parked) {
+    nk_hostthd_idle_remove(self);
+    self->parked = 0;
+    __atomic_sub_fetch(&host->nparked, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_spin_unlock(&host->idle_lock);
+  return parked;
+}
+
+// Blocks the poller in the host's epoll instance for up to `timeout_ns`
+// (forever if negative), unless its parking word changes first. Returns how
+// many threads became ready.
+static int nk_hostthd_poll_io(nk_hostthd *self, int64_t timeout_ns) {
+  nk_host *host = self->host;
+  int n = 0;
+  __atomic_store_n(&self->polling, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&host->io_blocked, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&self->park, __ATOMIC_SEQ_CST) == 0) {
+    n = nk_io_poll(host, timeout_ns);
+  }
+  __atomic_store_n(&host->io_blocked, 0, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&self->polling, 0, __ATOMIC_SEQ_CST);
+  return n;
+}
+
+// Registers the host-thread on the idle list, rescans the run queues once, and
+// then sleeps on its parking word until woken. If no other parked host-thread
+// is the host's poller, this one is: it waits for the next timer, and for
+// file descriptors in the epoll instance, and returns when a timer is due or
+// threads became ready. Returns a schob if the rescan found one. On return,
+// `*spinning` is set if a waker counted the host-thread as spinning on its
+// behalf.
+static int nk_hostthd_shrink(nk_hostthd *self);
+
+static nk_schob *nk_hostthd_park(nk_hostthd *self, int *spinning) {
+  nk_host *host = self->host;
+  uint64_t parked_at = host->attrs.max_workers ? nk_now_ns() : 0;
+  pthread_spin_lock(&host->idle_lock);
+  __atomic_store_n(&self->park, 0, __ATOMIC_RELAXED);
+  self->parked = 1;
+  nk_hostthd_idle_push(&host->idle_hostthds, self);
+  __atomic_add_fetch(&host->nparked, 1, __ATOMIC_SEQ_CST);
+  pthread_spin_unlock(&host->idle_lock);
+
+  // Register *before* the final rescan, so that a concurrent enqueuer either
+  // sees us parked and wakes us, or is seen below.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  nk_schob *next = NULL;
+  int retry = nk_host_should_exit(host) ||
+              __atomic_load_n(&self->retire, __ATOMIC_SEQ_CST);
+  if (!retry) {
+    next = nk_schob_next(self);
+    // If a level is still marked non-empty, another host-thread is draining
+    // the global queue or a producer is midway through a push. Retry rather
+    // than sleep past the work.
+    retry = !next && (__atomic_load_n(&host->prio_mask, __ATOMIC_SEQ_CST) ||
+                      __atomic_load_n(&self->inbox_mask, __ATOMIC_SEQ_CST) ||
+                      nk_host_groups_pending(host));
+  }
+  if (next || retry) {
+    *spinning = !nk_hostthd_unpark_self(self);
+    if (!next) {
+      sched_yield();
+    }
+    return next;
+  }
+
+  int poller = 0;
+  int park;
+  while ((park = __atomic_load_n(&self->park, __ATOMIC_ACQUIRE)) != 1) {
+    if (park == NK_HOSTTHD_PARK_RETIME) {
+      __atomic_compare_exchange_n(&self->park, &park, 0, /* weak = */ 0,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (!poller) {
+      nk_hostthd *none = NULL;
+      poller = __atomic_compare_exchange_n(&host->poller, &none, self,
+                                           /* weak = */ 0, __ATOMIC_SEQ_CST,
+                                           __ATOMIC_RELAXED);
+    }
+    if (!poller) {
+      if (!host->attrs.max_workers) {
+        nk_futex_wait(&self->park, 0);
+        continue;
+      }
+      // Elastic: exit if left idle for long enough.
+      nk_futex_wait_timeout(&self->park, 0, host->attrs.shrink_idle_ns);
+      if (__atomic_load_n(&self->park, __ATOMIC_ACQUIRE) == 0 &&
+          nk_now_ns() - parked_at >= host->attrs.shrink_idle_ns &&
+          nk_hostthd_shrink(self)) {
+        *spinning = 0;
+        return NULL;
+      }
+      continue;
+    }
+    int64_t timeout = -1;
+    uint64_t next = __atomic_load_n(&host->timer_next, __ATOMIC_SEQ_CST);
+    if (next != UINT64_MAX) {
+      uint64_t now = nk_now_ns();
+      if (next <= now) {
+        break;
+      }
+      timeout = next - now;
+    }
+    if (__atomic_load_n(&host->io_waiters, __ATOMIC_SEQ_CST)) {
+      if (nk_hostthd_poll_io(self, timeout) > 0) {
+        break;
+      }
+    } else if (timeout < 0) {
+      nk_futex_wait(&self->park, 0);
+    } else {
+      nk_futex_wait_timeout(&self->park, 0, timeout);
+    }
+  }
+  if (poller) {
+    __atomic_store_n(&host->poller, NULL, __ATOMIC_SEQ_CST);
+  }
+  if (park != 1) {
+    // A timer is due, or threads we polled are ready: go and run them.
+    *spinning = !nk_hostthd_unpark_self(self);
+    return NULL;
+  }
+  *spinning = 1;
+  return NULL;
+}
+
+// Idle path: spins looking for work for up to the host's idle_spin_ns, then
+// parks until an enqueuer wakes it, a timer is due or a file descriptor is
+// ready. Returns NULL if the host exits, or the host-thread is to exit or
+// retire. Assumes no locks are held.
+static nk_schob *nk_hostthd_wait(nk_hostthd *self) {
+  nk_host *host = self->host;
+  nk_schob *next = NULL;
+  int spinning = 0;
+  while (!nk_host_should_exit(host) && !self->exiting &&
+         !__atomic_load_n(&self->retire, __ATOMIC_SEQ_CST)) {
+    nk_hostthd_trim_stacks(self);
+    // Nothing else to run here, so no reason to hold queued file operations
+    // back.
+    nk_io_submit(host);
+    nk_host_poll_timers(host);
+    if (__atomic_load_n(&host->io_waiters, __ATOMIC_SEQ_CST)) {
+      nk_io_poll(host, 0);
+    }
+    if (!spinning) {
+      spinning = nk_hostthd_spin_begin(self);
+    }
+    if (spinning) {
+      next = nk_hostthd_spin(self);
+      nk_hostthd_spin_end(self, next != NULL);
+      spinning = 0;
+      if (next || nk_host_should_exit(host)) {
+        break;
+      }
+    }
+    next = nk_hostthd_park(self, &spinning);
+    if (next) {
+      break;
+    }
+  }
+  if (spinning) {
+    nk_hostthd_spin_end(self, next != NULL);
+  }
+  if (next) {
+    // If we were the poller, hand that over to another parked host-thread.
+    nk_host_kick_poller(host, /* retime = */ 0);
+  }
+  return next;
+}
+
+// Moves everything queued on the host-thread -- its batch, its run-next slot,
+// its local run queues and its affine queues -- to the global run queue, and
+// signals idle host-threads to come and take it. Assumes no locks are held.
+static void nk_hostthd_shed(nk_hostthd *self) {
+  nk_host *host = self->host;
+  nk_hostthd_flush_batch(self);
+  nk_schob *s = __atomic_exchange_n(&self->runnext, NULL, __ATOMIC_ACQ_REL);
+  if (s) {
+    nk_schob_enqueue_global(host, s);
+  }
+  for (int i = 0; i < NK_PRIO_LEVELS; i++) {
+    while ((s = nk_deque_steal(&self->runq[i])) != NULL) {
+      nk_schob_enqueue_global(host, s);
+    }
+    while ((s = nk_schob_pop(&self->affine[i])) != NULL) {
+      nk_schob_enqueue_global(host, s);
+    }
   }
-  return status;
 }
 
-static void nk_thd_destroy(nk_thd *t) {
-  nk_hostthd *hostthd = nk_hostthd_self();
-  assert(hostthd != NULL);
-  nk_host *host = hostthd->host;
+static nk_status nk_hostthd_create_locked(nk_hostthd **ret, nk_host *host,
+                                          int index);
 
-  pthread_mutex_lock(&nk_thd_stack_freelist_mutex);
-  nk_freelist_free(&nk_thd_stack_freelist, t->stack);
-  pthread_mutex_unlock(&nk_thd_stack_freelist_mutex);
-
-  pthread_spin_destroy(&t->running_lock);
-  nk_schob_destroy(&t->schob);
-  nk_freelist_free(&host->thd_freelist, t);
+// Puts another host-thread into service: one from the spare pool, or else a
+// new one in a free slot of the host's array, restarting an exited one there
+// if need be. Returns NULL if the array is full. The caller holds runq_mutex.
+static nk_hostthd *nk_host_add_hostthd_locked(nk_host *host) {
+  nk_hostthd *h = nk_hostthd_spare_shift(&host->spare_hostthds);
+  if (h) {
+    __atomic_sub_fetch(&host->nspare_idle, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&h->serving, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&h->spare_wait, 0, __ATOMIC_SEQ_CST);
+    nk_futex_wake(&h->spare_wait);
+    return h;
+  }
+  for (int i = 0; i < host->hostthd_array_len; i++) {
+    h = host->hostthd_array[i];
+    if (!h || (h->exited && !h->joined)) {
+      return nk_hostthd_create_locked(&h, host, i) == NK_OK ? h : NULL;
+    }
+  }
+  return NULL;
 }
 
-void nk_thd_yield_ext(nk_thd_yield_reason r) {
-  nk_hostthd *host = nk_hostthd_self();
-  assert(host != NULL);
-  nk_thd *self = nk_thd_self();
-  assert(self != NULL);
-  // Context-switch back to host thread, which will schedule the next item.
-  nk_arch_switch_ctx(&self->stacktop, host->hoststack, r);
+// Puts a spare host-thread into service for one blocked in a blocking
+// section: preferably one still in service that was about to retire, else one
+// from the pool. Returns NULL if there is none to spare: the host's array has
+// room for blocking_spares host-threads beyond its workers. Assumes no locks
+// are held.
+static nk_hostthd *nk_host_activate_spare(nk_host *host) {
+  if (nk_host_should_exit(host)) {
+    return NULL;
+  }
+  pthread_mutex_lock(&host->runq_mutex);
+  nk_hostthd *h = NULL;
+  for (int i = 0; i < host->hostthd_array_len && !h; i++) {
+    nk_hostthd *r = host->hostthd_array[i];
+    int one = 1;
+    if (r && __atomic_compare_exchange_n(&r->retire, &one, 0, /* weak = */ 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      h = r;
+    }
+  }
+  if (!h) {
+    h = nk_host_add_hostthd_locked(host);
+  }
+  pthread_mutex_unlock(&host->runq_mutex);
+  return h;
 }
 
-void nk_thd_yield() { nk_thd_yield_ext(NK_THD_YIELD_REASON_READY); }
-
-void nk_thd_exit() {
-  nk_hostthd *host = nk_hostthd_self();
-  assert(host != NULL);
-  nk_thd *self = nk_thd_self();
-  assert(self != NULL);
-  // Should never return.
-  nk_arch_switch_ctx(&self->stacktop, host->hoststack,
-                     NK_THD_YIELD_REASON_ZOMBIE);
-  while (1) {
-    assert(0);
+// In elastic mode, adds a worker if `next` has waited on a run queue for
+// longer than the host's grow_delay_ns while no worker was idle to take it.
+// Adds at most one worker per grow_delay_ns. Assumes no locks are held.
+static void nk_host_check_delay(nk_host *host, nk_schob *next) {
+  if (!host->attrs.max_workers) {
+    return;
+  }
+  uint64_t delay = host->attrs.grow_delay_ns;
+  uint64_t now = nk_now_ns();
+  if (now - next->queued_at < delay ||
+      __atomic_load_n(&host->nparked, __ATOMIC_SEQ_CST) ||
+      __atomic_load_n(&host->nspinning, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+  uint64_t last = __atomic_load_n(&host->last_grow, __ATOMIC_RELAXED);
+  if (now - last < delay ||
+      !__atomic_compare_exchange_n(&host->last_grow, &last, now,
+                                   /* weak = */ 0, __ATOMIC_SEQ_CST,
+                                   __ATOMIC_RELAXED)) {
+    return;
+  }
+  pthread_mutex_lock(&host->runq_mutex);
+  if (!nk_host_should_exit(host) &&
+      nk_host_workers(host) < host->attrs.max_workers &&
+      nk_host_add_hostthd_locked(host)) {
+    __atomic_add_fetch(&host->grown, 1, __ATOMIC_SEQ_CST);
   }
+  pthread_mutex_unlock(&host->runq_mutex);
 }
 
-// ------------- dpc -----------
-
-nk_status nk_dpc_create(nk_dpc **ret, nk_dpc_func func, void *data) {
-  nk_hostthd *host = nk_hostthd_self();
-  assert(host != NULL);
-  return nk_dpc_create_ext(host->host, ret, func, data);
+// Lets an idle worker of an elastic host exit, unless that would leave fewer
+// than min_workers. Returns 0 if it is to stay, including if a waker has just
+// taken it off the idle list. Assumes no locks are held.
+static int nk_hostthd_shrink(nk_hostthd *self) {
+  nk_host *host = self->host;
+  pthread_mutex_lock(&host->runq_mutex);
+  if (!nk_host_should_exit(host) &&
+      nk_host_workers(host) > host->attrs.min_workers &&
+      !__atomic_load_n(&self->retire, __ATOMIC_SEQ_CST) &&
+      !__atomic_load_n(&self->nshared, __ATOMIC_SEQ_CST) &&
+      nk_hostthd_unpark_self(self)) {
+    __atomic_sub_fetch(&host->hostthd_count, 1, __ATOMIC_SEQ_CST);
+    self->exiting = 1;
+  }
+  pthread_mutex_unlock(&host->runq_mutex);
+  if (self->exiting) {
+    nk_hostthd_leave_service(self);
+    __atomic_add_fetch(&host->shrunk, 1, __ATOMIC_SEQ_CST);
+  }
+  return self->exiting;
 }
 
-nk_status nk_dpc_create_ext(nk_host *host, nk_dpc **ret, nk_dpc_func func,
-                            void *data) {
-  nk_status status;
-
-  status = NK_ERR_NOMEM;
-  nk_dpc *d = nk_freelist_alloc(&host->dpc_freelist);
-  if (!d) {
-    goto err;
+// Unless a blocking section claimed it in the meantime (see
+// nk_host_activate_spare()), hands everything queued on the host-thread to
+// others, and sleeps in the spare pool until put back into service or the
+// host exits. Assumes no locks are held.
+static void nk_hostthd_retire(nk_hostthd *self) {
+  nk_host *host = self->host;
+  pthread_mutex_lock(&host->runq_mutex);
+  if (!__atomic_exchange_n(&self->retire, 0, __ATOMIC_SEQ_CST) ||
+      __atomic_load_n(&self->nshared, __ATOMIC_SEQ_CST)) {
+    // (Threads on our shared stacks keep us in service, as an extra worker.)
+    pthread_mutex_unlock(&host->runq_mutex);
+    return;
   }
+  // Out of service before anyone can take it from the pool again.
+  nk_hostthd_leave_service(self);
+  __atomic_store_n(&self->spare_wait, 1, __ATOMIC_SEQ_CST);
+  nk_hostthd_spare_push(&host->spare_hostthds, self);
+  __atomic_add_fetch(&host->nspare_idle, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&host->runq_mutex);
+  nk_hostthd_shed(self);
+  // If we were the host's poller, a parked host-thread takes over.
+  nk_host_kick_poller(host, /* retime = */ 0);
+  while (__atomic_load_n(&self->spare_wait, __ATOMIC_SEQ_CST) &&
+         !nk_host_should_exit(host)) {
+    nk_futex_wait(&self->spare_wait, 1);
+  }
+}
 
-  d->func = func;
-  d->data = data;
-
-  status = nk_schob_init(&d->schob, NK_SCHOB_TYPE_DPC);
-  if (status != NK_OK) {
-    goto err;
+// SIGURG handler for preemption. Switches the running thread away if it is
+// overdue and inside a nk_preempt_enable() section, and the signal caught it
+// running its own code -- on its own stack, not in a switch to or from it.
+// The switch leaves the signal frame on the thread's stack; when the thread is
+// resumed, possibly on another host-thread, the handler returns through it to
+// where the thread was interrupted.
+static void nk_hostthd_preempt_signal(int sig, siginfo_t *info, void *uc) {
+  nk_hostthd *host = nk_hostthd_self();
+  if (!host || !__atomic_load_n(&host->overdue, __ATOMIC_RELAXED)) {
+    return;
+  }
+  nk_schob *s = host->running;
+  if (!s || s->type != NK_SCHOB_TYPE_THD) {
+    return;
+  }
+  nk_thd *self = (nk_thd *)s;
+  char *sp = (char *)&sp;
+  char *stack = self->shared ? self->shared->stack : self->stack;
+  if (!__atomic_load_n(&self->preemptible, __ATOMIC_RELAXED) ||
+      sp < stack ||
+      sp >= stack + nk_thd_stack_class_size(self->stack_class)) {
+    return;
   }
+  // Out of the section while in the scheduler, and open to the next signal,
+  // which is blocked while its handler runs.
+  __atomic_store_n(&self->preemptible, 0, __ATOMIC_RELAXED);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGURG);
+  pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+  nk_thd_yield();
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  __atomic_store_n(&self->preemptible, 1, __ATOMIC_RELAXED);
+}
 
-  nk_schob_enqueue(host, (nk_schob *)d, /* new_schob = */ 1);
+static pthread_once_t nk_preempt_signal_once = PTHREAD_ONCE_INIT;
 
-  *ret = d;
-  return NK_OK;
+static void setup_preempt_signal() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = nk_hostthd_preempt_signal;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGURG, &sa, NULL);
+}
 
-err:
-  if (d) {
-    nk_freelist_free(&host->dpc_freelist, d);
+// Preemption monitor: every preempt_ns, marks host-threads whose running
+// thread has not yielded since the last look as overdue, and signals those
+// whose thread may be switched away.
+static void *nk_host_preempt_monitor(void *_host) {
+  nk_host *host = (nk_host *)_host;
+  while (!nk_host_should_exit(host)) {
+    nk_futex_wait_timeout(&host->exiting, 0, host->attrs.preempt_ns);
+    // Under the mutex, so that no host-thread is joined under our feet.
+    pthread_mutex_lock(&host->runq_mutex);
+    for (int i = 0; i < host->hostthd_array_len; i++) {
+      nk_hostthd *h = host->hostthd_array[i];
+      if (!h || h->joined) {
+        continue;
+      }
+      unsigned tick = __atomic_load_n(&h->tick, __ATOMIC_RELAXED);
+      nk_schob *s = __atomic_load_n(&h->running, __ATOMIC_RELAXED);
+      int same = tick == h->preempt_tick;
+      h->preempt_tick = tick;
+      if (!same || !s || s->type != NK_SCHOB_TYPE_THD ||
+          ((nk_thd *)s)->blocking) {
+        continue;
+      }
+      __atomic_store_n(&h->overdue, 1, __ATOMIC_RELAXED);
+      if (__atomic_load_n(&((nk_thd *)s)->preemptible, __ATOMIC_RELAXED)) {
+        pthread_kill(h->pthread, SIGURG);
+      }
+    }
+    pthread_mutex_unlock(&host->runq_mutex);
   }
-  return status;
+  return NULL;
 }
 
-static void nk_dpc_destroy(nk_dpc *dpc) {
-  nk_hostthd *hostthd = nk_hostthd_self();
-  assert(hostthd != NULL);
-  nk_host *host = hostthd->host;
-  nk_schob_destroy(&dpc->schob);
-  nk_freelist_free(&host->dpc_freelist, dpc);
+// Completes a context switch on the side that resumes: acts on the yield
+// reason of the thread that switched away, if any, now that its context is
+// saved. Assumes no locks are held.
+static void nk_hostthd_finish_switch(nk_hostthd *self,
+                                     nk_arch_switch_ret ret) {
+  nk_thd *prev = ret.prev;
+  if (!prev) {
+    return;
+  }
+  switch (ret.reason) {
+  case NK_THD_YIELD_REASON_READY:
+    // Place it back on our local runqueue. No need to wake anyone: this
+    // host-thread is busy, but will get back to it.
+    __atomic_store_n(&prev->state, NK_THD_STATE_RUNNABLE, __ATOMIC_RELAXED);
+    nk_schob_enqueue_local(self, &prev->schob, /* wake = */ 0);
+    break;
+  case NK_THD_YIELD_REASON_ZOMBIE:
+    // kill immediately, keeping its stack (which we are off by now) in our
+    // stack cache for the next thread created or started here.
+    nk_thd_destroy(self->host, prev);
+    nk_host_schob_destroyed(self->host);
+    break;
+  case NK_THD_YIELD_REASON_WAITING: {
+    // Yielding code will have added thd to other queue already. If it was
+    // woken while still switching away, though, the waker left queueing it to
+    // us.
+    int state = NK_THD_STATE_PARKING;
+    if (!__atomic_compare_exchange_n(&prev->state, &state,
+                                     NK_THD_STATE_WAITING, /* weak = */ 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      assert(state == NK_THD_STATE_RUNNABLE);
+      nk_schob_enqueue_local(self, &prev->schob, /* wake = */ 1);
+    }
+    break;
+  }
+  }
 }
 
-// --------------- hostthd ---------------
-
 static void *nk_hostthd_main(void *_self) {
   nk_hostthd *self = (nk_hostthd *)_self;
-  pthread_once(&nk_hostthd_self_key_once, setup_hostthd_self_key);
-  pthread_setspecific(nk_hostthd_self_key, self);
+  nk_hostthd_current = self;
 
   nk_host *host = self->host;
+  // Whoever started us holds runq_mutex until done: nk_host_run() starts all
+  // the workers, and puts them in service, before any runs.
+  pthread_mutex_lock(&host->runq_mutex);
+  pthread_mutex_unlock(&host->runq_mutex);
+  if (host->numa) {
+    // Best effort: a host-thread left unplaced still works.
+    nk_numa_bind_thread(host->numa, self->node,
+                        host->attrs.affinity == NK_HOST_AFFINITY_CPU
+                            ? self->index / host->nnodes
+                            : -1);
+  }
   while (1) {
-    nk_schob *next = NULL;
-    pthread_mutex_lock(&host->runq_mutex);
-    while (1) {
+    if (__atomic_load_n(&self->retire, __ATOMIC_SEQ_CST)) {
+      nk_hostthd_retire(self);
+    }
+    nk_hostthd_trim_stacks(self);
+
+    // A schob handed over by a thread that switched back to us.
+    nk_schob *next = self->stash;
+    self->stash = NULL;
 
-      if (host->shutdown || host->schob_count == 0) {
-        pthread_mutex_unlock(&host->runq_mutex);
+    if (!next) {
+      if (nk_host_should_exit(host)) {
         goto shutdown;
       }
-
-      next = nk_schob_next(host);
-      if (next) {
-        break;
+      next = nk_schob_next(self);
+    }
+    if (!next) {
+      next = nk_hostthd_wait(self);
+      if (!next) {
+        if (nk_host_should_exit(host) || self->exiting) {
+          goto shutdown;
+        }
+        // Retiring.
+        continue;
       }
-
-      pthread_cond_wait(&host->runq_cond, &host->runq_mutex);
     }
-    pthread_mutex_unlock(&host->runq_mutex);
+
+    nk_host_check_delay(host, next);
+    next->last_ran = self->index;
 
     // If `next` is a dpc, run it here. If `next` is a thd, context-switch to
-    // it until it yields.
+    // it; threads then switch among themselves until one has nothing to
+    // switch to, and comes back here.
     self->running = next;
-
-    int destroyed = 0;
-    int insert_into_runq = 0;
+    nk_hostthd_run_begin(self);
 
     switch (next->type) {
     case NK_SCHOB_TYPE_DPC: {
       nk_dpc *dpc = (nk_dpc *)next;
       dpc->func(dpc->data);
-      nk_dpc_destroy(dpc);
-      destroyed = 1;
+      nk_hostthd_run_end(self, next);
+      self->running = NULL;
+      if (!nk_dpc_rearm(host, dpc)) {
+        nk_dpc_destroy(host, dpc);
+        nk_host_schob_destroyed(host);
+      }
       break;
     }
     case NK_SCHOB_TYPE_THD: {
       nk_thd *thd = (nk_thd *)next;
-      pthread_spin_lock(&thd->running_lock);
-      nk_thd_yield_reason reason =
-          nk_arch_switch_ctx(&self->hoststack, thd->stacktop, 0);
-      pthread_spin_unlock(&thd->running_lock);
-      switch (reason) {
-      case NK_THD_YIELD_REASON_READY:
-        // insert into runqueue below.
-        insert_into_runq = 1;
-        break;
-      case NK_THD_YIELD_REASON_ZOMBIE:
-        // kill immediately.
-        nk_thd_destroy(thd);
-        destroyed = 1;
-        break;
-      case NK_THD_YIELD_REASON_WAITING:
-        // Do nothing -- yielding code will have added thd to other queue
-        // already.
+      if (!nk_thd_ensure_stack(self, thd)) {
+        // Wait for a stack to be freed.
+        self->running = NULL;
+        nk_thd_wait_for_stack(host, thd);
         break;
       }
+      __atomic_store_n(&thd->state, NK_THD_STATE_RUNNING, __ATOMIC_RELAXED);
+      nk_arch_switch_ret ret =
+          nk_arch_switch_ctx(&self->hoststack, thd->stacktop, 0, NULL);
+      self->running = NULL;
+      nk_hostthd_finish_switch(self, ret);
       break;
     }
     }
-    self->running = NULL;
-
-    // If we destroyed a thread or DPC, decrement the total schob count.
-    if (destroyed) {
-      pthread_mutex_lock(&host->runq_mutex);
-      host->schob_count--;
-      if (host->schob_count == 0) {
-        pthread_cond_broadcast(&host->runq_cond);
-      }
-      pthread_mutex_unlock(&host->runq_mutex);
-    }
-    // If `next` yielded ready to run again, place it back on the runqueue.
-    else if (insert_into_runq) {
-      pthread_mutex_lock(&host->runq_mutex);
-      nk_schob_runq_push(&host->runq, next);
-      pthread_mutex_unlock(&host->runq_mutex);
-    }
   }
 shutdown:
+  if (self->exiting) {
+    // Left in the host's array to be restarted; see
+    // nk_host_add_hostthd_locked().
+    pthread_mutex_lock(&host->runq_mutex);
+    self->exited = 1;
+    pthread_mutex_unlock(&host->runq_mutex);
+  }
 
   return NULL;
 }
 
-static nk_status nk_hostthd_create(nk_hostthd **ret, nk_host *host) {
+// Starts a host-thread in the given slot of the host's array, which is either
+// empty or holds an exited host-thread to restart. The caller holds
+// runq_mutex, so that the host-thread is on the host's list before it can
+// run (and start others of its own).
+static nk_status nk_hostthd_create_locked(nk_hostthd **ret, nk_host *host,
+                                          int index) {
   nk_status status;
 
-  status = NK_ERR_NOMEM;
-  nk_hostthd *h = nk_freelist_alloc(&host->hostthd_freelist);
-  if (!h) {
-    goto err;
+  nk_hostthd *h = host->hostthd_array[index];
+  int reuse = h != NULL;
+  if (reuse) {
+    assert(h->exited && !h->joined);
+    void *retval;
+    pthread_join(h->pthread, &retval);
+    h->joined = 1;
+    // Its queues were left empty, and peers may still look at them: keep
+    // them as they are.
+  } else {
+    status = NK_ERR_NOMEM;
+    h = nk_freelist_alloc(&host->hostthd_freelist);
+    if (!h) {
+      goto err;
+    }
+    for (int i = 0; i < NK_PRIO_LEVELS; i++) {
+      nk_deque_init(&h->runq[i]);
+      nk_mpscq_init(&h->inbox[i]);
+      nk_mpscq_init(&h->affine[i]);
+    }
   }
 
   h->host = host;
+  h->index = index;
+  h->node = index % host->nnodes;
+  if (reuse && h->stack_cache_node != nk_host_stack_node(host, h->node)) {
+    nk_hostthd_flush_stacks(h);
+  }
+  h->stack_cache_node = nk_host_stack_node(host, h->node);
+  h->trim_stacks = 0;
+  h->steal_seed = index + 1;
+  h->parked = 0;
+  h->polling = 0;
+  h->runnext = NULL;
+  h->runnext_chain = 0;
+  h->stash = NULL;
+  if (!reuse) {
+    // (One coming back from the spare pool keeps the stacks it has.)
+    memset(h->stack_cache, 0, sizeof(h->stack_cache));
+    memset(h->stack_cache_count, 0, sizeof(h->stack_cache_count));
+    h->shared_stacks = NULL;
+    h->next_shared_stack = 0;
+    QUEUE_INIT(&h->shared_thds);
+    h->nshared = 0;
+  }
+  h->batch_pos = h->batch_len = 0;
+  h->retire = 0;
+  h->spare_wait = 0;
+  h->exiting = 0;
+  // Publish before the thread starts, so that it (and its peers) can find it.
+  __atomic_store_n(&host->hostthd_array[index], h, __ATOMIC_RELEASE);
+
   status = NK_ERR_NOMEM;
   if (pthread_create(&h->pthread, NULL, &nk_hostthd_main, h)) {
+    if (reuse) {
+      // Stays exited, and joined, for good.
+      h = NULL;
+    } else {
+      __atomic_store_n(&host->hostthd_array[index], NULL, __ATOMIC_RELEASE);
+    }
     goto err;
   }
+  h->exited = 0;
+  h->joined = 0;
+  __atomic_store_n(&h->serving, 1, __ATOMIC_SEQ_CST);
 
-  pthread_mutex_lock(&host->runq_mutex);
-  nk_hostthd_list_push(&host->hostthds, h);
-  host->hostthd_count++;
-  pthread_mutex_unlock(&host->runq_mutex);
+  if (!reuse) {
+    nk_hostthd_list_push(&host->hostthds, h);
+  }
+  __atomic_add_fetch(&host->hostthd_count, 1, __ATOMIC_SEQ_CST);
 
   *ret = h;
   return NK_OK;
@@ -413,14 +3155,52 @@ err:
   return status;
 }
 
-static void nk_hostthd_join(nk_hostthd *thd) {
-  void *retval;
+// Destroys an already-joined host-thread. Anything left on its local run
+// queue, in its batch or in its run-next slot is moved to the global run
+// queue. Threads left with one of its shared stacks lose it: they are only
+// ever destroyed after this.
+static void nk_hostthd_destroy(nk_hostthd *thd) {
   nk_host *host = thd->host;
-  pthread_join(thd->pthread, &retval);
-  pthread_mutex_lock(&thd->host->runq_mutex);
+  nk_hostthd_flush_stacks(thd);
+  nk_thd *t;
+  while ((t = nk_thd_shared_link_shift(&thd->shared_thds)) != NULL) {
+    t->shared = NULL;
+  }
+  thd->nshared = 0;
+  if (thd->shared_stacks) {
+    for (int i = 0; i < host->attrs.shared_stacks; i++) {
+      nk_shared_stack *s = &thd->shared_stacks[i];
+      if (s->stack) {
+        // Its guard may be overwritten.
+        *nk_thd_stack_guard_word(s->stack, host->shared_stack_bytes) =
+            NK_THD_GUARDSIZE;
+        *nk_thd_stack_reclaimed_word(s->stack, host->shared_stack_bytes) = 0;
+        nk_thd_stack_put(s->stack, host->shared_stack_class,
+                         nk_host_stack_node(host, thd->node));
+      }
+    }
+    NK_FREE(thd->shared_stacks);
+    thd->shared_stacks = NULL;
+  }
+  nk_hostthd_flush_batch(thd);
+  if (thd->runnext) {
+    nk_schob *s = thd->runnext;
+    nk_mpscq_push(&host->runq[s->prio], &s->runq);
+    thd->runnext = NULL;
+  }
+  for (int i = 0; i < NK_PRIO_LEVELS; i++) {
+    nk_schob *s;
+    while ((s = nk_deque_steal(&thd->runq[i])) != NULL) {
+      nk_mpscq_push(&host->runq[i], &s->runq);
+    }
+  }
+  pthread_mutex_lock(&host->runq_mutex);
   nk_hostthd_list_remove(thd);
-  thd->host->hostthd_count--;
-  pthread_mutex_unlock(&thd->host->runq_mutex);
+  if (!thd->exited) {
+    __atomic_sub_fetch(&host->hostthd_count, 1, __ATOMIC_SEQ_CST);
+  }
+  host->hostthd_array[thd->index] = NULL;
+  pthread_mutex_unlock(&host->runq_mutex);
   nk_freelist_free(&host->hostthd_freelist, thd);
 }
 
@@ -428,14 +3208,194 @@ DEFINE_SIMPLE_FREELIST_TYPE(nk_thd, 10000);
 DEFINE_SIMPLE_FREELIST_TYPE(nk_dpc, 10000);
 DEFINE_SIMPLE_FREELIST_TYPE(nk_hostthd, 10000);
 
+// By default an idle host-thread spins for about as long as a round trip
+// through futex wait and wake costs, before parking.
+#define NK_HOST_DEFAULT_IDLE_SPIN_NS 50000
+
+#define NK_HOST_DEFAULT_BATCH 16
+
+#define NK_HOST_DEFAULT_IO_URING_ENTRIES 256
+#define NK_HOST_DEFAULT_IO_HELPERS 4
+
+#define NK_HOST_DEFAULT_BLOCKING_SPARES 16
+
+// Threads yield at nk_thd_maybe_yield() after a millisecond.
+#define NK_HOST_DEFAULT_SLICE_NS 1000000
+
+#define NK_HOST_DEFAULT_SHARED_STACKS 4
+
+// A reclaimed stack keeps its top 16 KiB, enough for most threads' frames.
+#define NK_HOST_DEFAULT_STACK_KEEP_BYTES (16 * 1024)
+
+// Elastic mode: add a worker once work waits for a millisecond, and let one go
+// once idle for a second.
+#define NK_HOST_DEFAULT_GROW_DELAY_NS 1000000
+#define NK_HOST_DEFAULT_SHRINK_IDLE_NS 1000000000
+
+void nk_host_attrs_init(nk_host_attrs *attrs) {
+  memset(attrs, 0, sizeof(*attrs));
+  attrs->idle_spin_ns = NK_HOST_DEFAULT_IDLE_SPIN_NS;
+  attrs->batch = NK_HOST_DEFAULT_BATCH;
+  attrs->io_uring_entries = NK_HOST_DEFAULT_IO_URING_ENTRIES;
+  attrs->io_helpers = NK_HOST_DEFAULT_IO_HELPERS;
+  attrs->blocking_spares = NK_HOST_DEFAULT_BLOCKING_SPARES;
+  attrs->grow_delay_ns = NK_HOST_DEFAULT_GROW_DELAY_NS;
+  attrs->shrink_idle_ns = NK_HOST_DEFAULT_SHRINK_IDLE_NS;
+  attrs->slice_ns = NK_HOST_DEFAULT_SLICE_NS;
+  attrs->shared_stacks = NK_HOST_DEFAULT_SHARED_STACKS;
+  attrs->shared_stack_size = NK_THD_DEFAULT_STACK_SIZE;
+  attrs->stack_keep_bytes = NK_HOST_DEFAULT_STACK_KEEP_BYTES;
+}
+
+// Global: timestamp-counter cycles per millisecond; 0 until known.
+static uint64_t nk_cycles_per_ms;
+// Global: the clock and the counter when the first host was created, to
+// measure the counter against if the CPU does not report its frequency.
+static uint64_t nk_cycles_ref_ns, nk_cycles_ref;
+static pthread_once_t nk_cycles_per_ms_once = PTHREAD_ONCE_INIT;
+
+// Reads the counter frequency from CPUID: leaf 0x15 gives it as a ratio of the
+// crystal clock, leaf 0x16 the base frequency in MHz (which the invariant
+// counter runs at). Returns 0 if neither is reported.
+static uint64_t nk_cpuid_cycles_per_ms() {
+  unsigned max = __get_cpuid_max(0, NULL);
+  unsigned a, b, c, d;
+  if (max >= 0x15) {
+    __cpuid_count(0x15, 0, a, b, c, d);
+    if (a && b && c) {
+      return (uint64_t)c * b / a / 1000;
+    }
+  }
+  if (max >= 0x16) {
+    __cpuid_count(0x16, 0, a, b, c, d);
+    if (a & 0xffff) {
+      return (uint64_t)(a & 0xffff) * 1000;
+    }
+  }
+  return 0;
+}
+
+static void setup_cycles_per_ms() {
+  uint64_t cycles_per_ms = nk_cpuid_cycles_per_ms();
+  if (cycles_per_ms) {
+    __atomic_store_n(&nk_cycles_per_ms, cycles_per_ms, __ATOMIC_RELAXED);
+    return;
+  }
+  nk_cycles_ref_ns = nk_now_ns();
+  nk_cycles_ref = nk_arch_cycles();
+}
+
+// Returns timestamp-counter cycles per millisecond, or 0 while the counter has
+// not yet run for a millisecond since the first host was created to measure
+// it against the clock.
+static uint64_t nk_get_cycles_per_ms() {
+  uint64_t cycles_per_ms = __atomic_load_n(&nk_cycles_per_ms, __ATOMIC_RELAXED);
+  if (__builtin_expect(cycles_per_ms != 0, 1)) {
+    return cycles_per_ms;
+  }
+  uint64_t t = nk_now_ns(), c = nk_arch_cycles();
+  if (t - nk_cycles_ref_ns < 1000000) {
+    return 0;
+  }
+  cycles_per_ms = (c - nk_cycles_ref) * 1000000 / (t - nk_cycles_ref_ns);
+  __atomic_store_n(&nk_cycles_per_ms, cycles_per_ms, __ATOMIC_RELAXED);
+  return cycles_per_ms;
+}
+
+// Converts nanoseconds to timestamp-counter cycles, saturating; 0 if the
+// counter frequency is not yet known.
+static uint64_t nk_ns_to_cycles(uint64_t ns) {
+  uint64_t cycles_per_ms = nk_get_cycles_per_ms();
+  if (!cycles_per_ms) {
+    return 0;
+  }
+  uint64_t ms = ns / 1000000, rem = ns % 1000000;
+  if (ms > UINT64_MAX / 2 / cycles_per_ms) {
+    return UINT64_MAX / 2;
+  }
+  return ms * cycles_per_ms + rem * cycles_per_ms / 1000000;
+}
+
+// Returns the host's time slice in timestamp-counter cycles. Until the counter
+// frequency is known, slices do not end.
+static uint64_t nk_host_slice_cycles(nk_host *host) {
+  uint64_t slice = __atomic_load_n(&host->slice_cycles, __ATOMIC_RELAXED);
+  if (__builtin_expect(slice != 0, 1)) {
+    return slice;
+  }
+  slice = nk_ns_to_cycles(host->attrs.slice_ns);
+  if (!slice) {
+    return UINT64_MAX / 2;
+  }
+  __atomic_store_n(&host->slice_cycles, slice, __ATOMIC_RELAXED);
+  return slice;
+}
+
 nk_status nk_host_create(nk_host **ret) {
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  return nk_host_create_ext(ret, &attrs);
+}
+
+nk_status nk_host_create_ext(nk_host **ret, const nk_host_attrs *attrs) {
   nk_status status;
 
+  if (attrs->batch < 1 || attrs->batch > NK_HOSTTHD_BATCH_MAX ||
+      attrs->io_helpers < 1 || attrs->blocking_spares < 0 ||
+      attrs->affinity < NK_HOST_AFFINITY_NONE ||
+      attrs->affinity > NK_HOST_AFFINITY_CPU ||
+      attrs->stack_reclaim < NK_STACK_RECLAIM_NONE ||
+      attrs->stack_reclaim > NK_STACK_RECLAIM_EAGER) {
+    return NK_ERR_PARAM;
+  }
+  if (attrs->max_workers &&
+      (attrs->min_workers < 1 || attrs->min_workers > attrs->max_workers ||
+       attrs->shrink_idle_ns == 0)) {
+    return NK_ERR_PARAM;
+  }
+  nk_thd_attrs shared_attrs;
+  nk_thd_attrs_init(&shared_attrs);
+  shared_attrs.stack_size = attrs->shared_stack_size;
+  int shared_stack_class = nk_thd_stack_class(&shared_attrs);
+  if (attrs->shared_stacks < 0 ||
+      (attrs->shared_stacks && shared_stack_class < 0)) {
+    return NK_ERR_PARAM;
+  }
+
   status = NK_ERR_NOMEM;
   nk_host *h = NK_ALLOC(nk_host);
   if (!h) {
     goto err;
   }
+  h->attrs = *attrs;
+  h->attrs.cpus = NULL;
+  // At least the page that holds the free stack's bookkeeping is kept.
+  h->attrs.stack_keep_bytes =
+      (attrs->stack_keep_bytes + NK_THD_PAGESIZE - 1) &
+      ~(size_t)(NK_THD_PAGESIZE - 1);
+  if (h->attrs.stack_keep_bytes < NK_THD_PAGESIZE) {
+    h->attrs.stack_keep_bytes = NK_THD_PAGESIZE;
+  }
+  h->ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  h->nnodes = 1;
+  pthread_once(&nk_cycles_per_ms_once, setup_cycles_per_ms);
+  h->slice_cycles = nk_ns_to_cycles(attrs->slice_ns);
+  h->shared_stack_class = shared_stack_class;
+  h->shared_stack_bytes =
+      shared_stack_class < 0 ? 0 : nk_thd_stack_class_size(shared_stack_class);
+
+  if (attrs->affinity != NK_HOST_AFFINITY_NONE) {
+    status = NK_ERR_NOMEM;
+    h->numa = NK_ALLOC(nk_numa);
+    if (!h->numa) {
+      goto err;
+    }
+    status = nk_numa_init(h->numa, attrs->cpus);
+    if (status != NK_OK) {
+      goto err;
+    }
+    h->nnodes = h->numa->nnodes;
+  }
 
   status = NK_ERR_NOMEM;
   if (pthread_mutex_init(&h->runq_mutex, NULL)) {
@@ -443,29 +3403,48 @@ nk_status nk_host_create(nk_host **ret) {
   }
 
   status = NK_ERR_NOMEM;
-  if (pthread_cond_init(&h->runq_cond, NULL)) {
+  if (pthread_spin_init(&h->idle_lock, PTHREAD_PROCESS_PRIVATE)) {
     goto err2;
   }
 
-  QUEUE_INIT(&h->runq);
-  QUEUE_INIT(&h->hostthds);
-
-  if (nk_freelist_init(&h->thd_freelist, &nk_thd_freelist_attrs, NULL) !=
-      NK_OK) {
+  status = NK_ERR_NOMEM;
+  if (pthread_spin_init(&h->timer_lock, PTHREAD_PROCESS_PRIVATE)) {
     goto err3;
   }
-  if (nk_freelist_init(&h->dpc_freelist, &nk_dpc_freelist_attrs, NULL) !=
-      NK_OK) {
-    goto err4;
+  nk_timer_wheel_init(&h->timers, nk_now_ns());
+  h->timer_next = UINT64_MAX;
+
+  for (int i = 0; i < NK_PRIO_LEVELS; i++) {
+    nk_mpscq_init(&h->runq[i]);
+  }
+  nk_group_init(h, &h->root_group, NK_GROUP_WEIGHT_DEFAULT);
+  QUEUE_INIT(&h->hostthds);
+  QUEUE_INIT(&h->idle_hostthds);
+  QUEUE_INIT(&h->spare_hostthds);
+
+  int node;
+  for (node = 0; node < h->nnodes; node++) {
+    if (nk_freelist_init(&h->thd_freelist[node], &nk_thd_freelist_attrs,
+                         NULL) != NK_OK) {
+      goto err4;
+    }
+    if (nk_freelist_init(&h->dpc_freelist[node], &nk_dpc_freelist_attrs,
+                         NULL) != NK_OK) {
+      nk_freelist_destroy(&h->thd_freelist[node]);
+      goto err4;
+    }
   }
   if (nk_freelist_init(&h->hostthd_freelist, &nk_hostthd_freelist_attrs,
                        NULL) != NK_OK) {
-    goto err5;
+    goto err4;
   }
   if (nk_msg_init_freelists(h) != NK_OK) {
-    goto err6;
+    goto err5;
   }
   if (nk_sync_init_freelists(h) != NK_OK) {
+    goto err6;
+  }
+  if (nk_io_init(h) != NK_OK) {
     goto err7;
   }
 
@@ -473,78 +3452,231 @@ nk_status nk_host_create(nk_host **ret) {
   return NK_OK;
 
 err7:
-  nk_msg_destroy_freelists(h);
+  nk_sync_destroy_freelists(h);
 err6:
-  nk_freelist_destroy(&h->hostthd_freelist);
+  nk_msg_destroy_freelists(h);
 err5:
-  nk_freelist_destroy(&h->dpc_freelist);
+  nk_freelist_destroy(&h->hostthd_freelist);
 err4:
-  nk_freelist_destroy(&h->thd_freelist);
+  while (node-- > 0) {
+    nk_freelist_destroy(&h->dpc_freelist[node]);
+    nk_freelist_destroy(&h->thd_freelist[node]);
+  }
+  pthread_spin_destroy(&h->timer_lock);
 err3:
-  pthread_cond_destroy(&h->runq_cond);
+  pthread_spin_destroy(&h->idle_lock);
 err2:
   pthread_mutex_destroy(&h->runq_mutex);
 err:
   if (h) {
+    if (h->numa) {
+      NK_FREE(h->numa);
+    }
     NK_FREE(h);
   }
   return status;
 }
 
 void nk_host_run(nk_host *host, int workers) {
-  // Create workers.
-  for (int i = 0; i < workers; i++) {
+  if (host->attrs.max_workers) {
+    if (workers < host->attrs.min_workers) {
+      workers = host->attrs.min_workers;
+    } else if (workers > host->attrs.max_workers) {
+      workers = host->attrs.max_workers;
+    }
+  }
+  int slots = (host->attrs.max_workers ? host->attrs.max_workers : workers) +
+              host->attrs.blocking_spares;
+  nk_hostthd **array = NK_ALLOCN(nk_hostthd *, slots);
+  if (!array) {
+    return;
+  }
+
+  // Create workers, all before any of them can start spares in the free
+  // slots. (The array is published under the mutex for
+  // nk_host_trim_stacks().)
+  pthread_mutex_lock(&host->runq_mutex);
+  host->hostthd_array = array;
+  host->hostthd_array_len = slots;
+  nk_status status = NK_OK;
+  for (int i = 0; i < workers && status == NK_OK; i++) {
     nk_hostthd *hostthd;
-    nk_status status = nk_hostthd_create(&hostthd, host);
-    if (status != NK_OK) {
-      nk_host_shutdown(host);
+    status = nk_hostthd_create_locked(&hostthd, host, i);
+  }
+  pthread_mutex_unlock(&host->runq_mutex);
+  if (status != NK_OK) {
+    nk_host_shutdown(host);
+  }
+  int preempting = 0;
+  if (host->attrs.preempt_ns) {
+    pthread_once(&nk_preempt_signal_once, setup_preempt_signal);
+    // Without the monitor, threads simply run until they yield.
+    preempting = !pthread_create(&host->preempt_monitor, NULL,
+                                 &nk_host_preempt_monitor, host);
+  }
+
+  // Host-threads come and go while the host runs; wait for it to be done.
+  while (!nk_host_should_exit(host)) {
+    nk_futex_wait(&host->exiting, 0);
+  }
+  if (preempting) {
+    void *retval;
+    pthread_join(host->preempt_monitor, &retval);
+  }
+
+  // Join all host-threads before destroying any of them, since an exiting
+  // host-thread may still be stealing from its peers' run queues. Host-threads
+  // may be started until the last one exits, so go by the list.
+  while (1) {
+    pthread_mutex_lock(&host->runq_mutex);
+    nk_hostthd *h = NULL;
+    for (nk_hostthd *i = nk_hostthd_list_begin(&host->hostthds);
+         &i->list != &host->hostthds; i = nk_hostthd_list_next(i)) {
+      if (!i->joined) {
+        h = i;
+        break;
+      }
+    }
+    if (h) {
+      // Claimed, so that nobody restarts it meanwhile.
+      h->joined = 1;
+    }
+    pthread_mutex_unlock(&host->runq_mutex);
+    if (!h) {
       break;
     }
+    void *retval;
+    pthread_join(h->pthread, &retval);
   }
 
-  // Host-thread join/destroy loop.
+  // Host-thread destroy loop.
   while (1) {
     pthread_mutex_lock(&host->runq_mutex);
     if (nk_hostthd_list_empty(&host->hostthds)) {
       pthread_mutex_unlock(&host->runq_mutex);
       break;
     }
-    nk_hostthd *h = nk_hostthd_list_shift(&host->hostthds);
+    nk_hostthd *h = nk_hostthd_list_begin(&host->hostthds);
     pthread_mutex_unlock(&host->runq_mutex);
-    nk_hostthd_join(h);
+    nk_hostthd_destroy(h);
+  }
+  pthread_mutex_lock(&host->runq_mutex);
+  NK_FREE(host->hostthd_array);
+  host->hostthd_array = NULL;
+  host->hostthd_array_len = 0;
+  pthread_mutex_unlock(&host->runq_mutex);
+  QUEUE_INIT(&host->spare_hostthds);
+  host->nspare_idle = 0;
+  host->exiting = 0;
+
+  // Timers still pending after a shutdown: delayed DPCs never run, and
+  // sleeping threads are destroyed along with the rest of the run queue.
+  queue_head pending;
+  QUEUE_INIT(&pending);
+  nk_timer_wheel_drain(&host->timers, &pending);
+  host->timer_next = UINT64_MAX;
+  nk_timer *t;
+  while ((t = nk_timer_link_shift(&pending)) != NULL) {
+    nk_schob *s = t->owner;
+    nk_mpscq_push(&host->runq[s->prio], &s->runq);
   }
 
-  // Destroy any remaining thds/DPCs on runq.
-  for (nk_schob *s = nk_schob_runq_begin(&host->runq),
-                *e = nk_schob_runq_end(&host->runq), *next = NULL;
-       s != e; s = next) {
-    next = nk_schob_runq_next(s);
-    switch (s->type) {
-    case NK_SCHOB_TYPE_THD:
-      nk_thd_destroy((nk_thd *)s);
-      break;
-    case NK_SCHOB_TYPE_DPC:
-      nk_dpc_destroy((nk_dpc *)s);
-      break;
+  // Destroy any remaining thds/DPCs on runq, and on the groups' run queues.
+  // All producers are gone, so the queues cannot appear transiently empty
+  // here.
+  for (int i = 0; i < NK_PRIO_LEVELS; i++) {
+    queue_entry *e;
+    for (int j = 0; j < host->ngroups; j++) {
+      while ((e = nk_mpscq_pop(&host->groups[j]->runq[i])) != NULL) {
+        nk_mpscq_push(&host->runq[i], e);
+      }
+      host->groups[j]->prio_mask = 0;
+    }
+    while ((e = nk_mpscq_pop(&host->runq[i])) != NULL) {
+      nk_schob *s = QUEUE_OBJ_FROM_ENTRY(nk_schob, runq, e);
+      switch (s->type) {
+      case NK_SCHOB_TYPE_THD:
+        nk_thd_destroy(host, (nk_thd *)s);
+        break;
+      case NK_SCHOB_TYPE_DPC:
+        nk_dpc_destroy(host, (nk_dpc *)s);
+        break;
+      }
+      host->schob_count--;
     }
   }
+  host->prio_mask = 0;
 }
 
 void nk_host_shutdown(nk_host *host) {
-  pthread_mutex_lock(&host->runq_mutex);
-  host->shutdown = 1;
-  pthread_cond_broadcast(&host->runq_cond);
-  pthread_mutex_unlock(&host->runq_mutex);
+  __atomic_store_n(&host->shutdown, 1, __ATOMIC_SEQ_CST);
+  nk_host_unpark_all(host);
 }
 
 void nk_host_destroy(nk_host *host) {
   assert(host->schob_count == 0);
-  pthread_cond_destroy(&host->runq_cond);
+  pthread_spin_destroy(&host->idle_lock);
+  pthread_spin_destroy(&host->timer_lock);
   pthread_mutex_destroy(&host->runq_mutex);
-  nk_freelist_destroy(&host->thd_freelist);
-  nk_freelist_destroy(&host->dpc_freelist);
+  for (int i = 0; i < host->nnodes; i++) {
+    nk_freelist_destroy(&host->thd_freelist[i]);
+    nk_freelist_destroy(&host->dpc_freelist[i]);
+  }
   nk_freelist_destroy(&host->hostthd_freelist);
   nk_msg_destroy_freelists(host);
   nk_sync_destroy_freelists(host);
+  nk_io_destroy(host);
+  for (int i = 0; i < host->ngroups; i++) {
+    NK_FREE(host->groups[i]);
+  }
+  if (host->numa) {
+    NK_FREE(host->numa);
+  }
   NK_FREE(host);
 }
+
+void nk_host_get_stats(nk_host *host, nk_host_stats *stats) {
+  stats->workers = nk_host_workers(host);
+  stats->parked = __atomic_load_n(&host->nparked, __ATOMIC_SEQ_CST);
+  stats->blocked = __atomic_load_n(&host->nblocking, __ATOMIC_SEQ_CST);
+  stats->spares = __atomic_load_n(&host->nspare_idle, __ATOMIC_SEQ_CST);
+  stats->schobs = __atomic_load_n(&host->schob_count, __ATOMIC_SEQ_CST);
+  stats->grown = __atomic_load_n(&host->grown, __ATOMIC_SEQ_CST);
+  stats->shrunk = __atomic_load_n(&host->shrunk, __ATOMIC_SEQ_CST);
+  stats->stack_reserved =
+      __atomic_load_n(&nk_thd_stack_reserved, __ATOMIC_RELAXED);
+  stats->stack_committed =
+      __atomic_load_n(&nk_thd_stack_committed, __ATOMIC_RELAXED);
+}
+
+void nk_host_trim_stacks(nk_host *host) {
+  // A host-thread out of service, or asleep in the spare pool, cannot touch
+  // its stack cache until put back under runq_mutex: empty it here. The rest
+  // empty theirs at their next scheduling point, and parked ones are woken
+  // for it. (Joined ones are being destroyed, which empties them.)
+  int flagged = 0;
+  pthread_mutex_lock(&host->runq_mutex);
+  for (int i = 0; i < host->hostthd_array_len; i++) {
+    nk_hostthd *h = host->hostthd_array[i];
+    if (!h || h->joined) {
+      continue;
+    }
+    if (h->exited || __atomic_load_n(&h->spare_wait, __ATOMIC_SEQ_CST)) {
+      nk_hostthd_flush_stacks(h);
+    } else {
+      __atomic_store_n(&h->trim_stacks, 1, __ATOMIC_RELAXED);
+      flagged++;
+    }
+  }
+  pthread_mutex_unlock(&host->runq_mutex);
+  for (int i = 0; i < flagged; i++) {
+    __atomic_add_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST);
+    if (!nk_host_unpark(host)) {
+      __atomic_sub_fetch(&host->nspinning, 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+  }
+  for (int i = 0; i <= NK_NUMA_MAX_NODES; i++) {
+    nk_thd_stack_trim(i);
+  }
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "nk/timer.h"
+
+#define NK_TIMER_SLOT_MASK (NK_TIMER_SLOTS - 1)
+#define NK_TIMER_SPAN (1ull << (NK_TIMER_LEVEL_BITS * NK_TIMER_LEVELS))
+
+void nk_timer_wheel_init(nk_timer_wheel *w, uint64_t now) {
+  w->tick = now >> NK_TIMER_TICK_SHIFT;
+  w->count = 0;
+  for (int l = 0; l < NK_TIMER_LEVELS; l++) {
+    w->occupied[l] = 0;
+    for (int i = 0; i < NK_TIMER_SLOTS; i++) {
+      QUEUE_INIT(&w->slots[l][i]);
+    }
+  }
+}
+
+int nk_timer_wheel_add(nk_timer_wheel *w, nk_timer *t) {
+  // Round up, so that a timer never expires before its deadline.
+  uint64_t expires = (t->deadline >> NK_TIMER_TICK_SHIFT) +
+                     ((t->deadline & ((1ull << NK_TIMER_TICK_SHIFT) - 1)) != 0);
+  if (expires < w->tick) {
+    return 0;
+  }
+  uint64_t delta = expires - w->tick;
+  if (delta >= NK_TIMER_SPAN) {
+    delta = NK_TIMER_SPAN - 1;
+    expires = w->tick + delta;
+  }
+  int level = 0;
+  while (delta >= (1ull << (NK_TIMER_LEVEL_BITS * (level + 1)))) {
+    level++;
+  }
+  int index = (expires >> (NK_TIMER_LEVEL_BITS * level)) & NK_TIMER_SLOT_MASK;
+  nk_timer_link_push(&w->slots[level][index], t);
+  w->occupied[level] |= 1ull << index;
+  w->count++;
+  t->pending = 1;
+  t->level = level;
+  t->index = index;
+  return 1;
+}
+
+void nk_timer_wheel_remove(nk_timer_wheel *w, nk_timer *t) {
+  nk_timer_link_remove(t);
+  if (nk_timer_link_empty(&w->slots[t->level][t->index])) {
+    w->occupied[t->level] &= ~(1ull << t->index);
+  }
+  w->count--;
+  t->pending = 0;
+}
+
+// Re-hashes the timers in a higher-level slot into lower levels, now that
+// the wheel has reached the span that slot covers.
+static void nk_timer_wheel_cascade(nk_timer_wheel *w, int level, int index) {
+  queue_head *slot = &w->slots[level][index];
+  queue_head moving;
+  QUEUE_INIT(&moving);
+  if (nk_timer_link_empty(slot)) {
+    return;
+  }
+  // Splice the slot out first: a re-hashed timer may land back on it.
+  moving.next = slot->next;
+  moving.prev = slot->prev;
+  moving.next->prev = &moving;
+  moving.prev->next = &moving;
+  QUEUE_INIT(slot);
+  w->occupied[level] &= ~(1ull << index);
+  nk_timer *t;
+  while ((t = nk_timer_link_shift(&moving)) != NULL) {
+    w->count--;
+    nk_timer_wheel_add(w, t);
+  }
+}
+
+void nk_timer_wheel_advance(nk_timer_wheel *w, uint64_t now,
+                            queue_head *expired) {
+  uint64_t target = now >> NK_TIMER_TICK_SHIFT;
+  while (w->tick <= target) {
+    if (w->count == 0) {
+      w->tick = target + 1;
+      break;
+    }
+    int index = w->tick & NK_TIMER_SLOT_MASK;
+    if (index == 0) {
+      for (int l = 1; l < NK_TIMER_LEVELS; l++) {
+        int i = (w->tick >> (NK_TIMER_LEVEL_BITS * l)) & NK_TIMER_SLOT_MASK;
+        nk_timer_wheel_cascade(w, l, i);
+        if (i != 0) {
+          break;
+        }
+      }
+    } else if ((w->occupied[0] >> index) == 0) {
+      // Nothing left on level 0 before it wraps: skip to the next cascade.
+      uint64_t wrap = (w->tick | NK_TIMER_SLOT_MASK) + 1;
+      w->tick = wrap <= target ? wrap : target + 1;
+      continue;
+    }
+    nk_timer *t;
+    while ((t = nk_timer_link_shift(&w->slots[0][index])) != NULL) {
+      t->pending = 0;
+      w->count--;
+      nk_timer_link_push(expired, t);
+    }
+    w->occupied[0] &= ~(1ull << index);
+    w->tick++;
+  }
+}
+
+uint64_t nk_timer_wheel_next(nk_timer_wheel *w) {
+  uint64_t next = UINT64_MAX;
+  for (int l = 0; l < NK_TIMER_LEVELS; l++) {
+    uint64_t bits = w->occupied[l];
+    if (!bits) {
+      continue;
+    }
+    // The first tick, from now on, at which this level's slots are served,
+    // and the slot served then.
+    int shift = NK_TIMER_LEVEL_BITS * l;
+    uint64_t unit = 1ull << shift;
+    uint64_t base = (w->tick + unit - 1) & ~(unit - 1);
+    int pos = (base >> shift) & NK_TIMER_SLOT_MASK;
+    uint64_t rot = bits;
+    if (pos) {
+      rot = (bits >> pos) | (bits << (NK_TIMER_SLOTS - pos));
+    }
+    uint64_t tick = base + (uint64_t)__builtin_ctzll(rot) * unit;
+    if (tick < next) {
+      next = tick;
+    }
+  }
+  return next == UINT64_MAX ? UINT64_MAX : next << NK_TIMER_TICK_SHIFT;
+}
+
+void nk_timer_wheel_drain(nk_timer_wheel *w, queue_head *out) {
+  for (int l = 0; l < NK_TIMER_LEVELS; l++) {
+    for (int i = 0; i < NK_TIMER_SLOTS; i++) {
+      nk_timer *t;
+      while ((t = nk_timer_link_shift(&w->slots[l][i])) != NULL) {
+        t->pending = 0;
+        nk_timer_link_push(out, t);
+      }
+    }
+    w->occupied[l] = 0;
+  }
+  w->count = 0;
+}
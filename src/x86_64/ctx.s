@@ -32,7 +32,14 @@
 # Thread start needs to set rdi, rsi, and rdx, but these aren't part of the
 # frame, so we vector through a trampoline that sets r15 -> rdi, r14 -> rsi,
 # r13 -> rdx, and jumps through r12.
+#
+# The switch that starts the thread returns its (reason, prev) pair in
+# rax:rdx, as for any other switch. The entry function takes that pair as a
+# fourth, struct-typed argument, which the ABI passes in rcx:r8, so the
+# trampoline moves it there first.
 trampoline:
+    movq %rdx, %r8
+    movq %rax, %rcx
     movq %r15, %rdi
     movq %r14, %rsi
     movq %r13, %rdx
@@ -70,7 +77,12 @@ nk_arch_create_ctx:
     movq %rdi, %rax
     retq
 
-# args: void **fromstack (rdi), void *tostack (rsi), int msg (rdx)
+# args: void **fromstack (rdi), void *tostack (rsi), int msg (rdx),
+#       void *prev (rcx)
+#
+# returns (msg, prev) in rax:rdx on the destination stack, i.e., as a 16-byte
+# struct return value, so that the side that resumes can finish off the
+# context it switched away from.
 .global nk_arch_switch_ctx
 nk_arch_switch_ctx:
     pushq %rbp
@@ -88,4 +100,5 @@ nk_arch_switch_ctx:
     popq %r15
     popq %rbp
     movq %rdx, %rax
+    movq %rcx, %rdx
     retq
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+#include "nk/alloc.h"
+
+#include <pthread.h>
+
+// Objects handed out by the freelist's alloc_func and not yet given to its
+// free_func.
+static int alloc_live;
+
+static void *alloc_count_alloc(const nk_freelist_attrs *attrs, void *cookie) {
+  __atomic_fetch_add(&alloc_live, 1, __ATOMIC_RELAXED);
+  return calloc(attrs->node_size, 1);
+}
+
+static void alloc_count_free(const nk_freelist_attrs *attrs, void *cookie,
+                             void *p) {
+  __atomic_fetch_sub(&alloc_live, 1, __ATOMIC_RELAXED);
+  free(p);
+}
+
+static const nk_freelist_attrs alloc_count_attrs = {
+    .node_size = 64,
+    .max_count = 100,
+    .freelist_header_offset = 0,
+    .alloc_func = alloc_count_alloc,
+    .free_func = alloc_count_free,
+    .zero_func = NULL,
+    .magazine_size = 8,
+};
+
+#define ALLOC_OBJS 1000
+
+NK_TEST(alloc_magazines) {
+  static void *objs[ALLOC_OBJS];
+  nk_freelist f;
+  alloc_live = 0;
+  NK_TEST_ASSERT(nk_freelist_init(&f, &alloc_count_attrs, NULL) == NK_OK);
+
+  // Freed objects come back, zeroed, most recently freed first.
+  for (int i = 0; i < ALLOC_OBJS; i++) {
+    objs[i] = nk_freelist_alloc(&f);
+    NK_TEST_ASSERT(objs[i] != NULL);
+    memset(objs[i], 1, 64);
+  }
+  NK_TEST_ASSERT(alloc_live == ALLOC_OBJS);
+  nk_freelist_free(&f, objs[0]);
+  NK_TEST_ASSERT(nk_freelist_alloc(&f) == objs[0]);
+  NK_TEST_ASSERT(((char *)objs[0])[63] == 0);
+
+  // The freelist keeps about max_count of them, besides its magazines.
+  for (int i = 0; i < ALLOC_OBJS; i++) {
+    nk_freelist_free(&f, objs[i]);
+  }
+  NK_TEST_ASSERT_FMT(alloc_live <= 100 + 2 * 8, "%d objects kept",
+                     alloc_live);
+  NK_TEST_ASSERT(alloc_live >= 100);
+  // They are handed out again before any new ones.
+  int kept = alloc_live;
+  for (int i = 0; i < kept; i++) {
+    objs[i] = nk_freelist_alloc(&f);
+  }
+  NK_TEST_ASSERT(alloc_live == kept);
+  for (int i = 0; i < kept; i++) {
+    nk_freelist_free(&f, objs[i]);
+  }
+
+  // Trimming frees what the depot holds, but not the magazines.
+  nk_freelist_trim(&f, 0);
+  NK_TEST_ASSERT_FMT(alloc_live <= 2 * 8, "%d objects kept", alloc_live);
+  nk_freelist_destroy(&f);
+  NK_TEST_ASSERT(alloc_live == 0);
+
+  NK_TEST_OK();
+}
+
+#define ALLOC_THREADS 4
+#define ALLOC_ROUNDS 20000
+#define ALLOC_BATCH 50
+
+struct alloc_thread_arg {
+  nk_freelist *f;
+  int id;
+  int ok;
+};
+
+// Allocates batches of objects, marking them as its own, and frees each batch
+// once the next is allocated, checking that no other thread was handed them
+// meanwhile.
+static void *alloc_thread(void *_arg) {
+  struct alloc_thread_arg *arg = _arg;
+  int *held[2][ALLOC_BATCH] = {{0}};
+  for (int r = 0; r < ALLOC_ROUNDS / ALLOC_BATCH; r++) {
+    for (int i = 0; i < ALLOC_BATCH; i++) {
+      int *obj = nk_freelist_alloc(arg->f);
+      if (!obj) {
+        return NULL;
+      }
+      *obj = arg->id;
+      held[r % 2][i] = obj;
+    }
+    for (int i = 0; i < ALLOC_BATCH; i++) {
+      int *obj = held[(r + 1) % 2][i];
+      if (obj) {
+        if (*obj != arg->id) {
+          return NULL;
+        }
+        nk_freelist_free(arg->f, obj);
+        held[(r + 1) % 2][i] = NULL;
+      }
+    }
+  }
+  for (int i = 0; i < ALLOC_BATCH; i++) {
+    int *obj = held[(ALLOC_ROUNDS / ALLOC_BATCH - 1) % 2][i];
+    nk_freelist_free(arg->f, obj);
+  }
+  arg->ok = 1;
+  return NULL;
+}
+
+NK_TEST(alloc_magazines_threads) {
+  nk_freelist f;
+  alloc_live = 0;
+  NK_TEST_ASSERT(nk_freelist_init(&f, &alloc_count_attrs, NULL) == NK_OK);
+  pthread_t threads[ALLOC_THREADS];
+  struct alloc_thread_arg args[ALLOC_THREADS];
+  for (int i = 0; i < ALLOC_THREADS; i++) {
+    args[i].f = &f;
+    args[i].id = i + 1;
+    args[i].ok = 0;
+    NK_TEST_ASSERT(pthread_create(&threads[i], NULL, alloc_thread,
+                                  &args[i]) == 0);
+  }
+  for (int i = 0; i < ALLOC_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    NK_TEST_ASSERT_FMT(args[i].ok, "thread %d saw an object in use", i);
+  }
+  nk_freelist_destroy(&f);
+  NK_TEST_ASSERT(alloc_live == 0);
+
+  NK_TEST_OK();
+}
+
+#define ALLOC_EXITS (2 * NK_FREELIST_CACHES)
+#define ALLOC_EXIT_OBJS 4
+
+static void *alloc_exit_thread(void *_arg) {
+  nk_freelist *f = _arg;
+  void *objs[ALLOC_EXIT_OBJS];
+  for (int i = 0; i < ALLOC_EXIT_OBJS; i++) {
+    objs[i] = nk_freelist_alloc(f);
+  }
+  for (int i = 0; i < ALLOC_EXIT_OBJS; i++) {
+    nk_freelist_free(f, objs[i]);
+  }
+  return NULL;
+}
+
+NK_TEST(alloc_magazines_exit) {
+  nk_freelist f;
+  alloc_live = 0;
+  NK_TEST_ASSERT(nk_freelist_init(&f, &alloc_count_attrs, NULL) == NK_OK);
+  // More threads than caches, one after another: each leaves what it freed to
+  // the depot when it exits, where trimming can free it.
+  for (int i = 0; i < ALLOC_EXITS; i++) {
+    pthread_t thread;
+    NK_TEST_ASSERT(pthread_create(&thread, NULL, alloc_exit_thread, &f) == 0);
+    pthread_join(thread, NULL);
+  }
+  NK_TEST_ASSERT(alloc_live > 0);
+  nk_freelist_trim(&f, 0);
+  NK_TEST_ASSERT_FMT(alloc_live == 0, "%d objects left in caches", alloc_live);
+  nk_freelist_destroy(&f);
+  NK_TEST_ASSERT(alloc_live == 0);
+
+  NK_TEST_OK();
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+#include "nk/deque.h"
+
+#include <pthread.h>
+
+NK_TEST(deque_fifo) {
+  nk_deque *d = NK_ALLOC(nk_deque);
+  nk_deque_init(d);
+  NK_TEST_ASSERT(nk_deque_empty(d));
+  NK_TEST_ASSERT(nk_deque_steal(d) == NULL);
+
+  // Fill to capacity; one more push must be refused.
+  for (intptr_t i = 1; i <= NK_DEQUE_SIZE; i++) {
+    NK_TEST_ASSERT(nk_deque_push(d, (void *)i));
+  }
+  NK_TEST_ASSERT(!nk_deque_push(d, (void *)1));
+
+  for (intptr_t i = 1; i <= NK_DEQUE_SIZE; i++) {
+    NK_TEST_ASSERT(nk_deque_steal(d) == (void *)i);
+  }
+  NK_TEST_ASSERT(nk_deque_empty(d));
+  NK_FREE(d);
+
+  NK_TEST_OK();
+}
+
+NK_TEST(deque_steal_batch) {
+  nk_deque *d = NK_ALLOC(nk_deque);
+  nk_deque_init(d);
+  void *out[16];
+  NK_TEST_ASSERT(nk_deque_steal_batch(d, out, 16, 0) == 0);
+
+  for (intptr_t i = 1; i <= 10; i++) {
+    NK_TEST_ASSERT(nk_deque_push(d, (void *)i));
+  }
+  // Half of ten, in FIFO order.
+  NK_TEST_ASSERT(nk_deque_steal_batch(d, out, 16, 1) == 5);
+  for (intptr_t i = 0; i < 5; i++) {
+    NK_TEST_ASSERT(out[i] == (void *)(i + 1));
+  }
+  // Capped by `max`.
+  NK_TEST_ASSERT(nk_deque_steal_batch(d, out, 2, 0) == 2);
+  NK_TEST_ASSERT(out[0] == (void *)6 && out[1] == (void *)7);
+  // Half of three rounds up.
+  NK_TEST_ASSERT(nk_deque_steal_batch(d, out, 16, 1) == 2);
+  NK_TEST_ASSERT(out[0] == (void *)8 && out[1] == (void *)9);
+  NK_TEST_ASSERT(nk_deque_steal_batch(d, out, 16, 1) == 1);
+  NK_TEST_ASSERT(out[0] == (void *)10);
+  NK_TEST_ASSERT(nk_deque_empty(d));
+  NK_FREE(d);
+
+  NK_TEST_OK();
+}
+
+#define DEQUE_STEAL_ITEMS 100000
+#define DEQUE_STEAL_THIEVES 4
+
+struct deque_steal_arg {
+  nk_deque *d;
+  int done;
+  int batch; // thieves take half the deque at a time.
+  unsigned char *seen;
+};
+
+static void *deque_steal_thief(void *_arg) {
+  struct deque_steal_arg *arg = _arg;
+  void *items[8];
+  while (1) {
+    int done = __atomic_load_n(&arg->done, __ATOMIC_ACQUIRE);
+    int n;
+    if (arg->batch) {
+      n = nk_deque_steal_batch(arg->d, items, 8, /* half = */ 1);
+    } else {
+      items[0] = nk_deque_steal(arg->d);
+      n = items[0] ? 1 : 0;
+    }
+    for (int i = 0; i < n; i++) {
+      intptr_t item = (intptr_t)items[i];
+      __atomic_add_fetch(&arg->seen[item - 1], 1, __ATOMIC_RELAXED);
+    }
+    if (!n && done) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+static int deque_steal_run(FILE *__test_out, int batch) {
+  struct deque_steal_arg arg;
+  arg.d = NK_ALLOC(nk_deque);
+  arg.done = 0;
+  arg.batch = batch;
+  arg.seen = NK_ALLOCN(unsigned char, DEQUE_STEAL_ITEMS);
+  nk_deque_init(arg.d);
+
+  pthread_t thieves[DEQUE_STEAL_THIEVES];
+  for (int i = 0; i < DEQUE_STEAL_THIEVES; i++) {
+    NK_TEST_ASSERT(
+        pthread_create(&thieves[i], NULL, deque_steal_thief, &arg) == 0);
+  }
+  // The owner both pushes and takes, as a host-thread does.
+  for (intptr_t i = 1; i <= DEQUE_STEAL_ITEMS; i++) {
+    while (!nk_deque_push(arg.d, (void *)i)) {
+      intptr_t item = (intptr_t)nk_deque_steal(arg.d);
+      if (item) {
+        __atomic_add_fetch(&arg.seen[item - 1], 1, __ATOMIC_RELAXED);
+      }
+    }
+  }
+  __atomic_store_n(&arg.done, 1, __ATOMIC_RELEASE);
+  for (int i = 0; i < DEQUE_STEAL_THIEVES; i++) {
+    pthread_join(thieves[i], NULL);
+  }
+
+  // Every item must have been taken exactly once.
+  for (int i = 0; i < DEQUE_STEAL_ITEMS; i++) {
+    NK_TEST_ASSERT_FMT(arg.seen[i] == 1, "item %d taken %d times", i + 1,
+                       arg.seen[i]);
+  }
+  NK_FREE(arg.seen);
+  NK_FREE(arg.d);
+
+  NK_TEST_OK();
+}
+
+NK_TEST(deque_steal) { return deque_steal_run(__test_out, /* batch = */ 0); }
+
+NK_TEST(deque_steal_half) {
+  return deque_steal_run(__test_out, /* batch = */ 1);
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+#include "nk/io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define IO_PINGPONG_ROUNDS 2000
+
+struct io_pingpong_arg {
+  int fd;
+  int serve; // echo back rather than start the exchange.
+  int rounds;
+  nk_status status;
+};
+
+// Reads one byte from a non-blocking descriptor, parking until it is there.
+static nk_status io_read_byte(int fd, char *c) {
+  while (1) {
+    ssize_t r = read(fd, c, 1);
+    if (r == 1) {
+      return NK_OK;
+    }
+    if (r == 0 || errno != EAGAIN) {
+      return NK_ERR_STATE;
+    }
+    nk_status s = nk_fd_wait(fd, NK_FD_READ);
+    if (s != NK_OK) {
+      return s;
+    }
+  }
+}
+
+static void io_pingpong_thd(nk_thd *self, void *_arg) {
+  struct io_pingpong_arg *arg = _arg;
+  char c = 'x';
+  for (int i = 0; i < IO_PINGPONG_ROUNDS; i++) {
+    if (!arg->serve && write(arg->fd, &c, 1) != 1) {
+      arg->status = NK_ERR_STATE;
+      return;
+    }
+    arg->status = io_read_byte(arg->fd, &c);
+    if (arg->status != NK_OK) {
+      return;
+    }
+    if (arg->serve && write(arg->fd, &c, 1) != 1) {
+      arg->status = NK_ERR_STATE;
+      return;
+    }
+    arg->rounds++;
+  }
+}
+
+static uint64_t io_pingpong_run(FILE *__test_out, int workers) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv)) {
+    return UINT64_MAX;
+  }
+  nk_host *host;
+  if (nk_host_create(&host) != NK_OK) {
+    return UINT64_MAX;
+  }
+  struct io_pingpong_arg args[2] = {{sv[0], 0}, {sv[1], 1}};
+  for (int i = 0; i < 2; i++) {
+    nk_thd *t;
+    nk_thd_create_ext(host, &t, io_pingpong_thd, &args[i]);
+  }
+  uint64_t start = nk_now_ns();
+  nk_host_run(host, workers);
+  uint64_t elapsed = nk_now_ns() - start;
+  nk_host_destroy(host);
+  close(sv[0]);
+  close(sv[1]);
+  for (int i = 0; i < 2; i++) {
+    if (args[i].status != NK_OK || args[i].rounds != IO_PINGPONG_ROUNDS) {
+      return UINT64_MAX;
+    }
+  }
+  return elapsed / IO_PINGPONG_ROUNDS;
+}
+
+NK_TEST(io_pingpong) {
+  uint64_t one = io_pingpong_run(__test_out, 1);
+  NK_TEST_ASSERT(one != UINT64_MAX);
+  uint64_t two = io_pingpong_run(__test_out, 2);
+  NK_TEST_ASSERT(two != UINT64_MAX);
+  nk_test_error_report(__test_out,
+                       "socketpair round trip: %lu ns on one host-thread, "
+                       "%lu ns on two\n",
+                       (unsigned long)one, (unsigned long)two);
+
+  NK_TEST_OK();
+}
+
+#define IO_EXTERNAL_ROUNDS 50
+
+struct io_external_arg {
+  int pipe[2];
+  int got;
+  nk_status status;
+};
+
+// Writes to the pipe from outside the host, with pauses in between, so that
+// the host idles and its poller has to block in epoll to see the data.
+static void *io_external_writer(void *_arg) {
+  struct io_external_arg *arg = _arg;
+  for (int i = 0; i < IO_EXTERNAL_ROUNDS; i++) {
+    usleep(1000);
+    char c = 'y';
+    if (write(arg->pipe[1], &c, 1) != 1) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void io_external_reader(nk_thd *self, void *_arg) {
+  struct io_external_arg *arg = _arg;
+  for (int i = 0; i < IO_EXTERNAL_ROUNDS; i++) {
+    char c;
+    arg->status = io_read_byte(arg->pipe[0], &c);
+    if (arg->status != NK_OK) {
+      return;
+    }
+    arg->got++;
+  }
+}
+
+static void io_sleeper(nk_thd *self, void *_arg) {
+  // Keeps a timer pending alongside the descriptor waits.
+  for (int i = 0; i < 20; i++) {
+    nk_thd_sleep(3000000);
+  }
+}
+
+NK_TEST(io_external) {
+  struct io_external_arg arg = {{-1, -1}, 0, NK_OK};
+  NK_TEST_ASSERT(pipe(arg.pipe) == 0);
+  NK_TEST_ASSERT(fcntl(arg.pipe[0], F_SETFL, O_NONBLOCK) == 0);
+  nk_host *host;
+  NK_TEST_ASSERT(nk_host_create(&host) == NK_OK);
+  nk_thd *t;
+  NK_TEST_ASSERT(nk_thd_create_ext(host, &t, io_external_reader, &arg) ==
+                 NK_OK);
+  NK_TEST_ASSERT(nk_thd_create_ext(host, &t, io_sleeper, NULL) == NK_OK);
+  pthread_t writer;
+  pthread_create(&writer, NULL, io_external_writer, &arg);
+  nk_host_run(host, 2);
+  pthread_join(writer, NULL);
+  nk_host_destroy(host);
+  close(arg.pipe[0]);
+  close(arg.pipe[1]);
+  NK_TEST_ASSERT(arg.status == NK_OK);
+  NK_TEST_ASSERT(arg.got == IO_EXTERNAL_ROUNDS);
+
+  NK_TEST_OK();
+}
+
+static void io_bad_fd_thd(nk_thd *self, void *_arg) {
+  nk_status *status = _arg;
+  char path[] = "/tmp/nk_test_io_XXXXXX";
+  int fd = mkstemp(path);
+  unlink(path);
+  // Regular files do not support epoll.
+  status[0] = nk_fd_wait(fd, NK_FD_READ);
+  status[1] = nk_fd_wait(fd, 0);
+  close(fd);
+  status[2] = nk_fd_wait(-1, NK_FD_READ);
+}
+
+NK_TEST(io_bad_fd) {
+  nk_status status[3] = {NK_OK, NK_OK, NK_OK};
+  nk_host *host;
+  NK_TEST_ASSERT(nk_host_create(&host) == NK_OK);
+  nk_thd *t;
+  NK_TEST_ASSERT(nk_thd_create_ext(host, &t, io_bad_fd_thd, status) == NK_OK);
+  nk_host_run(host, 1);
+  nk_host_destroy(host);
+  NK_TEST_ASSERT(status[0] == NK_ERR_PARAM);
+  NK_TEST_ASSERT(status[1] == NK_ERR_PARAM);
+  NK_TEST_ASSERT(status[2] == NK_ERR_PARAM);
+
+  NK_TEST_OK();
+}
+
+#define IO_FILE_THREADS 16
+#define IO_FILE_BLOCKS 32
+#define IO_FILE_BLOCK_SIZE 4096
+
+struct io_file_arg {
+  int fd;
+  int index;
+  nk_status status;
+};
+
+static void io_file_thd(nk_thd *self, void *_arg) {
+  struct io_file_arg *arg = _arg;
+  char buf[IO_FILE_BLOCK_SIZE];
+  char back[IO_FILE_BLOCK_SIZE];
+  size_t done;
+  arg->status = NK_ERR_STATE;
+  // Blocks interleave with those of the other threads.
+  for (int i = 0; i < IO_FILE_BLOCKS; i++) {
+    uint64_t offset =
+        (uint64_t)(i * IO_FILE_THREADS + arg->index) * IO_FILE_BLOCK_SIZE;
+    memset(buf, 'a' + (arg->index + i) % 26, sizeof(buf));
+    if (nk_file_write(arg->fd, buf, sizeof(buf), offset, &done) != NK_OK ||
+        done != sizeof(buf)) {
+      return;
+    }
+  }
+  if (nk_file_fsync(arg->fd) != NK_OK) {
+    return;
+  }
+  for (int i = 0; i < IO_FILE_BLOCKS; i++) {
+    uint64_t offset =
+        (uint64_t)(i * IO_FILE_THREADS + arg->index) * IO_FILE_BLOCK_SIZE;
+    memset(buf, 'a' + (arg->index + i) % 26, sizeof(buf));
+    if (nk_file_read(arg->fd, back, sizeof(back), offset, &done) != NK_OK ||
+        done != sizeof(back) || memcmp(buf, back, sizeof(buf))) {
+      return;
+    }
+  }
+  // Past the end of the file: nothing to read.
+  uint64_t end =
+      (uint64_t)IO_FILE_THREADS * IO_FILE_BLOCKS * IO_FILE_BLOCK_SIZE;
+  if (nk_file_read(arg->fd, back, sizeof(back), end, &done) != NK_OK ||
+      done != 0) {
+    return;
+  }
+  // A bad descriptor reports the error through errno.
+  errno = 0;
+  if (nk_file_read(-1, back, sizeof(back), 0, &done) != NK_ERR_IO ||
+      errno != EBADF) {
+    return;
+  }
+  arg->status = NK_OK;
+}
+
+static int io_file_run(unsigned io_uring_entries, int workers) {
+  char path[] = "/tmp/nk_test_io_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return 0;
+  }
+  unlink(path);
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  attrs.io_uring_entries = io_uring_entries;
+  nk_host *host;
+  if (nk_host_create_ext(&host, &attrs) != NK_OK) {
+    return 0;
+  }
+  struct io_file_arg args[IO_FILE_THREADS];
+  for (int i = 0; i < IO_FILE_THREADS; i++) {
+    args[i] = (struct io_file_arg){fd, i, NK_ERR_STATE};
+    nk_thd *t;
+    nk_thd_create_ext(host, &t, io_file_thd, &args[i]);
+  }
+  nk_host_run(host, workers);
+  nk_host_destroy(host);
+  close(fd);
+  for (int i = 0; i < IO_FILE_THREADS; i++) {
+    if (args[i].status != NK_OK) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+NK_TEST(io_file) {
+  // On the host's ring, if the kernel has io_uring; else on the helpers.
+  NK_TEST_ASSERT(io_file_run(256, 1));
+  NK_TEST_ASSERT(io_file_run(256, 2));
+  // A ring smaller than the number of threads fills up.
+  NK_TEST_ASSERT(io_file_run(4, 2));
+  // On the helpers.
+  NK_TEST_ASSERT(io_file_run(0, 1));
+  NK_TEST_ASSERT(io_file_run(0, 2));
+
+  NK_TEST_OK();
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+#include "nk/mpscq.h"
+
+#include <pthread.h>
+
+#define MPSCQ_PRODUCERS 4
+#define MPSCQ_ITEMS 50000
+
+struct mpscq_item {
+  queue_entry link;
+  int producer;
+  int seq;
+};
+
+struct mpscq_producer_arg {
+  nk_mpscq *q;
+  struct mpscq_item *items;
+};
+
+static void *mpscq_producer(void *_arg) {
+  struct mpscq_producer_arg *arg = _arg;
+  for (int i = 0; i < MPSCQ_ITEMS; i++) {
+    nk_mpscq_push(arg->q, &arg->items[i].link);
+  }
+  return NULL;
+}
+
+NK_TEST(mpscq_fifo_per_producer) {
+  nk_mpscq q;
+  nk_mpscq_init(&q);
+  NK_TEST_ASSERT(nk_mpscq_empty(&q));
+  NK_TEST_ASSERT(nk_mpscq_trylock(&q));
+  NK_TEST_ASSERT(!nk_mpscq_trylock(&q));
+  NK_TEST_ASSERT(nk_mpscq_pop(&q) == NULL);
+
+  pthread_t threads[MPSCQ_PRODUCERS];
+  struct mpscq_producer_arg args[MPSCQ_PRODUCERS];
+  for (int p = 0; p < MPSCQ_PRODUCERS; p++) {
+    args[p].q = &q;
+    args[p].items = NK_ALLOCN(struct mpscq_item, MPSCQ_ITEMS);
+    for (int i = 0; i < MPSCQ_ITEMS; i++) {
+      args[p].items[i].producer = p;
+      args[p].items[i].seq = i;
+    }
+    NK_TEST_ASSERT(pthread_create(&threads[p], NULL, mpscq_producer,
+                                  &args[p]) == 0);
+  }
+
+  // Each producer's items must come out in the order it pushed them.
+  int next_seq[MPSCQ_PRODUCERS] = {0};
+  int total = 0;
+  while (total < MPSCQ_PRODUCERS * MPSCQ_ITEMS) {
+    queue_entry *e = nk_mpscq_pop(&q);
+    if (!e) {
+      continue;
+    }
+    struct mpscq_item *item = QUEUE_OBJ_FROM_ENTRY(struct mpscq_item, link, e);
+    NK_TEST_ASSERT_FMT(item->seq == next_seq[item->producer],
+                       "producer %d: got %d, expected %d", item->producer,
+                       item->seq, next_seq[item->producer]);
+    next_seq[item->producer]++;
+    total++;
+  }
+  NK_TEST_ASSERT(nk_mpscq_pop(&q) == NULL);
+  NK_TEST_ASSERT(nk_mpscq_empty(&q));
+  nk_mpscq_unlock(&q);
+
+  for (int p = 0; p < MPSCQ_PRODUCERS; p++) {
+    pthread_join(threads[p], NULL);
+    NK_FREE(args[p].items);
+  }
+
+  NK_TEST_OK();
+}
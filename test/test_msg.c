@@ -156,3 +156,76 @@ NK_TEST(msg_ring) {
 
   NK_TEST_OK();
 }
+
+#define MSG_HANDOFF_ROUNDS 2000
+
+struct msg_handoff_arg {
+  nk_port *ping, *pong;
+  int done;
+  int bystander_runs;
+};
+
+static void msg_handoff_pinger(nk_thd *self, void *_arg) {
+  struct msg_handoff_arg *arg = _arg;
+  for (int i = 0; i < MSG_HANDOFF_ROUNDS; i++) {
+    nk_msg *m;
+    if (nk_msg_send(arg->pong, arg->ping, NULL, NULL) != NK_OK ||
+        nk_msg_recv(arg->ping, &m) != NK_OK) {
+      return;
+    }
+    nk_msg_destroy(m);
+  }
+  arg->done = 1;
+}
+
+static void msg_handoff_ponger(nk_thd *self, void *_arg) {
+  struct msg_handoff_arg *arg = _arg;
+  for (int i = 0; i < MSG_HANDOFF_ROUNDS; i++) {
+    nk_msg *m;
+    if (nk_msg_recv(arg->pong, &m) != NK_OK ||
+        nk_msg_send(arg->ping, arg->pong, NULL, NULL) != NK_OK) {
+      return;
+    }
+    nk_msg_destroy(m);
+  }
+}
+
+static void msg_handoff_bystander(nk_thd *self, void *_arg) {
+  struct msg_handoff_arg *arg = _arg;
+  while (!arg->done) {
+    arg->bystander_runs++;
+    nk_thd_yield();
+  }
+}
+
+NK_TEST(msg_handoff) {
+  nk_host *h;
+  NK_TEST_ASSERT(nk_host_create(&h) == NK_OK);
+
+  struct msg_handoff_arg arg = {NULL, NULL, 0, 0};
+  NK_TEST_ASSERT(nk_port_create(h, &arg.ping, NK_PORT_THD) == NK_OK);
+  NK_TEST_ASSERT(nk_port_create(h, &arg.pong, NK_PORT_THD) == NK_OK);
+  nk_thd *pinger, *ponger, *bystander;
+  NK_TEST_ASSERT(nk_thd_create_ext(h, &ponger, msg_handoff_ponger, &arg) ==
+                 NK_OK);
+  NK_TEST_ASSERT(nk_thd_create_ext(h, &bystander, msg_handoff_bystander,
+                                   &arg) == NK_OK);
+  NK_TEST_ASSERT(nk_thd_create_ext(h, &pinger, msg_handoff_pinger, &arg) ==
+                 NK_OK);
+
+  nk_host_run(h, 1);
+  NK_TEST_ASSERT(arg.done);
+  // Each message hands the receiver straight to the run-next slot, so the
+  // bystander does not get a turn per message...
+  NK_TEST_ASSERT_FMT(arg.bystander_runs < MSG_HANDOFF_ROUNDS,
+                     "bystander ran %d times", arg.bystander_runs);
+  // ...but it is not starved either.
+  NK_TEST_ASSERT_FMT(arg.bystander_runs > MSG_HANDOFF_ROUNDS / 64,
+                     "bystander ran %d times", arg.bystander_runs);
+
+  nk_port_destroy(arg.ping);
+  nk_port_destroy(arg.pong);
+  nk_host_destroy(h);
+
+  NK_TEST_OK();
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "test.h"
+#include "nk/numa.h"
+#include "nk/thd.h"
+
+#include <sched.h>
+#include <stdio.h>
+
+NK_TEST(numa_topology) {
+  nk_numa *numa = NK_ALLOC(nk_numa);
+  NK_TEST_ASSERT(nk_numa_init(numa, NULL) == NK_OK);
+  NK_TEST_ASSERT(numa->nnodes >= 1 && numa->nnodes <= NK_NUMA_MAX_NODES);
+  NK_TEST_ASSERT(numa->cpu_first[0] == 0);
+  NK_TEST_ASSERT(numa->cpu_first[numa->nnodes] == numa->ncpus);
+  for (int i = 0; i < numa->nnodes; i++) {
+    NK_TEST_ASSERT(numa->cpu_first[i] < numa->cpu_first[i + 1]);
+  }
+
+  // Narrow it to one CPU, as a single CPU and as a range.
+  int cpu = numa->cpus[numa->ncpus - 1];
+  char list[32];
+  snprintf(list, sizeof(list), "%d", cpu);
+  NK_TEST_ASSERT(nk_numa_init(numa, list) == NK_OK);
+  NK_TEST_ASSERT(numa->nnodes == 1 && numa->ncpus == 1);
+  NK_TEST_ASSERT(numa->cpus[0] == cpu);
+  snprintf(list, sizeof(list), "%d-%d,%d\n", cpu, cpu, cpu);
+  NK_TEST_ASSERT(nk_numa_init(numa, list) == NK_OK);
+  NK_TEST_ASSERT(numa->ncpus == 1);
+
+  static const char *bad[] = {"", "x", "1-", "-1", "3-1", "0,,1", "0 1",
+                              "4096"};
+  for (int i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+    NK_TEST_ASSERT_FMT(nk_numa_init(numa, bad[i]) == NK_ERR_PARAM,
+                       "accepted \"%s\"", bad[i]);
+  }
+
+  NK_FREE(numa);
+  NK_TEST_OK();
+}
+
+#define NUMA_PLACED_THREADS 32
+
+struct numa_placed_arg {
+  int cpu;
+  int misplaced;
+};
+
+static void numa_placed_thd(nk_thd *self, void *_arg) {
+  struct numa_placed_arg *arg = _arg;
+  for (int i = 0; i < 10; i++) {
+    if (sched_getcpu() != arg->cpu) {
+      __atomic_add_fetch(&arg->misplaced, 1, __ATOMIC_SEQ_CST);
+    }
+    nk_thd_yield();
+  }
+}
+
+// Host-threads pinned to one CPU run their threads there, however many there
+// are and whichever mode places them.
+NK_TEST(numa_host_placement) {
+  nk_numa *numa = NK_ALLOC(nk_numa);
+  NK_TEST_ASSERT(nk_numa_init(numa, NULL) == NK_OK);
+  struct numa_placed_arg arg = {numa->cpus[0], 0};
+  NK_FREE(numa);
+  char list[32];
+  snprintf(list, sizeof(list), "%d", arg.cpu);
+
+  static const int modes[] = {NK_HOST_AFFINITY_NODE, NK_HOST_AFFINITY_CPU};
+  for (int m = 0; m < 2; m++) {
+    nk_host_attrs attrs;
+    nk_host_attrs_init(&attrs);
+    attrs.affinity = modes[m];
+    attrs.cpus = list;
+    nk_host *host;
+    NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_OK);
+    for (int i = 0; i < NUMA_PLACED_THREADS; i++) {
+      nk_thd *t;
+      NK_TEST_ASSERT(nk_thd_create_ext(host, &t, numa_placed_thd, &arg) ==
+                     NK_OK);
+    }
+    nk_host_run(host, 3);
+    nk_host_destroy(host);
+    NK_TEST_ASSERT_FMT(arg.misplaced == 0, "%d runs off CPU %d",
+                       arg.misplaced, arg.cpu);
+  }
+
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  nk_host *host;
+  attrs.affinity = NK_HOST_AFFINITY_CPU;
+  attrs.cpus = "nonsense";
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_ERR_PARAM);
+  attrs.affinity = 3;
+  attrs.cpus = NULL;
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_ERR_PARAM);
+
+  NK_TEST_OK();
+}
@@ -23,6 +23,27 @@
 #include "test.h"
 #include "nk/kernel.h"
 #include "nk/thd.h"
+#include "nk/msg.h"
+#include "nk/sync.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// The process's resident set size, in bytes.
+static size_t thd_rss() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  unsigned long size = 0, resident = 0;
+  if (f) {
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
 
 static void thd_dpc_main(void *arg) {
   int *flag = arg;
@@ -86,3 +107,1689 @@ NK_TEST(thd_two_threads) {
 
   NK_TEST_OK();
 }
+
+#define THD_PRIO_FLOOD 2000
+#define THD_PRIO_SAMPLES 200
+
+struct thd_prio_arg {
+  int flood_done;
+  int flood_done_during_samples;
+  int sample_done;
+  uint64_t sample_start;
+  uint64_t latency[THD_PRIO_SAMPLES];
+  int nsamples;
+};
+
+static uint64_t thd_prio_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// A bulk background work item: ~20us of CPU.
+static void thd_prio_flood_dpc(void *_arg) {
+  struct thd_prio_arg *arg = _arg;
+  uint64_t end = thd_prio_now_ns() + 20000;
+  while (thd_prio_now_ns() < end) {
+  }
+  arg->flood_done++;
+}
+
+static void thd_prio_sample_dpc(void *_arg) {
+  struct thd_prio_arg *arg = _arg;
+  arg->latency[arg->nsamples++] = thd_prio_now_ns() - arg->sample_start;
+  arg->sample_done = 1;
+}
+
+static void thd_prio_driver(nk_thd *self, void *_arg) {
+  struct thd_prio_arg *arg = _arg;
+  for (int i = 0; i < THD_PRIO_SAMPLES; i++) {
+    nk_dpc *dpc;
+    arg->sample_done = 0;
+    arg->sample_start = thd_prio_now_ns();
+    if (nk_dpc_create_prio(&dpc, thd_prio_sample_dpc, arg, NK_PRIO_HIGHEST) !=
+        NK_OK) {
+      return;
+    }
+    while (!arg->sample_done) {
+      nk_thd_yield();
+    }
+  }
+  arg->flood_done_during_samples = arg->flood_done;
+}
+
+static int thd_prio_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t thd_prio_run(int flood, int *flood_done_during_samples) {
+  nk_host *host;
+  if (nk_host_create(&host) != NK_OK) {
+    return UINT64_MAX;
+  }
+  struct thd_prio_arg *arg = NK_ALLOC(struct thd_prio_arg);
+  for (int i = 0; i < flood; i++) {
+    nk_dpc *dpc;
+    nk_dpc_create_ext_prio(host, &dpc, thd_prio_flood_dpc, arg, NK_PRIO_LOWEST);
+  }
+  nk_thd *driver;
+  nk_thd_create_ext_prio(host, &driver, thd_prio_driver, arg, NK_PRIO_HIGHEST);
+  nk_host_run(host, 1);
+  nk_host_destroy(host);
+
+  uint64_t p99 = UINT64_MAX;
+  if (arg->nsamples == THD_PRIO_SAMPLES && arg->flood_done == flood) {
+    qsort(arg->latency, THD_PRIO_SAMPLES, sizeof(uint64_t), thd_prio_cmp);
+    p99 = arg->latency[THD_PRIO_SAMPLES * 99 / 100];
+  }
+  *flood_done_during_samples = arg->flood_done_during_samples;
+  NK_FREE(arg);
+  return p99;
+}
+
+NK_TEST(thd_prio_latency) {
+  int during;
+  uint64_t idle_p99 = thd_prio_run(0, &during);
+  NK_TEST_ASSERT(idle_p99 != UINT64_MAX);
+  uint64_t flood_p99 = thd_prio_run(THD_PRIO_FLOOD, &during);
+  NK_TEST_ASSERT(flood_p99 != UINT64_MAX);
+  nk_test_error_report(__test_out, "high-prio dispatch p99: %lu ns idle, %lu "
+                                   "ns under %d-DPC low-prio flood\n",
+                       (unsigned long)idle_p99, (unsigned long)flood_p99,
+                       THD_PRIO_FLOOD);
+
+  // FIFO dispatch would put each sample behind the whole ~40ms flood. With
+  // priorities it waits for at most a couple of flood items.
+  NK_TEST_ASSERT(flood_p99 < 1000000);
+  // ...while the starvation guard still let the flood make progress.
+  NK_TEST_ASSERT(during > 0 && during < THD_PRIO_FLOOD);
+
+  NK_TEST_OK();
+}
+
+#define THD_WAKE_SAMPLES 500
+
+struct thd_wake_arg {
+  nk_host *host;
+  nk_port *keeper_port;
+  uint64_t gap_ns;
+  uint64_t start;
+  volatile int done;
+  uint64_t latency[THD_WAKE_SAMPLES];
+  int nsamples;
+};
+
+static void thd_wake_sample_dpc(void *_arg) {
+  struct thd_wake_arg *arg = _arg;
+  arg->latency[arg->nsamples++] = thd_prio_now_ns() - arg->start;
+  __atomic_store_n(&arg->done, 1, __ATOMIC_RELEASE);
+}
+
+static void thd_wake_finish_dpc(void *_arg) {
+  struct thd_wake_arg *arg = _arg;
+  nk_msg_send(arg->keeper_port, NULL, NULL, NULL);
+}
+
+// Keeps the host alive while the injector runs, so that idle host-threads
+// park rather than exit.
+static void thd_wake_keeper(nk_thd *self, void *_arg) {
+  struct thd_wake_arg *arg = _arg;
+  nk_msg *msg;
+  if (nk_msg_recv(arg->keeper_port, &msg) == NK_OK) {
+    nk_msg_destroy(msg);
+  }
+}
+
+// Injects DPCs from outside the host one at a time, leaving the host idle for
+// `gap_ns` between them.
+static void *thd_wake_injector(void *_arg) {
+  struct thd_wake_arg *arg = _arg;
+  nk_dpc *dpc;
+  for (int i = 0; i < THD_WAKE_SAMPLES; i++) {
+    uint64_t resume = thd_prio_now_ns() + arg->gap_ns;
+    while (thd_prio_now_ns() < resume) {
+    }
+    arg->done = 0;
+    arg->start = thd_prio_now_ns();
+    nk_dpc_create_ext(arg->host, &dpc, thd_wake_sample_dpc, arg);
+    while (!__atomic_load_n(&arg->done, __ATOMIC_ACQUIRE)) {
+    }
+  }
+  nk_dpc_create_ext(arg->host, &dpc, thd_wake_finish_dpc, arg);
+  return NULL;
+}
+
+// Returns the median wakeup latency, or UINT64_MAX on failure.
+static uint64_t thd_wake_run(uint64_t spin_ns, uint64_t gap_ns) {
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  attrs.idle_spin_ns = spin_ns;
+  struct thd_wake_arg *arg = NK_ALLOC(struct thd_wake_arg);
+  arg->gap_ns = gap_ns;
+  if (nk_host_create_ext(&arg->host, &attrs) != NK_OK) {
+    NK_FREE(arg);
+    return UINT64_MAX;
+  }
+  nk_thd *keeper;
+  pthread_t injector;
+  nk_port_create(arg->host, &arg->keeper_port, NK_PORT_THD);
+  nk_thd_create_ext(arg->host, &keeper, thd_wake_keeper, arg);
+  pthread_create(&injector, NULL, thd_wake_injector, arg);
+  nk_host_run(arg->host, 4);
+  pthread_join(injector, NULL);
+  nk_port_destroy(arg->keeper_port);
+  nk_host_destroy(arg->host);
+
+  uint64_t p50 = UINT64_MAX;
+  if (arg->nsamples == THD_WAKE_SAMPLES) {
+    qsort(arg->latency, THD_WAKE_SAMPLES, sizeof(uint64_t), thd_prio_cmp);
+    p50 = arg->latency[THD_WAKE_SAMPLES / 2];
+  }
+  NK_FREE(arg);
+  return p50;
+}
+
+NK_TEST(thd_idle_wakeup) {
+  // Parking right away: every injected DPC has to wake a parked host-thread.
+  uint64_t park_p50 = thd_wake_run(0, 20000);
+  NK_TEST_ASSERT(park_p50 != UINT64_MAX);
+  // Default spin: short gaps are covered by a spinning host-thread (on
+  // machines with more than one CPU).
+  uint64_t spin_p50 = thd_wake_run(50000, 20000);
+  NK_TEST_ASSERT(spin_p50 != UINT64_MAX);
+  // Long gaps: host-threads spin, then park, and must still be woken.
+  uint64_t long_p50 = thd_wake_run(50000, 200000);
+  NK_TEST_ASSERT(long_p50 != UINT64_MAX);
+  nk_test_error_report(__test_out, "idle wakeup p50: %lu ns without spinning, "
+                                   "%lu ns with spinning, %lu ns after long "
+                                   "idle gaps\n",
+                       (unsigned long)park_p50, (unsigned long)spin_p50,
+                       (unsigned long)long_p50);
+
+  NK_TEST_OK();
+}
+
+#define THD_YIELD_ROUNDS 100000
+
+struct thd_yield_arg {
+  int last;       // which thread ran last.
+  int alternated; // how many times the other thread ran in between.
+};
+
+struct thd_yield_thd_arg {
+  struct thd_yield_arg *shared;
+  int id;
+};
+
+static void thd_yield_thd(nk_thd *self, void *_arg) {
+  struct thd_yield_thd_arg *arg = _arg;
+  for (int i = 0; i < THD_YIELD_ROUNDS; i++) {
+    if (arg->shared->last != arg->id) {
+      arg->shared->alternated++;
+    }
+    arg->shared->last = arg->id;
+    nk_thd_yield();
+  }
+}
+
+NK_TEST(thd_yield_switch) {
+  nk_host *host;
+  NK_TEST_ASSERT(nk_host_create(&host) == NK_OK);
+  struct thd_yield_arg shared = {-1, 0};
+  struct thd_yield_thd_arg args[2] = {{&shared, 0}, {&shared, 1}};
+  nk_thd *thds[2];
+  for (int i = 0; i < 2; i++) {
+    NK_TEST_ASSERT(nk_thd_create_ext(host, &thds[i], thd_yield_thd,
+                                     &args[i]) == NK_OK);
+  }
+  uint64_t start = thd_prio_now_ns();
+  nk_host_run(host, 1);
+  uint64_t elapsed = thd_prio_now_ns() - start;
+  nk_host_destroy(host);
+
+  // Two threads on one host-thread take strict turns.
+  NK_TEST_ASSERT_FMT(shared.alternated >= 2 * THD_YIELD_ROUNDS - 1,
+                     "threads alternated %d times", shared.alternated);
+  nk_test_error_report(__test_out, "yield switch: %lu ns per yield\n",
+                       (unsigned long)(elapsed / (2 * THD_YIELD_ROUNDS)));
+
+  NK_TEST_OK();
+}
+
+#define THD_BATCH_SEEDERS 100
+#define THD_BATCH_FANOUT 200
+
+static void thd_batch_leaf_dpc(void *_arg) {
+  int *ran = _arg;
+  (*ran)++;
+}
+
+static void thd_batch_seed_dpc(void *_arg) {
+  for (int i = 0; i < THD_BATCH_FANOUT; i++) {
+    nk_dpc *dpc;
+    nk_dpc_create(&dpc, thd_batch_leaf_dpc, _arg);
+  }
+}
+
+// Returns the time taken (in ns) to run all DPCs, or UINT64_MAX on failure.
+static uint64_t thd_batch_run(int batch) {
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  attrs.batch = batch;
+  nk_host *host;
+  if (nk_host_create_ext(&host, &attrs) != NK_OK) {
+    return UINT64_MAX;
+  }
+  int ran = 0;
+  for (int i = 0; i < THD_BATCH_SEEDERS; i++) {
+    nk_dpc *dpc;
+    nk_dpc_create_ext(host, &dpc, thd_batch_seed_dpc, &ran);
+  }
+  uint64_t start = thd_prio_now_ns();
+  nk_host_run(host, 1);
+  uint64_t elapsed = thd_prio_now_ns() - start;
+  nk_host_destroy(host);
+  return ran == THD_BATCH_SEEDERS * THD_BATCH_FANOUT ? elapsed : UINT64_MAX;
+}
+
+NK_TEST(thd_dpc_batch) {
+  nk_host_attrs attrs;
+  nk_host *host;
+  nk_host_attrs_init(&attrs);
+  attrs.batch = 0;
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_ERR_PARAM);
+  attrs.batch = NK_HOSTTHD_BATCH_MAX + 1;
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_ERR_PARAM);
+
+  static const int batches[] = {1, 4, 16, NK_HOSTTHD_BATCH_MAX};
+  uint64_t elapsed[4];
+  for (int i = 0; i < 4; i++) {
+    elapsed[i] = thd_batch_run(batches[i]);
+    NK_TEST_ASSERT_FMT(elapsed[i] != UINT64_MAX, "batch %d lost DPCs",
+                       batches[i]);
+  }
+  nk_test_error_report(__test_out, "DPC throughput (batch 1/4/16/%d):",
+                       NK_HOSTTHD_BATCH_MAX);
+  for (int i = 0; i < 4; i++) {
+    nk_test_error_report(
+        __test_out, " %.2f",
+        (double)(THD_BATCH_SEEDERS * THD_BATCH_FANOUT) * 1000.0 / elapsed[i]);
+  }
+  nk_test_error_report(__test_out, " Mdpc/s\n");
+
+  NK_TEST_OK();
+}
+
+#define THD_SLEEP_THREADS 8
+#define THD_SLEEP_ROUNDS 3
+
+struct thd_sleep_arg {
+  uint64_t ns;
+  int early;
+  uint64_t max_overshoot;
+};
+
+static void thd_sleep_thd(nk_thd *self, void *_arg) {
+  struct thd_sleep_arg *arg = _arg;
+  for (int i = 0; i < THD_SLEEP_ROUNDS; i++) {
+    uint64_t start = nk_now_ns();
+    nk_thd_sleep(arg->ns);
+    uint64_t slept = nk_now_ns() - start;
+    if (slept < arg->ns) {
+      arg->early = 1;
+    } else if (slept - arg->ns > arg->max_overshoot) {
+      arg->max_overshoot = slept - arg->ns;
+    }
+  }
+}
+
+static uint64_t thd_sleep_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+NK_TEST(thd_sleep) {
+  nk_host *host;
+  NK_TEST_ASSERT(nk_host_create(&host) == NK_OK);
+  struct thd_sleep_arg args[THD_SLEEP_THREADS];
+  for (int i = 0; i < THD_SLEEP_THREADS; i++) {
+    nk_thd *t;
+    memset(&args[i], 0, sizeof(args[i]));
+    args[i].ns = (i + 1) * 1000000ull;
+    NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_sleep_thd, &args[i]) ==
+                   NK_OK);
+  }
+  uint64_t cpu = thd_sleep_cpu_ns();
+  uint64_t start = nk_now_ns();
+  nk_host_run(host, 2);
+  uint64_t elapsed = nk_now_ns() - start;
+  cpu = thd_sleep_cpu_ns() - cpu;
+  nk_host_destroy(host);
+
+  uint64_t worst = 0;
+  for (int i = 0; i < THD_SLEEP_THREADS; i++) {
+    NK_TEST_ASSERT_FMT(!args[i].early, "thread %d woke early", i);
+    if (args[i].max_overshoot > worst) {
+      worst = args[i].max_overshoot;
+    }
+  }
+  // The sleeps overlap: the host runs about as long as the longest thread
+  // sleeps, and idles meanwhile rather than polling.
+  uint64_t longest = THD_SLEEP_THREADS * THD_SLEEP_ROUNDS * 1000000ull;
+  NK_TEST_ASSERT_FMT(elapsed < 2 * longest, "ran %lu ns for %lu ns of sleep",
+                     (unsigned long)elapsed, (unsigned long)longest);
+  NK_TEST_ASSERT_FMT(cpu < elapsed / 2, "used %lu ns of CPU in %lu ns",
+                     (unsigned long)cpu, (unsigned long)elapsed);
+  nk_test_error_report(__test_out,
+                       "sleep overshoot: worst %lu ns; "
+                       "%lu ns CPU over %lu ns\n",
+                       (unsigned long)worst, (unsigned long)cpu,
+                       (unsigned long)elapsed);
+
+  NK_TEST_OK();
+}
+
+struct thd_timer_arg;
+
+struct thd_timer_order_arg {
+  struct thd_timer_arg *shared;
+  int id;
+};
+
+struct thd_timer_arg {
+  struct thd_timer_order_arg ids[3];
+  int order[3];
+  int nran;
+  int periodic_runs;
+  nk_status periodic_cancel;
+  nk_dpc *doomed;
+  nk_status doomed_cancel;
+  int doomed_ran;
+};
+
+static void thd_timer_order_dpc(void *_arg) {
+  struct thd_timer_order_arg *arg = _arg;
+  arg->shared->order[arg->shared->nran++] = arg->id;
+}
+
+static void thd_timer_periodic_dpc(void *_arg) {
+  struct thd_timer_arg *arg = _arg;
+  if (++arg->periodic_runs == 5) {
+    arg->periodic_cancel = nk_dpc_cancel(nk_dpc_self());
+  }
+}
+
+static void thd_timer_doomed_dpc(void *_arg) {
+  struct thd_timer_arg *arg = _arg;
+  arg->doomed_ran = 1;
+}
+
+static void thd_timer_canceller_dpc(void *_arg) {
+  struct thd_timer_arg *arg = _arg;
+  arg->doomed_cancel = nk_dpc_cancel(arg->doomed);
+}
+
+NK_TEST(thd_dpc_timers) {
+  nk_host *host;
+  NK_TEST_ASSERT(nk_host_create(&host) == NK_OK);
+  struct thd_timer_arg *arg = NK_ALLOC(struct thd_timer_arg);
+  nk_dpc *dpc;
+  uint64_t now = nk_now_ns();
+  NK_TEST_ASSERT(nk_dpc_create_ext_periodic(host, &dpc, 0,
+                                            thd_timer_periodic_dpc,
+                                            arg) == NK_ERR_PARAM);
+  // Created in reverse order of their deadlines.
+  for (int i = 2; i >= 0; i--) {
+    arg->ids[i].shared = arg;
+    arg->ids[i].id = i;
+    NK_TEST_ASSERT(nk_dpc_create_ext_at(host, &dpc,
+                                        now + (i + 1) * 2000000ull,
+                                        thd_timer_order_dpc,
+                                        &arg->ids[i]) == NK_OK);
+  }
+  NK_TEST_ASSERT(nk_dpc_create_ext_periodic(host, &dpc, 1000000ull,
+                                            thd_timer_periodic_dpc,
+                                            arg) == NK_OK);
+  NK_TEST_ASSERT(nk_dpc_create_ext_at(host, &arg->doomed, now + 50000000ull,
+                                      thd_timer_doomed_dpc, arg) == NK_OK);
+  NK_TEST_ASSERT(nk_dpc_create_ext_at(host, &dpc, now + 1000000ull,
+                                      thd_timer_canceller_dpc,
+                                      arg) == NK_OK);
+  uint64_t start = nk_now_ns();
+  nk_host_run(host, 2);
+  uint64_t elapsed = nk_now_ns() - start;
+  nk_host_destroy(host);
+
+  NK_TEST_ASSERT(arg->nran == 3);
+  NK_TEST_ASSERT(arg->order[0] == 0 && arg->order[1] == 1 &&
+                 arg->order[2] == 2);
+  // The periodic DPC stopped once cancelled from its own run.
+  NK_TEST_ASSERT(arg->periodic_runs == 5);
+  NK_TEST_ASSERT(arg->periodic_cancel == NK_ERR_STATE);
+  // The doomed DPC was cancelled in time, and the host did not wait for it.
+  NK_TEST_ASSERT(arg->doomed_cancel == NK_OK);
+  NK_TEST_ASSERT(!arg->doomed_ran);
+  NK_TEST_ASSERT_FMT(elapsed >= 6000000ull && elapsed < 50000000ull,
+                     "host ran for %lu ns", (unsigned long)elapsed);
+  NK_FREE(arg);
+
+  NK_TEST_OK();
+}
+
+#define THD_BLOCKING_ROUNDS 50
+
+struct thd_blocking_arg {
+  int pipe[2];
+  int acked;
+  int ok;
+};
+
+// Blocks its host-thread in read() each round, until the writer gets to run.
+static void thd_blocking_reader(nk_thd *self, void *_arg) {
+  struct thd_blocking_arg *arg = _arg;
+  for (int i = 0; i < THD_BLOCKING_ROUNDS; i++) {
+    char c;
+    nk_blocking_begin();
+    ssize_t r = read(arg->pipe[0], &c, 1);
+    nk_blocking_end();
+    if (r != 1) {
+      return;
+    }
+    __atomic_store_n(&arg->acked, i + 1, __ATOMIC_SEQ_CST);
+  }
+  arg->ok = 1;
+}
+
+static void thd_blocking_writer(nk_thd *self, void *_arg) {
+  struct thd_blocking_arg *arg = _arg;
+  for (int i = 0; i < THD_BLOCKING_ROUNDS; i++) {
+    char c = 'z';
+    if (write(arg->pipe[1], &c, 1) != 1) {
+      return;
+    }
+    // Wait for the reader to take it, so that it blocks again next round.
+    while (__atomic_load_n(&arg->acked, __ATOMIC_SEQ_CST) <= i) {
+      nk_thd_sleep(100000);
+    }
+  }
+}
+
+static int thd_blocking_run(int blocking_spares, int workers) {
+  struct thd_blocking_arg arg = {{-1, -1}, 0, 0};
+  if (pipe(arg.pipe)) {
+    return 0;
+  }
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  attrs.blocking_spares = blocking_spares;
+  nk_host *host;
+  if (nk_host_create_ext(&host, &attrs) != NK_OK) {
+    return 0;
+  }
+  nk_thd *t;
+  nk_thd_create_ext(host, &t, thd_blocking_reader, &arg);
+  nk_thd_create_ext(host, &t, thd_blocking_writer, &arg);
+  nk_host_run(host, workers);
+  nk_host_destroy(host);
+  close(arg.pipe[0]);
+  close(arg.pipe[1]);
+  return arg.ok;
+}
+
+NK_TEST(thd_blocking) {
+  // With one worker, the writer only runs if a spare covers for the blocked
+  // reader; with one spare, only if the spare is reused round after round.
+  NK_TEST_ASSERT(thd_blocking_run(1, 1));
+  NK_TEST_ASSERT(thd_blocking_run(4, 1));
+  NK_TEST_ASSERT(thd_blocking_run(4, 3));
+  // Without spares, another worker has to do.
+  NK_TEST_ASSERT(thd_blocking_run(0, 2));
+
+  NK_TEST_OK();
+}
+
+#define THD_ELASTIC_BUSY 16
+
+struct thd_elastic_arg {
+  nk_host *host;
+  int busy_done;
+  int peak;
+  nk_host_stats after;
+};
+
+static void thd_elastic_busy(nk_thd *self, void *_arg) {
+  struct thd_elastic_arg *arg = _arg;
+  // Runs in slices of about 50us for about 20ms, keeping the run queue long.
+  for (int i = 0; i < 400; i++) {
+    uint64_t end = nk_now_ns() + 50000;
+    while (nk_now_ns() < end) {
+    }
+    nk_host_stats stats;
+    nk_host_get_stats(arg->host, &stats);
+    int peak = __atomic_load_n(&arg->peak, __ATOMIC_SEQ_CST);
+    while (stats.workers > peak &&
+           !__atomic_compare_exchange_n(&arg->peak, &peak, stats.workers, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    }
+    nk_thd_yield();
+  }
+  __atomic_add_fetch(&arg->busy_done, 1, __ATOMIC_SEQ_CST);
+}
+
+static void thd_elastic_idle(nk_thd *self, void *_arg) {
+  struct thd_elastic_arg *arg = _arg;
+  while (__atomic_load_n(&arg->busy_done, __ATOMIC_SEQ_CST) <
+         THD_ELASTIC_BUSY) {
+    nk_thd_sleep(1000000);
+  }
+  // Idle long enough for the extra workers to go.
+  nk_thd_sleep(100000000);
+  nk_host_get_stats(arg->host, &arg->after);
+}
+
+NK_TEST(thd_elastic) {
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  attrs.min_workers = 1;
+  attrs.max_workers = 4;
+  attrs.grow_delay_ns = 200000;
+  attrs.shrink_idle_ns = 10000000;
+  nk_host *host;
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_OK);
+  struct thd_elastic_arg arg = {host, 0, 0};
+  nk_thd *t;
+  for (int i = 0; i < THD_ELASTIC_BUSY; i++) {
+    NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_elastic_busy, &arg) ==
+                   NK_OK);
+  }
+  NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_elastic_idle, &arg) ==
+                 NK_OK);
+  nk_host_run(host, 1);
+  nk_host_stats stats;
+  nk_host_get_stats(host, &stats);
+  nk_host_destroy(host);
+
+  // Grew to the cap under load, and shrank back once idle. (The host-thread
+  // waiting for the sleeper's timer stays.)
+  NK_TEST_ASSERT_FMT(arg.peak == 4, "peaked at %d workers", arg.peak);
+  NK_TEST_ASSERT(stats.grown >= 3);
+  NK_TEST_ASSERT_FMT(arg.after.workers <= 2, "%d workers left idle",
+                     arg.after.workers);
+  NK_TEST_ASSERT(stats.shrunk >= 2);
+
+  // Bad bounds.
+  attrs.min_workers = 5;
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_ERR_PARAM);
+
+  NK_TEST_OK();
+}
+
+#define THD_AFFINITY_WORKERS 4
+#define THD_AFFINITY_PINNED 8
+#define THD_AFFINITY_SOFT 4
+#define THD_AFFINITY_ROUNDS 200
+#define THD_AFFINITY_MSGS 100
+#define THD_AFFINITY_PORT_HOSTTHD 2
+
+struct thd_affinity_arg {
+  nk_port *port;
+  int pipe[2];
+  int misplaced;
+  int failed;
+  int soft_done;
+  int dpcs;
+};
+
+struct thd_affinity_pin {
+  struct thd_affinity_arg *arg;
+  int index;
+  int blocks; // waits for the sender in a blocking section at the end.
+};
+
+static void thd_affinity_check(struct thd_affinity_arg *arg, int index) {
+  if (nk_hostthd_self()->index != index) {
+    __atomic_add_fetch(&arg->misplaced, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void thd_affinity_expect(struct thd_affinity_arg *arg, int cond) {
+  if (!cond) {
+    __atomic_add_fetch(&arg->failed, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Runs on its host-thread from its first yield on, whether it yields, sleeps
+// or waits on a blocking call.
+static void thd_affinity_pinned(nk_thd *self, void *_pin) {
+  struct thd_affinity_pin *pin = _pin;
+  thd_affinity_expect(pin->arg,
+                      nk_thd_set_affinity(self, pin->index) == NK_OK);
+  nk_thd_yield();
+  for (int i = 0; i < THD_AFFINITY_ROUNDS; i++) {
+    thd_affinity_check(pin->arg, pin->index);
+    if (i % 50 == 0) {
+      nk_thd_sleep(10000);
+    } else {
+      nk_thd_yield();
+    }
+  }
+  if (pin->blocks) {
+    // Covered by a spare meanwhile, which retires after.
+    char c;
+    nk_blocking_begin();
+    ssize_t r = read(pin->arg->pipe[0], &c, 1);
+    nk_blocking_end();
+    thd_affinity_expect(pin->arg, r == 1);
+    thd_affinity_check(pin->arg, pin->index);
+    nk_thd_yield();
+    thd_affinity_check(pin->arg, pin->index);
+  }
+}
+
+static void thd_affinity_soft(nk_thd *self, void *_arg) {
+  struct thd_affinity_arg *arg = _arg;
+  thd_affinity_expect(arg,
+                      nk_thd_set_affinity(self, NK_AFFINITY_SOFT) == NK_OK);
+  for (int i = 0; i < THD_AFFINITY_ROUNDS; i++) {
+    if (i % 20 == 0) {
+      nk_thd_sleep(10000);
+    } else {
+      nk_thd_yield();
+    }
+  }
+  __atomic_add_fetch(&arg->soft_done, 1, __ATOMIC_SEQ_CST);
+}
+
+static void thd_affinity_dpc(void *data) {
+  nk_msg *msg = data;
+  struct thd_affinity_arg *arg = msg->data1;
+  thd_affinity_check(arg, (int)(intptr_t)msg->data2);
+  __atomic_add_fetch(&arg->dpcs, 1, __ATOMIC_SEQ_CST);
+  nk_msg_destroy(msg);
+}
+
+static void thd_affinity_sender(nk_thd *self, void *_arg) {
+  struct thd_affinity_arg *arg = _arg;
+  for (int i = 0; i < THD_AFFINITY_MSGS; i++) {
+    thd_affinity_expect(
+        arg, nk_msg_send(arg->port, NULL, arg,
+                         (void *)(intptr_t)THD_AFFINITY_PORT_HOSTTHD) == NK_OK);
+    if (i % 10 == 0) {
+      nk_thd_yield();
+    }
+  }
+  // Let the first pinned thread out of its blocking call.
+  nk_thd_sleep(1000000);
+  char c = 'z';
+  thd_affinity_expect(arg, write(arg->pipe[1], &c, 1) == 1);
+}
+
+NK_TEST(thd_affinity) {
+  struct thd_affinity_arg arg = {NULL, {-1, -1}, 0, 0, 0, 0};
+  NK_TEST_ASSERT(pipe(arg.pipe) == 0);
+  nk_host *host;
+  NK_TEST_ASSERT(nk_host_create(&host) == NK_OK);
+  NK_TEST_ASSERT(nk_port_create(host, &arg.port, NK_PORT_DPC) == NK_OK);
+  nk_port_set_dpc(arg.port, thd_affinity_dpc, NULL);
+  nk_port_set_affinity(arg.port, THD_AFFINITY_PORT_HOSTTHD);
+
+  struct thd_affinity_pin pins[THD_AFFINITY_PINNED];
+  nk_thd *t;
+  for (int i = 0; i < THD_AFFINITY_PINNED; i++) {
+    pins[i].arg = &arg;
+    pins[i].index = i % THD_AFFINITY_WORKERS;
+    pins[i].blocks = i == 0;
+    NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_affinity_pinned,
+                                     &pins[i]) == NK_OK);
+  }
+  for (int i = 0; i < THD_AFFINITY_SOFT; i++) {
+    NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_affinity_soft, &arg) ==
+                   NK_OK);
+  }
+  NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_affinity_sender, &arg) ==
+                 NK_OK);
+  // Pinned from outside the host too.
+  nk_dpc *d;
+  nk_msg *msg;
+  NK_TEST_ASSERT(nk_msg_create(host, &msg) == NK_OK);
+  msg->data1 = &arg;
+  msg->data2 = (void *)(intptr_t)1;
+  NK_TEST_ASSERT(nk_dpc_create_ext_on(host, &d, 1, thd_affinity_dpc, msg) ==
+                 NK_OK);
+  NK_TEST_ASSERT(nk_dpc_create_ext_on(host, &d, -3, thd_affinity_dpc, msg) ==
+                 NK_ERR_PARAM);
+  NK_TEST_ASSERT(nk_thd_set_affinity(t, -3) == NK_ERR_PARAM);
+
+  nk_host_run(host, THD_AFFINITY_WORKERS);
+  nk_port_destroy(arg.port);
+  nk_host_destroy(host);
+  close(arg.pipe[0]);
+  close(arg.pipe[1]);
+
+  NK_TEST_ASSERT_FMT(arg.misplaced == 0, "%d runs off their host-thread",
+                     arg.misplaced);
+  NK_TEST_ASSERT(arg.failed == 0);
+  NK_TEST_ASSERT(arg.soft_done == THD_AFFINITY_SOFT);
+  NK_TEST_ASSERT(arg.dpcs == THD_AFFINITY_MSGS + 1);
+
+  NK_TEST_OK();
+}
+
+// A flood of DPCs in one group, and a pair of threads in another with three
+// times the weight, share one host-thread: the threads should get about three
+// quarters of it however many DPCs are queued.
+#define THD_GROUPS_FLOOD 64
+#define THD_GROUPS_THREADS 2
+#define THD_GROUPS_SLICE_NS 20000ull
+#define THD_GROUPS_RUN_NS 200000000ull
+
+struct thd_groups_arg {
+  nk_group *noisy, *quiet;
+  int stop;
+  int misgrouped;
+  int live;
+};
+
+static void thd_groups_spin() {
+  uint64_t end = nk_now_ns() + THD_GROUPS_SLICE_NS;
+  while (nk_now_ns() < end) {
+  }
+}
+
+static void thd_groups_dpc(void *_arg) {
+  struct thd_groups_arg *arg = _arg;
+  if (nk_dpc_self()->schob.group != arg->noisy) {
+    __atomic_add_fetch(&arg->misgrouped, 1, __ATOMIC_SEQ_CST);
+  }
+  thd_groups_spin();
+  nk_dpc *d;
+  if (__atomic_load_n(&arg->stop, __ATOMIC_SEQ_CST) ||
+      nk_dpc_create(&d, thd_groups_dpc, arg) != NK_OK) {
+    __atomic_sub_fetch(&arg->live, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void thd_groups_quiet(nk_thd *self, void *_arg) {
+  struct thd_groups_arg *arg = _arg;
+  if (self->schob.group != arg->quiet) {
+    __atomic_add_fetch(&arg->misgrouped, 1, __ATOMIC_SEQ_CST);
+  }
+  while (!__atomic_load_n(&arg->stop, __ATOMIC_SEQ_CST)) {
+    thd_groups_spin();
+    nk_thd_yield();
+  }
+}
+
+static void thd_groups_timer(void *_arg) {
+  struct thd_groups_arg *arg = _arg;
+  __atomic_store_n(&arg->stop, 1, __ATOMIC_SEQ_CST);
+}
+
+NK_TEST(thd_groups) {
+  nk_host *host;
+  NK_TEST_ASSERT(nk_host_create(&host) == NK_OK);
+  struct thd_groups_arg arg = {0};
+  NK_TEST_ASSERT(nk_group_create(host, &arg.noisy, 0) == NK_ERR_PARAM);
+  NK_TEST_ASSERT(nk_group_create(host, &arg.noisy, 100) == NK_OK);
+  NK_TEST_ASSERT(nk_group_create(host, &arg.quiet, 300) == NK_OK);
+  NK_TEST_ASSERT(nk_group_set_weight(nk_host_root_group(host), 0) ==
+                 NK_ERR_PARAM);
+
+  arg.live = THD_GROUPS_FLOOD;
+  for (int i = 0; i < THD_GROUPS_FLOOD; i++) {
+    nk_dpc *d;
+    NK_TEST_ASSERT(nk_dpc_create_group(arg.noisy, &d, thd_groups_dpc, &arg) ==
+                   NK_OK);
+  }
+  for (int i = 0; i < THD_GROUPS_THREADS; i++) {
+    nk_thd *t;
+    NK_TEST_ASSERT(nk_thd_create_group(arg.quiet, &t, thd_groups_quiet,
+                                       &arg) == NK_OK);
+  }
+  nk_dpc *timer;
+  NK_TEST_ASSERT(nk_dpc_create_ext_at(host, &timer,
+                                      nk_now_ns() + THD_GROUPS_RUN_NS,
+                                      thd_groups_timer, &arg) == NK_OK);
+  nk_host_run(host, 1);
+
+  uint64_t noisy = nk_group_cpu_ns(arg.noisy);
+  uint64_t quiet = nk_group_cpu_ns(arg.quiet);
+  NK_TEST_ASSERT(arg.misgrouped == 0);
+  NK_TEST_ASSERT(arg.live == 0);
+  NK_TEST_ASSERT_FMT(quiet > 2 * noisy && quiet < 5 * noisy,
+                     "quiet group got %lu ns to the noisy group's %lu ns",
+                     (unsigned long)quiet, (unsigned long)noisy);
+  nk_host_destroy(host);
+
+  NK_TEST_OK();
+}
+
+// A thread computes for a long stretch without yielding, inside a preemptible
+// section, on a host with one host-thread: with preemption on, a second
+// thread still gets to run meanwhile, and the computation comes out right.
+#define THD_PREEMPT_NS 1000000ull
+#define THD_PREEMPT_RUN_NS 50000000ull
+
+struct thd_preempt_arg {
+  int done;
+  uint64_t sum;
+  int ran_during;
+  uint64_t longest_gap;
+};
+
+static void thd_preempt_hog(nk_thd *self, void *_arg) {
+  struct thd_preempt_arg *arg = _arg;
+  uint64_t end = nk_now_ns() + THD_PREEMPT_RUN_NS;
+  volatile uint64_t sum = 0;
+  uint64_t i = 0;
+  nk_preempt_enable();
+  // clock_gettime() is vDSO, and neither locks nor calls into nk.
+  while (nk_now_ns() < end) {
+    sum += i++;
+  }
+  nk_preempt_disable();
+  arg->sum = sum - i * (i - 1) / 2;
+  __atomic_store_n(&arg->done, 1, __ATOMIC_SEQ_CST);
+}
+
+static void thd_preempt_other(nk_thd *self, void *_arg) {
+  struct thd_preempt_arg *arg = _arg;
+  uint64_t last = nk_now_ns();
+  while (!__atomic_load_n(&arg->done, __ATOMIC_SEQ_CST)) {
+    uint64_t now = nk_now_ns();
+    if (now - last > arg->longest_gap) {
+      arg->longest_gap = now - last;
+    }
+    last = now;
+    arg->ran_during++;
+    nk_thd_yield();
+  }
+}
+
+NK_TEST(thd_preempt) {
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  attrs.preempt_ns = THD_PREEMPT_NS;
+  nk_host *host;
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_OK);
+  struct thd_preempt_arg arg = {0};
+  nk_thd *t;
+  NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_preempt_hog, &arg) == NK_OK);
+  NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_preempt_other, &arg) ==
+                 NK_OK);
+  nk_host_run(host, 1);
+  nk_host_destroy(host);
+
+  NK_TEST_ASSERT(arg.sum == 0);
+  // About one run per two or three periods.
+  NK_TEST_ASSERT_FMT(arg.ran_during >= 5, "other thread ran %d times",
+                     arg.ran_during);
+  NK_TEST_ASSERT_FMT(arg.longest_gap < THD_PREEMPT_RUN_NS / 2,
+                     "other thread waited %lu ns",
+                     (unsigned long)arg.longest_gap);
+
+  NK_TEST_OK();
+}
+
+// A thread that loops calling nk_thd_maybe_yield() yields about once per time
+// slice, not on every call; and at once when more urgent work comes in.
+#define THD_MAYBE_YIELD_SLICE_NS 100000ull
+#define THD_MAYBE_YIELD_RUN_NS 20000000ull
+
+struct thd_maybe_yield_arg {
+  nk_host *host;
+  int done;
+  uint64_t calls;
+  int other_runs;
+  uint64_t posted_at;
+  uint64_t urgent_delay;
+};
+
+static void thd_maybe_yield_loop(nk_thd *self, void *_arg) {
+  struct thd_maybe_yield_arg *arg = _arg;
+  uint64_t end = nk_now_ns() + THD_MAYBE_YIELD_RUN_NS;
+  while (nk_now_ns() < end) {
+    arg->calls++;
+    nk_thd_maybe_yield();
+  }
+  __atomic_store_n(&arg->done, 1, __ATOMIC_SEQ_CST);
+}
+
+static void thd_maybe_yield_other(nk_thd *self, void *_arg) {
+  struct thd_maybe_yield_arg *arg = _arg;
+  while (!__atomic_load_n(&arg->done, __ATOMIC_SEQ_CST)) {
+    arg->other_runs++;
+    nk_thd_yield();
+  }
+}
+
+static void thd_maybe_yield_urgent(void *_arg) {
+  struct thd_maybe_yield_arg *arg = _arg;
+  arg->urgent_delay = nk_now_ns() - arg->posted_at;
+}
+
+static void *thd_maybe_yield_poster(void *_arg) {
+  struct thd_maybe_yield_arg *arg = _arg;
+  struct timespec ts = {0, THD_MAYBE_YIELD_RUN_NS / 4};
+  nanosleep(&ts, NULL);
+  nk_dpc *d;
+  arg->posted_at = nk_now_ns();
+  nk_dpc_create_ext_prio(arg->host, &d, thd_maybe_yield_urgent, arg,
+                         NK_PRIO_HIGHEST);
+  return NULL;
+}
+
+NK_TEST(thd_maybe_yield) {
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  attrs.slice_ns = THD_MAYBE_YIELD_SLICE_NS;
+  struct thd_maybe_yield_arg arg = {0};
+  NK_TEST_ASSERT(nk_host_create_ext(&arg.host, &attrs) == NK_OK);
+  nk_thd *t;
+  NK_TEST_ASSERT(nk_thd_create_ext(arg.host, &t, thd_maybe_yield_loop, &arg) ==
+                 NK_OK);
+  NK_TEST_ASSERT(nk_thd_create_ext(arg.host, &t, thd_maybe_yield_other,
+                                   &arg) == NK_OK);
+  nk_host_run(arg.host, 1);
+  nk_host_destroy(arg.host);
+  uint64_t slices = THD_MAYBE_YIELD_RUN_NS / THD_MAYBE_YIELD_SLICE_NS;
+  NK_TEST_ASSERT_FMT(arg.other_runs >= slices / 4 &&
+                         arg.other_runs <= 2 * slices,
+                     "%d yields in %lu slices", arg.other_runs,
+                     (unsigned long)slices);
+  NK_TEST_ASSERT(arg.calls > 10 * (uint64_t)arg.other_runs);
+
+  // A slice long enough not to end during the run: only urgent work preempts.
+  memset(&arg, 0, sizeof(arg));
+  attrs.slice_ns = 10 * THD_MAYBE_YIELD_RUN_NS;
+  NK_TEST_ASSERT(nk_host_create_ext(&arg.host, &attrs) == NK_OK);
+  NK_TEST_ASSERT(nk_thd_create_ext(arg.host, &t, thd_maybe_yield_loop, &arg) ==
+                 NK_OK);
+  pthread_t poster;
+  NK_TEST_ASSERT(pthread_create(&poster, NULL, thd_maybe_yield_poster, &arg) ==
+                 0);
+  nk_host_run(arg.host, 1);
+  pthread_join(poster, NULL);
+  nk_host_destroy(arg.host);
+  NK_TEST_ASSERT(arg.posted_at != 0);
+  NK_TEST_ASSERT_FMT(arg.urgent_delay < THD_MAYBE_YIELD_RUN_NS / 4,
+                     "urgent DPC waited %lu ns",
+                     (unsigned long)arg.urgent_delay);
+
+  NK_TEST_OK();
+}
+
+#define THD_LAZY_STACKS_SHORT 1000
+#define THD_LAZY_STACKS_LONG 50
+
+struct thd_lazy_stacks_arg {
+  // Where each short-lived thread found a local variable.
+  uintptr_t where[THD_LAZY_STACKS_SHORT];
+  int next;
+  // Threads that found their stack data intact.
+  int ok;
+};
+
+static void thd_lazy_stacks_short(nk_thd *self, void *data) {
+  struct thd_lazy_stacks_arg *arg = data;
+  volatile int local = 1;
+  int i = __atomic_fetch_add(&arg->next, 1, __ATOMIC_RELAXED);
+  arg->where[i] = (uintptr_t)&local;
+  if (local == 1) {
+    __atomic_fetch_add(&arg->ok, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void thd_lazy_stacks_long(nk_thd *self, void *data) {
+  struct thd_lazy_stacks_arg *arg = data;
+  char buf[1024];
+  memset(buf, (int)(uintptr_t)&buf, sizeof(buf));
+  char c = buf[0];
+  for (int i = 0; i < 10; i++) {
+    if (i % 2) {
+      nk_thd_yield();
+    } else {
+      nk_thd_sleep(10000);
+    }
+  }
+  for (size_t i = 0; i < sizeof(buf); i++) {
+    if (buf[i] != c) {
+      return;
+    }
+  }
+  __atomic_fetch_add(&arg->ok, 1, __ATOMIC_RELAXED);
+}
+
+NK_TEST(thd_lazy_stacks) {
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  attrs.lazy_stacks = 1;
+  static struct thd_lazy_stacks_arg arg;
+  nk_host *host;
+  nk_thd *t;
+
+  // Threads that run to completion one after another share a stack or two.
+  memset(&arg, 0, sizeof(arg));
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_OK);
+  for (int i = 0; i < THD_LAZY_STACKS_SHORT; i++) {
+    NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_lazy_stacks_short, &arg) ==
+                   NK_OK);
+  }
+  nk_host_run(host, 1);
+  nk_host_destroy(host);
+  NK_TEST_ASSERT(arg.ok == THD_LAZY_STACKS_SHORT);
+  int distinct = 0;
+  for (int i = 0; i < THD_LAZY_STACKS_SHORT; i++) {
+    int seen = 0;
+    for (int j = 0; j < i && !seen; j++) {
+      seen = arg.where[j] == arg.where[i];
+    }
+    distinct += !seen;
+  }
+  NK_TEST_ASSERT_FMT(distinct <= 2, "%d distinct stacks", distinct);
+
+  // Threads that block keep their stacks, alongside others that come and go.
+  memset(&arg, 0, sizeof(arg));
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_OK);
+  for (int i = 0; i < THD_LAZY_STACKS_SHORT; i++) {
+    if (i % (THD_LAZY_STACKS_SHORT / THD_LAZY_STACKS_LONG) == 0) {
+      NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_lazy_stacks_long, &arg) ==
+                     NK_OK);
+    }
+    NK_TEST_ASSERT(nk_thd_create_ext(host, &t, thd_lazy_stacks_short, &arg) ==
+                   NK_OK);
+  }
+  nk_host_run(host, 4);
+  nk_host_destroy(host);
+  NK_TEST_ASSERT(arg.ok == THD_LAZY_STACKS_SHORT + THD_LAZY_STACKS_LONG);
+
+  NK_TEST_OK();
+}
+
+#define THD_STACK_CLASSES_THREADS 1000000
+#define THD_STACK_CLASSES_LIVE 10000
+#define THD_STACK_CLASSES_SMALL (8 * 1024)
+#define THD_STACK_CLASSES_BIG (1024 * 1024)
+
+struct thd_stack_classes_arg {
+  nk_host *host;
+  nk_thd_attrs attrs;
+  int touched, done;
+  // Peak resident set size seen, in bytes, and the stack used by the big
+  // thread.
+  size_t rss;
+  size_t big_used;
+};
+
+static void thd_stack_classes_small(nk_thd *self, void *data) {
+  struct thd_stack_classes_arg *arg = data;
+  // Most of the stack.
+  volatile char buf[THD_STACK_CLASSES_SMALL - 2048];
+  memset((char *)buf, 1, sizeof(buf));
+  if (++arg->touched % THD_STACK_CLASSES_LIVE == 0) {
+    // All of this wave is alive, each on a stack it has touched.
+    size_t rss = thd_rss();
+    if (rss > arg->rss) {
+      arg->rss = rss;
+    }
+  }
+  nk_thd_yield();
+  arg->done++;
+}
+
+static void thd_stack_classes_spawner(nk_thd *self, void *data) {
+  struct thd_stack_classes_arg *arg = data;
+  for (int i = 0; i < THD_STACK_CLASSES_THREADS;
+       i += THD_STACK_CLASSES_LIVE) {
+    for (int j = 0; j < THD_STACK_CLASSES_LIVE; j++) {
+      nk_thd *t;
+      if (nk_thd_create_ext_attrs(arg->host, &t, thd_stack_classes_small, arg,
+                                  &arg->attrs) != NK_OK) {
+        return;
+      }
+    }
+    while (arg->done < i + THD_STACK_CLASSES_LIVE) {
+      nk_thd_yield();
+    }
+  }
+}
+
+static void thd_stack_classes_big(nk_thd *self, void *data) {
+  struct thd_stack_classes_arg *arg = data;
+  volatile char buf[THD_STACK_CLASSES_BIG - 64 * 1024];
+  memset((char *)buf, 1, sizeof(buf));
+  arg->big_used = sizeof(buf);
+}
+
+NK_TEST(thd_stack_classes) {
+  static struct thd_stack_classes_arg arg;
+  nk_thd *t;
+  NK_TEST_ASSERT(nk_host_create(&arg.host) == NK_OK);
+
+  // No class holds this.
+  nk_thd_attrs_init(&arg.attrs);
+  arg.attrs.stack_size = NK_THD_STACK_CLASS_MAX;
+  NK_TEST_ASSERT(nk_thd_create_ext_attrs(arg.host, &t, thd_stack_classes_big,
+                                         &arg, &arg.attrs) == NK_ERR_PARAM);
+
+  // Nor is there room in this for the thread's first frame.
+  arg.attrs.stack_size = NK_THD_STACK_MIN - 1;
+  NK_TEST_ASSERT(nk_thd_create_ext_attrs(arg.host, &t, thd_stack_classes_big,
+                                         &arg, &arg.attrs) == NK_ERR_PARAM);
+  arg.attrs.stack_size = 0;
+  NK_TEST_ASSERT(nk_thd_create_ext_attrs(arg.host, &t, thd_stack_classes_big,
+                                         &arg, &arg.attrs) == NK_ERR_PARAM);
+
+  // A thread that needs a big stack gets one.
+  arg.attrs.stack_size = THD_STACK_CLASSES_BIG;
+  NK_TEST_ASSERT(nk_thd_create_ext_attrs(arg.host, &t, thd_stack_classes_big,
+                                         &arg, &arg.attrs) == NK_OK);
+  nk_host_run(arg.host, 1);
+  nk_host_destroy(arg.host);
+  NK_TEST_ASSERT(arg.big_used > 0);
+
+  // A million threads on small stacks, THD_STACK_CLASSES_LIVE at a time, stay
+  // within the resident memory their stacks need.
+  size_t base = thd_rss();
+  arg.attrs.stack_size = THD_STACK_CLASSES_SMALL;
+  arg.attrs.guard_size = 0;
+  NK_TEST_ASSERT(nk_host_create(&arg.host) == NK_OK);
+  NK_TEST_ASSERT(nk_thd_create_ext(arg.host, &t, thd_stack_classes_spawner,
+                                   &arg) == NK_OK);
+  nk_host_run(arg.host, 1);
+  nk_host_destroy(arg.host);
+  NK_TEST_ASSERT_FMT(arg.done == THD_STACK_CLASSES_THREADS, "%d threads ran",
+                     arg.done);
+  size_t budget = THD_STACK_CLASSES_LIVE * 2 * THD_STACK_CLASSES_SMALL +
+                  64 * 1024 * 1024;
+  NK_TEST_ASSERT_FMT(arg.rss - base < budget, "%lu bytes resident",
+                     (unsigned long)(arg.rss - base));
+
+  NK_TEST_OK();
+}
+
+#define THD_SHARED_STACKS_IDLE 4000
+#define THD_SHARED_STACKS_DEEP (32 * 1024)
+#define THD_SHARED_STACKS_BUSY 200
+#define THD_SHARED_STACKS_SLEEP 4
+
+struct thd_shared_stacks_arg {
+  nk_host *host;
+  nk_mutex *m;
+  nk_cond *c;
+  // Protected by m, but for the sleepers, which count themselves atomically.
+  int parked;
+  int go;
+  // Resident set size once all threads but the last have parked.
+  size_t rss;
+  // Threads that found their stack data intact.
+  int ok;
+};
+
+static __attribute__((noinline)) void thd_shared_stacks_deep() {
+  volatile char buf[THD_SHARED_STACKS_DEEP];
+  memset((char *)buf, 1, sizeof(buf));
+}
+
+// Goes deep once, then waits at a shallow depth for all the others.
+static void thd_shared_stacks_idle(nk_thd *self, void *data) {
+  struct thd_shared_stacks_arg *arg = data;
+  volatile uintptr_t mark = (uintptr_t)self;
+  thd_shared_stacks_deep();
+  nk_mutex_lock(arg->m);
+  if (++arg->parked == THD_SHARED_STACKS_IDLE) {
+    arg->rss = thd_rss();
+    arg->go = 1;
+    nk_cond_broadcast(arg->c);
+  }
+  while (!arg->go) {
+    nk_cond_wait(arg->c, arg->m);
+  }
+  nk_mutex_unlock(arg->m);
+  if (mark == (uintptr_t)self) {
+    __atomic_fetch_add(&arg->ok, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void thd_shared_stacks_sleep(nk_thd *self, void *data) {
+  struct thd_shared_stacks_arg *arg = data;
+  __atomic_fetch_add(&arg->parked, 1, __ATOMIC_SEQ_CST);
+  nk_thd_sleep(10 * 1000000000ull);
+  __atomic_fetch_add(&arg->ok, 1, __ATOMIC_RELAXED);
+}
+
+// Shuts the host down once the sleepers are all asleep.
+static void thd_shared_stacks_shutdown(nk_thd *self, void *data) {
+  struct thd_shared_stacks_arg *arg = data;
+  while (__atomic_load_n(&arg->parked, __ATOMIC_SEQ_CST) <
+         THD_SHARED_STACKS_SLEEP) {
+    nk_thd_yield();
+  }
+  nk_thd_sleep(1000000);
+  nk_host_shutdown(arg->host);
+}
+
+static void thd_shared_stacks_busy(nk_thd *self, void *data) {
+  struct thd_shared_stacks_arg *arg = data;
+  char buf[256];
+  memset(buf, (int)(uintptr_t)self, sizeof(buf));
+  for (int i = 0; i < 20; i++) {
+    if (i % 2) {
+      nk_thd_yield();
+    } else {
+      nk_thd_sleep(10000);
+    }
+    for (size_t j = 0; j < sizeof(buf); j++) {
+      if (buf[j] != (char)(uintptr_t)self) {
+        return;
+      }
+    }
+  }
+  __atomic_fetch_add(&arg->ok, 1, __ATOMIC_RELAXED);
+}
+
+// Runs THD_SHARED_STACKS_IDLE threads with the given attributes that all
+// wait at once. Returns how much resident memory grew.
+static size_t thd_shared_stacks_idle_run(struct thd_shared_stacks_arg *arg,
+                                         const nk_thd_attrs *attrs) {
+  memset(arg, 0, sizeof(*arg));
+  size_t base = thd_rss();
+  nk_host *host;
+  nk_thd *t;
+  if (nk_host_create(&host) != NK_OK ||
+      nk_mutex_create(host, &arg->m) != NK_OK ||
+      nk_cond_create(host, &arg->c) != NK_OK) {
+    return 0;
+  }
+  for (int i = 0; i < THD_SHARED_STACKS_IDLE; i++) {
+    if (nk_thd_create_ext_attrs(host, &t, thd_shared_stacks_idle, arg,
+                                attrs) != NK_OK) {
+      return 0;
+    }
+  }
+  nk_host_run(host, 1);
+  nk_cond_destroy(arg->c);
+  nk_mutex_destroy(arg->m);
+  nk_host_destroy(host);
+  return arg->rss > base ? arg->rss - base : 0;
+}
+
+NK_TEST(thd_shared_stacks) {
+  static struct thd_shared_stacks_arg arg;
+  nk_thd_attrs attrs;
+  nk_host *host;
+  nk_thd *t;
+
+  // Threads that wait at a shallow depth after going deep keep what they
+  // touched of a stack of their own, but not of a shared one. (A size class
+  // of their own, so that no stacks come ready-touched from the freelist.)
+  nk_thd_attrs_init(&attrs);
+  attrs.stack_size = 256 * 1024;
+  size_t own = thd_shared_stacks_idle_run(&arg, &attrs);
+  NK_TEST_ASSERT(arg.ok == THD_SHARED_STACKS_IDLE);
+  attrs.shared_stack = 1;
+  size_t shared = thd_shared_stacks_idle_run(&arg, &attrs);
+  NK_TEST_ASSERT(arg.ok == THD_SHARED_STACKS_IDLE);
+  NK_TEST_ASSERT_FMT(own > THD_SHARED_STACKS_IDLE * THD_SHARED_STACKS_DEEP &&
+                         shared < own / 8,
+                     "%lu bytes resident on own stacks, %lu on shared",
+                     (unsigned long)own, (unsigned long)shared);
+
+  // Threads that switch often, on several host-threads, keep their stack
+  // data -- and cannot be moved.
+  memset(&arg, 0, sizeof(arg));
+  NK_TEST_ASSERT(nk_host_create(&host) == NK_OK);
+  for (int i = 0; i < THD_SHARED_STACKS_BUSY; i++) {
+    NK_TEST_ASSERT(nk_thd_create_ext_attrs(host, &t, thd_shared_stacks_busy,
+                                           &arg, &attrs) == NK_OK);
+  }
+  NK_TEST_ASSERT(nk_thd_set_affinity(t, 0) == NK_ERR_PARAM);
+  nk_host_run(host, 4);
+  nk_host_destroy(host);
+  NK_TEST_ASSERT(arg.ok == THD_SHARED_STACKS_BUSY);
+
+  // Threads asleep on shared stacks when the host shuts down are destroyed
+  // after their host-threads.
+  memset(&arg, 0, sizeof(arg));
+  NK_TEST_ASSERT(nk_host_create(&arg.host) == NK_OK);
+  for (int i = 0; i < THD_SHARED_STACKS_SLEEP; i++) {
+    NK_TEST_ASSERT(nk_thd_create_ext_attrs(arg.host, &t,
+                                           thd_shared_stacks_sleep, &arg,
+                                           &attrs) == NK_OK);
+  }
+  NK_TEST_ASSERT(nk_thd_create_ext(arg.host, &t, thd_shared_stacks_shutdown,
+                                   &arg) == NK_OK);
+  nk_host_run(arg.host, 2);
+  nk_host_destroy(arg.host);
+  NK_TEST_ASSERT(arg.parked == THD_SHARED_STACKS_SLEEP && arg.ok == 0);
+
+  // Not without shared stacks.
+  nk_host_attrs host_attrs;
+  nk_host_attrs_init(&host_attrs);
+  host_attrs.shared_stacks = 0;
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &host_attrs) == NK_OK);
+  NK_TEST_ASSERT(nk_thd_create_ext_attrs(host, &t, thd_shared_stacks_busy,
+                                         &arg, &attrs) == NK_ERR_PARAM);
+  nk_host_destroy(host);
+
+  NK_TEST_OK();
+}
+
+// More than vm.max_map_count (65530 by default) allows with a mapping and a
+// guard per stack.
+#define THD_STACK_ARENA_THREADS 40000
+
+// vm.max_map_count, or its default if it cannot be read.
+static int thd_stack_arena_max_maps() {
+  FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+  int n = 65530;
+  if (f) {
+    if (fscanf(f, "%d", &n) != 1) {
+      n = 65530;
+    }
+    fclose(f);
+  }
+  return n;
+}
+
+static int thd_stack_arena_maps() {
+  FILE *f = fopen("/proc/self/maps", "r");
+  int n = 0;
+  if (f) {
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+      n += c == '\n';
+    }
+    fclose(f);
+  }
+  return n;
+}
+
+static void thd_stack_arena_thd(nk_thd *self, void *data) {
+  int *ran = data;
+  __atomic_fetch_add(ran, 1, __ATOMIC_RELAXED);
+}
+
+NK_TEST(thd_stack_arena) {
+  // Does the kernel have guard markers? Without them, every guard splits the
+  // arena.
+  char *p = mmap(NULL, 2 * 4096, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  NK_TEST_ASSERT(p != MAP_FAILED);
+  int markers = !madvise(p, 4096, 102 /* MADV_GUARD_INSTALL */);
+  munmap(p, 2 * 4096);
+  // Without them, stay well within the limit on mappings: up to two per
+  // stack.
+  int threads = THD_STACK_ARENA_THREADS;
+  if (!markers && threads > thd_stack_arena_max_maps() / 4) {
+    threads = thd_stack_arena_max_maps() / 4;
+  }
+
+  nk_host *host;
+  nk_thd *t;
+  static int ran;
+  ran = 0;
+  nk_thd_attrs attrs;
+  nk_thd_attrs_init(&attrs);
+  attrs.stack_size = 8 * 1024;
+  NK_TEST_ASSERT(nk_host_create(&host) == NK_OK);
+  int maps = thd_stack_arena_maps();
+  for (int i = 0; i < threads; i++) {
+    NK_TEST_ASSERT(nk_thd_create_ext_attrs(host, &t, thd_stack_arena_thd, &ran,
+                                           &attrs) == NK_OK);
+  }
+  if (markers) {
+    int added = thd_stack_arena_maps() - maps;
+    NK_TEST_ASSERT_FMT(added < 100, "%d mappings for %d stacks", added,
+                       THD_STACK_ARENA_THREADS);
+  }
+  nk_host_run(host, 1);
+  nk_host_destroy(host);
+  NK_TEST_ASSERT(ran == threads);
+
+  NK_TEST_OK();
+}
+
+#define THD_STACK_TRIM_THREADS 200
+#define THD_STACK_TRIM_DEPTH (512 * 1024)
+
+static void thd_stack_trim_thd(nk_thd *self, void *data) {
+  volatile char buf[THD_STACK_TRIM_DEPTH];
+  memset((char *)buf, 1, sizeof(buf));
+}
+
+// Runs THD_STACK_TRIM_THREADS threads, all with stacks at once, that each
+// touch THD_STACK_TRIM_DEPTH of them, on a host with the given reclaim policy.
+static void thd_stack_trim_run(int reclaim) {
+  nk_host_attrs host_attrs;
+  nk_host_attrs_init(&host_attrs);
+  host_attrs.stack_reclaim = reclaim;
+  nk_thd_attrs attrs;
+  nk_thd_attrs_init(&attrs);
+  // A size class of their own.
+  attrs.stack_size = 1024 * 1024 - 4096;
+  nk_host *host;
+  nk_thd *t;
+  if (nk_host_create_ext(&host, &host_attrs) != NK_OK) {
+    return;
+  }
+  for (int i = 0; i < THD_STACK_TRIM_THREADS; i++) {
+    if (nk_thd_create_ext_attrs(host, &t, thd_stack_trim_thd, NULL, &attrs) !=
+        NK_OK) {
+      break;
+    }
+  }
+  nk_host_run(host, 1);
+  nk_host_destroy(host);
+}
+
+// Threads that exit on a running host leave their stacks in its host-thread's
+// cache, THD_STACK_TRIM_CACHED of them: no more than the cache keeps.
+#define THD_STACK_TRIM_CACHED 16
+#define THD_STACK_TRIM_CACHED_SIZE (64 * 1024)
+
+struct thd_stack_trim_arg {
+  nk_host *host;
+  int exited;
+  // Stack bytes committed right after trimming, and once the host-thread got
+  // to trim its cache.
+  size_t before, after;
+};
+
+static void thd_stack_trim_cached_thd(nk_thd *self, void *data) {
+  struct thd_stack_trim_arg *arg = data;
+  volatile char buf[THD_STACK_TRIM_CACHED_SIZE / 2];
+  memset((char *)buf, 1, sizeof(buf));
+  arg->exited++;
+}
+
+static void thd_stack_trim_cached_main(nk_thd *self, void *data) {
+  struct thd_stack_trim_arg *arg = data;
+  nk_thd_attrs attrs;
+  nk_thd_attrs_init(&attrs);
+  attrs.stack_size = THD_STACK_TRIM_CACHED_SIZE - 4096;
+  nk_thd *t;
+  for (int i = 0; i < THD_STACK_TRIM_CACHED; i++) {
+    if (nk_thd_create_ext_attrs(arg->host, &t, thd_stack_trim_cached_thd, arg,
+                                &attrs) != NK_OK) {
+      return;
+    }
+  }
+  while (arg->exited < THD_STACK_TRIM_CACHED) {
+    nk_thd_yield();
+  }
+  nk_host_stats stats;
+  nk_host_trim_stacks(arg->host);
+  nk_host_get_stats(arg->host, &stats);
+  arg->before = stats.stack_committed;
+  // Our host-thread trims its cache before it runs us again.
+  nk_thd_yield();
+  nk_host_get_stats(arg->host, &stats);
+  arg->after = stats.stack_committed;
+}
+
+// How much resident memory grew since `base`. (Trimming may give back more
+// than was added since.)
+static size_t thd_stack_trim_grown(size_t base) {
+  size_t rss = thd_rss();
+  return rss > base ? rss - base : 0;
+}
+
+NK_TEST(thd_stack_trim) {
+  nk_host *host;
+  nk_host_stats stats;
+  nk_host_attrs attrs;
+  nk_host_attrs_init(&attrs);
+  attrs.stack_reclaim = NK_STACK_RECLAIM_EAGER + 1;
+  NK_TEST_ASSERT(nk_host_create_ext(&host, &attrs) == NK_ERR_PARAM);
+  NK_TEST_ASSERT(nk_host_create(&host) == NK_OK);
+
+  // Free stacks keep what their threads touched...
+  size_t base = thd_rss();
+  thd_stack_trim_run(NK_STACK_RECLAIM_NONE);
+  size_t grown = thd_stack_trim_grown(base);
+  NK_TEST_ASSERT_FMT(grown > 50 * 1024 * 1024, "%lu bytes resident",
+                     (unsigned long)grown);
+  nk_host_get_stats(host, &stats);
+  NK_TEST_ASSERT(stats.stack_reserved > 0);
+  NK_TEST_ASSERT(stats.stack_committed <= stats.stack_reserved);
+  size_t committed = stats.stack_committed;
+
+  // ...until trimmed.
+  nk_host_trim_stacks(host);
+  grown = thd_stack_trim_grown(base);
+  NK_TEST_ASSERT_FMT(grown < 20 * 1024 * 1024, "%lu bytes resident",
+                     (unsigned long)grown);
+  nk_host_get_stats(host, &stats);
+  NK_TEST_ASSERT_FMT(committed - stats.stack_committed >=
+                         (size_t)THD_STACK_TRIM_THREADS * 1024 * 1024,
+                     "%lu bytes committed, down from %lu",
+                     (unsigned long)stats.stack_committed,
+                     (unsigned long)committed);
+  committed = stats.stack_committed;
+
+  // Or given back as they are freed, all but the top of each.
+  base = thd_rss();
+  thd_stack_trim_run(NK_STACK_RECLAIM_EAGER);
+  grown = thd_stack_trim_grown(base);
+  NK_TEST_ASSERT_FMT(grown < 20 * 1024 * 1024, "%lu bytes resident",
+                     (unsigned long)grown);
+  nk_host_get_stats(host, &stats);
+  NK_TEST_ASSERT_FMT(stats.stack_committed - committed <
+                         (size_t)THD_STACK_TRIM_THREADS * 64 * 1024,
+                     "%lu bytes committed, up from %lu",
+                     (unsigned long)stats.stack_committed,
+                     (unsigned long)committed);
+
+  // Lazily too; the kernel takes the pages back when it needs them.
+  nk_host_trim_stacks(host);
+  nk_host_get_stats(host, &stats);
+  committed = stats.stack_committed;
+  thd_stack_trim_run(NK_STACK_RECLAIM_LAZY);
+  nk_host_get_stats(host, &stats);
+  NK_TEST_ASSERT_FMT(stats.stack_committed - committed <
+                         (size_t)THD_STACK_TRIM_THREADS * 64 * 1024,
+                     "%lu bytes committed, up from %lu",
+                     (unsigned long)stats.stack_committed,
+                     (unsigned long)committed);
+
+  nk_host_destroy(host);
+
+  // Stacks cached on the host-threads of a running host are trimmed too.
+  struct thd_stack_trim_arg arg = {0};
+  NK_TEST_ASSERT(nk_host_create(&arg.host) == NK_OK);
+  nk_thd *t;
+  NK_TEST_ASSERT(nk_thd_create_ext(arg.host, &t, thd_stack_trim_cached_main,
+                                   &arg) == NK_OK);
+  nk_host_run(arg.host, 1);
+  nk_host_destroy(arg.host);
+  NK_TEST_ASSERT(arg.exited == THD_STACK_TRIM_CACHED);
+  NK_TEST_ASSERT_FMT(arg.before - arg.after >=
+                         THD_STACK_TRIM_CACHED * THD_STACK_TRIM_CACHED_SIZE / 2,
+                     "%lu bytes committed, down from %lu",
+                     (unsigned long)arg.after, (unsigned long)arg.before);
+
+  NK_TEST_OK();
+}
+
+#define THD_SPAWN_SCALING_THREADS 64000
+#define THD_SPAWN_SCALING_BATCH 64
+#define THD_SPAWN_SCALING_MAX_WORKERS 32
+
+struct thd_spawn_scaling_arg {
+  int spawns;
+  int done;
+  int ok;
+};
+
+static void thd_spawn_scaling_child(nk_thd *self, void *data) {
+  struct thd_spawn_scaling_arg *arg = data;
+  __atomic_fetch_add(&arg->done, 1, __ATOMIC_RELAXED);
+}
+
+// Creates its share of threads, from within the host so that they get their
+// stacks from this host-thread's stack cache, a batch at a time.
+static void thd_spawn_scaling_spawner(nk_thd *self, void *data) {
+  struct thd_spawn_scaling_arg *arg = data;
+  for (int i = 0; i < arg->spawns; i += THD_SPAWN_SCALING_BATCH) {
+    for (int j = 0; j < THD_SPAWN_SCALING_BATCH; j++) {
+      nk_thd *t;
+      if (nk_thd_create(&t, thd_spawn_scaling_child, arg) != NK_OK) {
+        return;
+      }
+    }
+    while (__atomic_load_n(&arg->done, __ATOMIC_RELAXED) <
+           i + THD_SPAWN_SCALING_BATCH) {
+      nk_thd_yield();
+    }
+  }
+  arg->ok = 1;
+}
+
+// Returns how many threads per second were created and ran to exit with the
+// given number of workers, each with a spawner of its own; or 0 on failure.
+static uint64_t thd_spawn_scaling_run(int workers) {
+  static struct thd_spawn_scaling_arg args[THD_SPAWN_SCALING_MAX_WORKERS];
+  nk_host *host;
+  nk_thd *t;
+  if (nk_host_create(&host) != NK_OK) {
+    return 0;
+  }
+  for (int i = 0; i < workers; i++) {
+    memset(&args[i], 0, sizeof(args[i]));
+    args[i].spawns = THD_SPAWN_SCALING_THREADS / workers;
+    if (nk_thd_create_ext(host, &t, thd_spawn_scaling_spawner, &args[i]) !=
+            NK_OK ||
+        nk_thd_set_affinity(t, i) != NK_OK) {
+      return 0;
+    }
+  }
+  uint64_t start = nk_now_ns();
+  nk_host_run(host, workers);
+  uint64_t elapsed = nk_now_ns() - start;
+  nk_host_destroy(host);
+  for (int i = 0; i < workers; i++) {
+    if (!args[i].ok) {
+      return 0;
+    }
+  }
+  return THD_SPAWN_SCALING_THREADS * 1000000000ull / (elapsed ? elapsed : 1);
+}
+
+NK_TEST(thd_spawn_scaling) {
+  char report[256];
+  int len = 0;
+  for (int workers = 1; workers <= THD_SPAWN_SCALING_MAX_WORKERS;
+       workers *= 2) {
+    uint64_t rate = thd_spawn_scaling_run(workers);
+    NK_TEST_ASSERT_FMT(rate > 0, "spawn/exit failed with %d workers", workers);
+    len += snprintf(report + len, sizeof(report) - len, "%s%d: %lu/s",
+                    len ? ", " : "", workers, (unsigned long)rate);
+  }
+  // (Scaling shows only with as many CPUs as workers.)
+  nk_test_error_report(__test_out, "spawn/exit by workers: %s\n", report);
+
+  NK_TEST_OK();
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2016, Chris Fallin <cfallin@c1f.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+#include "nk/timer.h"
+
+#define TICK (1ull << NK_TIMER_TICK_SHIFT)
+
+// Advances the wheel to `now` and returns how many timers expired, checking
+// that none expired early.
+static int timer_advance(nk_timer_wheel *w, uint64_t now, int *early) {
+  queue_head expired;
+  QUEUE_INIT(&expired);
+  nk_timer_wheel_advance(w, now, &expired);
+  int n = 0;
+  nk_timer *t;
+  while ((t = nk_timer_link_shift(&expired)) != NULL) {
+    if (t->deadline > now) {
+      (*early)++;
+    }
+    n++;
+  }
+  return n;
+}
+
+NK_TEST(timer_wheel_expiry) {
+  nk_timer_wheel *w = NK_ALLOC(nk_timer_wheel);
+  uint64_t start = 1000 * TICK + 123;
+  nk_timer_wheel_init(w, start);
+  NK_TEST_ASSERT(nk_timer_wheel_next(w) == UINT64_MAX);
+
+  // Deadlines spread over every level, plus one beyond the wheel's span.
+  static const uint64_t delays[] = {
+      1,         TICK / 2,    TICK,           5 * TICK,
+      63 * TICK,   64 * TICK, 65 * TICK,   4095 * TICK,    4097 * TICK,
+      300000 * TICK, 20000000 * TICK, (1ull << 30) * TICK, (1ull << 33) * TICK,
+  };
+  int n = sizeof(delays) / sizeof(delays[0]);
+  nk_timer *timers = NK_ALLOCN(nk_timer, n);
+  int added = 0;
+  for (int i = 0; i < n; i++) {
+    timers[i].deadline = start + delays[i];
+    added += nk_timer_wheel_add(w, &timers[i]);
+  }
+  NK_TEST_ASSERT(added == n);
+  // A deadline before the current tick is refused.
+  nk_timer past;
+  past.deadline = start - 2 * TICK;
+  NK_TEST_ASSERT(!nk_timer_wheel_add(w, &past));
+
+  // Step from one expiry to the next; each timer expires exactly once, and
+  // never early.
+  int early = 0, expired = 0;
+  uint64_t now = start;
+  while (expired < added) {
+    uint64_t next = nk_timer_wheel_next(w);
+    NK_TEST_ASSERT(next != UINT64_MAX);
+    NK_TEST_ASSERT(next >= now - TICK);
+    for (int i = 0; i < n; i++) {
+      // The next expiry is never later than any pending deadline's tick.
+      NK_TEST_ASSERT(!timers[i].pending || next < timers[i].deadline + TICK);
+    }
+    now = next > now ? next : now + TICK;
+    expired += timer_advance(w, now, &early);
+  }
+  NK_TEST_ASSERT(early == 0);
+  NK_TEST_ASSERT(expired == added);
+  NK_TEST_ASSERT(nk_timer_wheel_next(w) == UINT64_MAX);
+
+  NK_FREE(timers);
+  NK_FREE(w);
+  NK_TEST_OK();
+}
+
+NK_TEST(timer_wheel_remove) {
+  nk_timer_wheel *w = NK_ALLOC(nk_timer_wheel);
+  nk_timer_wheel_init(w, 0);
+  nk_timer a, b, c;
+  a.deadline = 10 * TICK;
+  b.deadline = 10 * TICK;
+  c.deadline = 5000 * TICK;
+  NK_TEST_ASSERT(nk_timer_wheel_add(w, &a));
+  NK_TEST_ASSERT(nk_timer_wheel_add(w, &b));
+  NK_TEST_ASSERT(nk_timer_wheel_add(w, &c));
+  NK_TEST_ASSERT(nk_timer_wheel_next(w) == 10 * TICK);
+
+  nk_timer_wheel_remove(w, &a);
+  NK_TEST_ASSERT(!a.pending);
+  NK_TEST_ASSERT(nk_timer_wheel_next(w) == 10 * TICK);
+  nk_timer_wheel_remove(w, &b);
+  // Only the level-1 timer is left: the next event is its cascade.
+  NK_TEST_ASSERT(nk_timer_wheel_next(w) > 10 * TICK);
+  NK_TEST_ASSERT(nk_timer_wheel_next(w) <= c.deadline);
+
+  int early = 0;
+  NK_TEST_ASSERT(timer_advance(w, 4999 * TICK, &early) == 0);
+  NK_TEST_ASSERT(c.pending);
+  NK_TEST_ASSERT(nk_timer_wheel_next(w) == c.deadline);
+  NK_TEST_ASSERT(timer_advance(w, c.deadline, &early) == 1);
+  NK_TEST_ASSERT(early == 0);
+
+  // Draining empties the wheel.
+  NK_TEST_ASSERT(nk_timer_wheel_add(w, &a) == 0); // already past.
+  a.deadline = 1ull << 40;
+  NK_TEST_ASSERT(nk_timer_wheel_add(w, &a));
+  queue_head out;
+  QUEUE_INIT(&out);
+  nk_timer_wheel_drain(w, &out);
+  NK_TEST_ASSERT(nk_timer_link_shift(&out) == &a);
+  NK_TEST_ASSERT(nk_timer_link_empty(&out));
+  NK_TEST_ASSERT(nk_timer_wheel_next(w) == UINT64_MAX);
+
+  NK_FREE(w);
+  NK_TEST_OK();
+}